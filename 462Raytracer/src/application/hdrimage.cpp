@@ -0,0 +1,317 @@
+/**
+ * @file hdrimage.cpp
+ * @brief Float images, their output and tone mapping
+ *
+ * Images are stored bottom row first, like the gl buffers they are shown
+ * with.
+ */
+
+#include "application/hdrimage.hpp"
+#include "application/imageio.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace _462 {
+
+ToneMap default_tonemap()
+{
+    ToneMap tonemap = { 0, 1 };
+    return tonemap;
+}
+
+/**
+ * Converts float colors to 4-byte RGBA with alpha 1.0: scales them by the
+ * exposure, applies the gamma and clamps them.
+ * @param colors The colors to convert.
+ * @param buffer Output, 4 bytes per color.
+ * @param count Number of colors.
+ */
+void tonemap_image( const Color3* colors, unsigned char* buffer, size_t count, const ToneMap& tonemap )
+{
+    real_t scale = std::pow( real_t( 2 ), tonemap.exposure );
+    real_t inv_gamma = real_t( 1 ) / tonemap.gamma;
+    bool linear = tonemap.gamma == 1;
+#ifdef OPENMP
+#pragma omp parallel for
+#endif
+    for ( long i = 0; i < (long)count; ++i ) {
+        Color3 c = colors[i] * scale;
+        if ( !linear ) {
+            c.r = std::pow( std::max( c.r, real_t( 0 ) ), inv_gamma );
+            c.g = std::pow( std::max( c.g, real_t( 0 ) ), inv_gamma );
+            c.b = std::pow( std::max( c.b, real_t( 0 ) ), inv_gamma );
+        }
+        c.to_array4( &buffer[4 * i] );
+    }
+}
+
+static void put_u32( std::vector< unsigned char >& out, uint32_t v )
+{
+    for ( int i = 0; i < 4; ++i )
+        out.push_back( (unsigned char)( v >> ( 8 * i ) ) );
+}
+
+static void put_u64( std::vector< unsigned char >& out, uint64_t v )
+{
+    for ( int i = 0; i < 8; ++i )
+        out.push_back( (unsigned char)( v >> ( 8 * i ) ) );
+}
+
+static void put_f32( std::vector< unsigned char >& out, float f )
+{
+    uint32_t v;
+    memcpy( &v, &f, 4 );
+    put_u32( out, v );
+}
+
+static void put_u16( std::vector< unsigned char >& out, uint16_t v )
+{
+    out.push_back( (unsigned char)v );
+    out.push_back( (unsigned char)( v >> 8 ) );
+}
+
+static void put_string( std::vector< unsigned char >& out, const char* s )
+{
+    out.insert( out.end(), s, s + strlen( s ) + 1 );
+}
+
+static bool write_file( const char* filename, const std::vector< unsigned char >& bytes )
+{
+    FILE* file = fopen( filename, "wb" );
+    if ( !file )
+        return false;
+    bool ok = bytes.empty() || fwrite( &bytes[0], bytes.size(), 1, file ) == 1;
+    return fclose( file ) == 0 && ok;
+}
+
+/**
+ * Writes a little endian PFM file, 3 floats per pixel.
+ * @return False if the file can not be written, otherwise return True.
+ */
+bool hdr_save_pfm( const char* filename, const Color3* colors, int width, int height )
+{
+    char header[64];
+    snprintf( header, sizeof( header ), "PF\n%d %d\n-1.0\n", width, height );
+    std::vector< unsigned char > bytes( header, header + strlen( header ) );
+    bytes.reserve( bytes.size() + 12 * size_t( width ) * height );
+    // pfm rows go from bottom to top as well
+    for ( size_t i = 0; i < size_t( width ) * height; ++i ) {
+        put_f32( bytes, float( colors[i].r ) );
+        put_f32( bytes, float( colors[i].g ) );
+        put_f32( bytes, float( colors[i].b ) );
+    }
+    return write_file( filename, bytes );
+}
+
+// rounds to the nearest half, ties to even; too large values become infinite
+static uint16_t float_to_half( float f )
+{
+    uint32_t x;
+    memcpy( &x, &f, 4 );
+    uint32_t sign = ( x >> 16 ) & 0x8000;
+    uint32_t bits = ( x >> 23 ) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+    int exp = int( bits ) - 127 + 15;
+
+    if ( bits == 0xff )
+        return uint16_t( sign | 0x7c00 | ( mant ? 0x200 : 0 ) );
+    if ( exp >= 31 )
+        return uint16_t( sign | 0x7c00 );
+    if ( exp <= 0 ) {
+        // denormal half, or zero
+        if ( exp < -10 )
+            return uint16_t( sign );
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rest = mant & ( ( 1u << shift ) - 1 );
+        uint32_t halfway = 1u << ( shift - 1 );
+        if ( rest > halfway || ( rest == halfway && ( half & 1 ) ) )
+            half++;
+        return uint16_t( sign | half );
+    }
+
+    uint32_t half = sign | ( uint32_t( exp ) << 10 ) | ( mant >> 13 );
+    uint32_t rest = mant & 0x1fff;
+    // a carry out of the mantissa correctly bumps the exponent
+    if ( rest > 0x1000 || ( rest == 0x1000 && ( half & 1 ) ) )
+        half++;
+    return uint16_t( half );
+}
+
+static bool channel_less( const ExrChannel& a, const ExrChannel& b )
+{
+    return a.name < b.name;
+}
+
+/**
+ * Adds the R, G and B channels of the colors, named layer.R and so on, or
+ * just R, G and B for an empty layer.
+ */
+void exr_add_colors( std::vector< ExrChannel >* channels, const std::string& layer,
+                     const Color3* colors, size_t count, bool half )
+{
+    const char* names[3] = { "R", "G", "B" };
+    for ( int c = 0; c < 3; ++c ) {
+        ExrChannel channel;
+        channel.name = layer.empty() ? names[c] : layer + "." + names[c];
+        channel.half = half;
+        channel.values.resize( count );
+        for ( size_t i = 0; i < count; ++i )
+            channel.values[i] = float( colors[i][c] );
+        channels->push_back( channel );
+    }
+}
+
+/**
+ * Writes an uncompressed scanline OpenEXR file with R, G and B channels.
+ * @param half Store 16-bit half floats instead of 32-bit floats.
+ * @return False if the file can not be written, otherwise return True.
+ */
+bool hdr_save_exr( const char* filename, const Color3* colors, int width, int height, bool half )
+{
+    std::vector< ExrChannel > channels;
+    exr_add_colors( &channels, "", colors, size_t( width ) * height, half );
+    return hdr_save_exr_channels( filename, channels, width, height );
+}
+
+/**
+ * Writes an uncompressed scanline OpenEXR file with any channels, each
+ * holding width * height values.
+ * @return False if the file can not be written, otherwise return True.
+ */
+bool hdr_save_exr_channels( const char* filename, std::vector< ExrChannel > channels, int width, int height )
+{
+    // exr pixel types
+    const uint32_t EXR_HALF = 1, EXR_FLOAT = 2;
+
+    // channels are listed and stored in alphabetical order
+    std::sort( channels.begin(), channels.end(), channel_less );
+
+    std::vector< unsigned char > bytes;
+    put_u32( bytes, 20000630 );
+    put_u32( bytes, 2 );
+
+    size_t chlist_size = 1;
+    size_t line_size = 0;
+    for ( size_t c = 0; c < channels.size(); ++c ) {
+        chlist_size += channels[c].name.size() + 1 + 16;
+        line_size += ( channels[c].half ? 2 : 4 ) * size_t( width );
+    }
+    put_string( bytes, "channels" );
+    put_string( bytes, "chlist" );
+    put_u32( bytes, uint32_t( chlist_size ) );
+    for ( size_t c = 0; c < channels.size(); ++c ) {
+        put_string( bytes, channels[c].name.c_str() );
+        put_u32( bytes, channels[c].half ? EXR_HALF : EXR_FLOAT );
+        // pLinear and reserved bytes
+        put_u32( bytes, 0 );
+        put_u32( bytes, 1 );
+        put_u32( bytes, 1 );
+    }
+    bytes.push_back( 0 );
+
+    put_string( bytes, "compression" );
+    put_string( bytes, "compression" );
+    put_u32( bytes, 1 );
+    bytes.push_back( 0 );
+
+    for ( int w = 0; w < 2; ++w ) {
+        put_string( bytes, w == 0 ? "dataWindow" : "displayWindow" );
+        put_string( bytes, "box2i" );
+        put_u32( bytes, 16 );
+        put_u32( bytes, 0 );
+        put_u32( bytes, 0 );
+        put_u32( bytes, uint32_t( width - 1 ) );
+        put_u32( bytes, uint32_t( height - 1 ) );
+    }
+
+    put_string( bytes, "lineOrder" );
+    put_string( bytes, "lineOrder" );
+    put_u32( bytes, 1 );
+    bytes.push_back( 0 );
+
+    put_string( bytes, "pixelAspectRatio" );
+    put_string( bytes, "float" );
+    put_u32( bytes, 4 );
+    put_f32( bytes, 1.0f );
+
+    put_string( bytes, "screenWindowCenter" );
+    put_string( bytes, "v2f" );
+    put_u32( bytes, 8 );
+    put_f32( bytes, 0.0f );
+    put_f32( bytes, 0.0f );
+
+    put_string( bytes, "screenWindowWidth" );
+    put_string( bytes, "float" );
+    put_u32( bytes, 4 );
+    put_f32( bytes, 1.0f );
+
+    bytes.push_back( 0 );
+
+    // one scanline per block, the table gives the offset of each
+    size_t table_start = bytes.size();
+    size_t data_start = table_start + 8 * size_t( height );
+    for ( int y = 0; y < height; ++y )
+        put_u64( bytes, data_start + size_t( y ) * ( 8 + line_size ) );
+
+    bytes.reserve( data_start + size_t( height ) * ( 8 + line_size ) );
+    for ( int y = 0; y < height; ++y ) {
+        put_u32( bytes, uint32_t( y ) );
+        put_u32( bytes, uint32_t( line_size ) );
+        // exr rows go from top to bottom
+        size_t row = size_t( height - 1 - y ) * width;
+        for ( size_t c = 0; c < channels.size(); ++c ) {
+            const float* values = &channels[c].values[row];
+            for ( int x = 0; x < width; ++x ) {
+                if ( channels[c].half )
+                    put_u16( bytes, float_to_half( values[x] ) );
+                else
+                    put_f32( bytes, values[x] );
+            }
+        }
+    }
+    return write_file( filename, bytes );
+}
+
+static bool has_extension( const char* filename, const char* ext )
+{
+    size_t n = strlen( filename ), m = strlen( ext );
+    if ( n < m )
+        return false;
+    for ( size_t i = 0; i < m; ++i ) {
+        if ( tolower( filename[n - m + i] ) != ext[i] )
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Writes a render, picking the format by the extension of the file:
+ * .pfm and .exr keep the float colors, anything else is tone mapped to
+ * bytes and written as png.
+ * @param exr_half Store half floats in exr files instead of floats.
+ * @param png_level The zlib level of png files, see PNG_DEFAULT_LEVEL.
+ * @return False if the file can not be written, otherwise return True.
+ */
+bool save_render( const char* filename, const Color3* colors, int width, int height,
+                  const ToneMap& tonemap, bool exr_half, int png_level )
+{
+    if ( has_extension( filename, ".pfm" ) )
+        return hdr_save_pfm( filename, colors, width, height );
+    if ( has_extension( filename, ".exr" ) )
+        return hdr_save_exr( filename, colors, width, height, exr_half );
+
+    std::vector< unsigned char > buffer( 4 * size_t( width ) * height );
+    tonemap_image( colors, &buffer[0], size_t( width ) * height, tonemap );
+    return imageio_save_image( filename, &buffer[0], width, height, png_level );
+}
+
+} /* _462 */
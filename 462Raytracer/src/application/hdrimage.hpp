@@ -0,0 +1,54 @@
+/**
+ * @file hdrimage.hpp
+ * @brief Float images, their output and tone mapping
+ *
+ * Renders are kept as float colors until they are written. PFM and EXR
+ * files store them as they are, other formats go through the tone map,
+ * which is the only place colors are rounded to bytes.
+ */
+
+#ifndef _462_APPLICATION_HDRIMAGE_HPP_
+#define _462_APPLICATION_HDRIMAGE_HPP_
+
+#include "math/color.hpp"
+
+#include <string>
+#include <vector>
+
+namespace _462 {
+
+struct ToneMap
+{
+    // scales the colors by 2^exposure
+    real_t exposure;
+    // display gamma, 1 leaves the colors linear
+    real_t gamma;
+};
+
+// exposure 0 and gamma 1, the colors are only clamped
+ToneMap default_tonemap();
+
+void tonemap_image( const Color3* colors, unsigned char* buffer, size_t count, const ToneMap& tonemap );
+
+// one channel of a multi-channel exr file, bottom row first
+struct ExrChannel
+{
+    std::string name;
+    std::vector< float > values;
+    // stored as 16-bit half floats instead of 32-bit floats
+    bool half;
+};
+
+void exr_add_colors( std::vector< ExrChannel >* channels, const std::string& layer,
+                     const Color3* colors, size_t count, bool half );
+
+bool hdr_save_pfm( const char* filename, const Color3* colors, int width, int height );
+bool hdr_save_exr( const char* filename, const Color3* colors, int width, int height, bool half );
+bool hdr_save_exr_channels( const char* filename, std::vector< ExrChannel > channels, int width, int height );
+
+bool save_render( const char* filename, const Color3* colors, int width, int height,
+                  const ToneMap& tonemap, bool exr_half, int png_level );
+
+} /* _462 */
+
+#endif /* _462_APPLICATION_HDRIMAGE_HPP_ */
@@ -25,12 +25,13 @@
  */
 
 #include "application/imageio.hpp"
+#include "application/pngstream.hpp"
 
 #include "application/opengl.hpp"
-#include "application/application.hpp"
 #include <iostream>
 #include <png.h>
 #include <cassert>
+#include <cstring>
 
 namespace _462 {
 
@@ -148,54 +149,17 @@ static unsigned char* _load_image_RGBA_png(const char *fileName, int *width, int
 }
 
 static bool _save_image_RGBA_png(const char *fileName, unsigned char *buffer,
-  int width, int height)
+  int width, int height, int level)
 {
-    // open the file
-    FILE *fp = fopen(fileName, "wb");
-    if (!fp)
+    // the strips are compressed in parallel
+    PngStream png;
+    if (!png.open(fileName, width, height, level))
         return false;
 
-    // create the needed data structures
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0,
-      0);
-    if (!png_ptr) {
-        fclose(fp);
-        return false;
-    }
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        fclose(fp);
-        png_destroy_write_struct(&png_ptr, (png_infopp) 0);
-        return false;
-    }
-
-    // do the setjmp thingy
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(fp);
-        return false;
-    }
-
-    // set up the io
-    png_init_io(png_ptr, fp);
-
-    // write the header
-    png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
-      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png_ptr, info_ptr);
-    png_set_flush(png_ptr, 10);
-
-    // write the image
-    png_bytep *row_pointers = new png_bytep[height];
-    for (int y = 0 ; y < height ; y++)
-        row_pointers[y] = (png_byte *) (buffer + (height - 1 - y) * width * 4);
-    png_write_image(png_ptr, row_pointers);
-    png_write_end(png_ptr, info_ptr);
-
-    // clean up memory, and finish
-    fclose(fp);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    return true;
+    // png rows go from top to bottom
+    for (int y = height - 1; y >= 0; y--)
+        png.add_rows(buffer + y * width * 4, 1);
+    return png.close();
 }
 
 // ***** external functions ***** //
@@ -215,12 +179,12 @@ unsigned char* imageio_load_image( const char *fileName, int *width, int *height
 
 // Saves image given by buffer with specicified width and height
 // to the given file name, returns true on success, false otherwise.
-// The image format is RGBA.
+// The image format is RGBA. png_level is the zlib level of png files.
 bool imageio_save_image( const char *fileName, unsigned char *buffer,
-                         int width, int height )
+                         int width, int height, int png_level )
 {
     if (_ends_with(fileName, ".png"))
-        return _save_image_RGBA_png(fileName, buffer, width, height);
+        return _save_image_RGBA_png(fileName, buffer, width, height, png_level);
     else
         return false;
 }
@@ -230,14 +194,19 @@ bool imageio_save_image( const char *fileName, unsigned char *buffer,
 // false otherwise.
 bool imageio_save_screenshot( const char *fileName, int width, int height )
 {
+#ifdef _462_HEADLESS
+    // there is no frame buffer to read
+    return false;
+#else
 
     unsigned char *buffer = new unsigned char[width * height * 4];
     if (!buffer)
         return false;
     glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
-    bool result = imageio_save_image(fileName, buffer, width, height);
+    bool result = imageio_save_image(fileName, buffer, width, height, PNG_DEFAULT_LEVEL);
     delete [] buffer;
     return result;
+#endif
 }
 
 void imageio_gen_name( char* filename, size_t len )
@@ -40,8 +40,10 @@ unsigned char* imageio_load_image( const char* filename, int *width, int *height
 
 // Saves image given by buffer with specicified width and height
 // to the given file name, returns true on success, false otherwise.
-// The image format is RGBA.
-bool imageio_save_image( const char* filename, unsigned char* buffer, int width, int height );
+// The image format is RGBA. png_level is the zlib level of png files,
+// from 0 (stored) to 9 (smallest).
+bool imageio_save_image( const char* filename, unsigned char* buffer, int width, int height,
+                         int png_level );
 
 // Writes the current opengl frame buffer to a specified file name.
 // Returns true on succces, false otherwise.
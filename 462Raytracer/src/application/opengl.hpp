@@ -12,9 +12,14 @@
 #define NOMINMAX
 #endif
 
+#ifdef _462_HEADLESS
+// built without windowing or gl libraries, gl objects are never created
+typedef unsigned int GLuint;
+#else
 #include <GL/glew.h>
 #define NO_SDL_GLEXT
 #include <SDL_opengl.h>
+#endif
 
 #endif /* _462_OPENGL_HPP_ */
 
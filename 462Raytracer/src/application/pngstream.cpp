@@ -0,0 +1,348 @@
+/**
+ * @file pngstream.cpp
+ * @brief Png files written while the image is still being made
+ *
+ * Only 8-bit rgba images are written, the format of the rest of imageio.
+ */
+
+#include "application/pngstream.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <zlib.h>
+
+namespace _462 {
+
+// rgba bytes of the rows of one strip, fewer strips compress a little
+// better, more keep more threads busy
+#define PNG_STRIP_BYTES ( 1 << 20 )
+#define PNG_BYTES_PER_PIXEL 4
+
+static void put_be32( unsigned char* p, uint32_t v )
+{
+    p[0] = (unsigned char)( v >> 24 );
+    p[1] = (unsigned char)( v >> 16 );
+    p[2] = (unsigned char)( v >> 8 );
+    p[3] = (unsigned char)v;
+}
+
+static unsigned char paeth( int a, int b, int c )
+{
+    int p = a + b - c;
+    int pa = abs( p - a ), pb = abs( p - b ), pc = abs( p - c );
+    if ( pa <= pb && pa <= pc )
+        return (unsigned char)a;
+    return (unsigned char)( pb <= pc ? b : c );
+}
+
+/**
+ * Filters a row with one of the five png filters.
+ * @param out Output, row_bytes filtered bytes.
+ */
+static void filter_row( int filter, const unsigned char* row, const unsigned char* above,
+                        size_t row_bytes, unsigned char* out )
+{
+    // the first pixel has no left neighbor, a and c are 0 there
+    const size_t bpp = PNG_BYTES_PER_PIXEL;
+    size_t i = 0;
+    switch ( filter ) {
+    case 0:
+        memcpy( out, row, row_bytes );
+        break;
+    case 1:
+        for ( ; i < bpp; ++i )
+            out[i] = row[i];
+        for ( ; i < row_bytes; ++i )
+            out[i] = (unsigned char)( row[i] - row[i - bpp] );
+        break;
+    case 2:
+        for ( ; i < row_bytes; ++i )
+            out[i] = (unsigned char)( row[i] - above[i] );
+        break;
+    case 3:
+        for ( ; i < bpp; ++i )
+            out[i] = (unsigned char)( row[i] - above[i] / 2 );
+        for ( ; i < row_bytes; ++i )
+            out[i] = (unsigned char)( row[i] - ( row[i - bpp] + above[i] ) / 2 );
+        break;
+    default:
+        for ( ; i < bpp; ++i )
+            out[i] = (unsigned char)( row[i] - above[i] );
+        for ( ; i < row_bytes; ++i )
+            out[i] = (unsigned char)( row[i] - paeth( row[i - bpp], above[i], above[i - bpp] ) );
+        break;
+    }
+}
+
+// sum of the filtered bytes as signed differences, smaller usually deflates better
+static size_t filter_cost( const unsigned char* filtered, size_t size )
+{
+    size_t cost = 0;
+    for ( size_t i = 0; i < size; ++i )
+        cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    return cost;
+}
+
+PngStream::PngStream() : file( NULL ), current( NULL ) { }
+
+PngStream::~PngStream()
+{
+    close();
+}
+
+/**
+ * Creates the file and writes its header. The rows follow with add_rows.
+ * @param level The zlib level, see PNG_DEFAULT_LEVEL.
+ * @return False if the file can not be written, otherwise return True.
+ */
+bool PngStream::open( const char* filename, int width, int height, int level )
+{
+    close();
+    if ( width <= 0 || height <= 0 )
+        return false;
+    file = fopen( filename, "wb" );
+    if ( !file )
+        return false;
+
+    this->width = width;
+    this->height = height;
+    this->level = std::max( 0, std::min( level, 9 ) );
+    row_bytes = PNG_BYTES_PER_PIXEL * size_t( width );
+    strip_rows = std::max( size_t( 1 ), size_t( PNG_STRIP_BYTES ) / row_bytes );
+    rows_added = 0;
+    last_row.assign( row_bytes, 0 );
+    next_strip = next_write = 0;
+    adler = 0;
+    closing = failed = false;
+
+    static const unsigned char SIGNATURE[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char header[13];
+    put_be32( header, uint32_t( width ) );
+    put_be32( header + 4, uint32_t( height ) );
+    // 8 bits per channel, rgba, deflate, adaptive filters, no interlace
+    header[8] = 8;
+    header[9] = 6;
+    header[10] = header[11] = header[12] = 0;
+    if ( fwrite( SIGNATURE, sizeof( SIGNATURE ), 1, file ) != 1
+         || !write_chunk( "IHDR", header, sizeof( header ) ) ) {
+        fclose( file );
+        file = NULL;
+        return false;
+    }
+
+    size_t num_strips = ( size_t( height ) + strip_rows - 1 ) / strip_rows;
+    size_t num_threads = std::min( size_t( std::max( std::thread::hardware_concurrency(), 1u ) ), num_strips );
+    for ( size_t i = 0; i < num_threads; ++i )
+        threads.push_back( std::thread( &PngStream::compress_strips, this ) );
+    return true;
+}
+
+/**
+ * Adds the next rows of the image, from the top down, and hands every
+ * full strip to the compression threads.
+ * @param rows count rows of 4 bytes per pixel, the top one first.
+ */
+void PngStream::add_rows( const unsigned char* rows, int count )
+{
+    if ( !file )
+        return;
+    for ( int i = 0; i < count && rows_added < height; ++i ) {
+        if ( !current ) {
+            current = new Strip();
+            current->index = next_strip++;
+            current->above = last_row;
+            current->rows.reserve( strip_rows * row_bytes );
+        }
+        const unsigned char* row = rows + i * row_bytes;
+        current->rows.insert( current->rows.end(), row, row + row_bytes );
+        rows_added++;
+
+        if ( current->rows.size() == strip_rows * row_bytes || rows_added == height ) {
+            last_row.assign( row, row + row_bytes );
+            current->last = rows_added == height;
+            {
+                std::lock_guard< std::mutex > guard( lock );
+                queue.push_back( current );
+            }
+            wake.notify_one();
+            current = NULL;
+        }
+    }
+}
+
+/**
+ * Waits for the strips still being compressed and finishes the file.
+ * @return False if the file could not be written or not all rows were
+ *  added, otherwise return True.
+ */
+bool PngStream::close()
+{
+    if ( !file )
+        return false;
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        closing = true;
+    }
+    wake.notify_all();
+    for ( size_t i = 0; i < threads.size(); ++i )
+        threads[i].join();
+    threads.clear();
+
+    bool ok = !failed && rows_added == height && next_write == next_strip;
+    // strips of an image that was left unfinished
+    delete current;
+    current = NULL;
+    for ( std::map< size_t, Strip* >::iterator it = done.begin(); it != done.end(); ++it )
+        delete it->second;
+    done.clear();
+
+    ok = write_chunk( "IEND", NULL, 0 ) && ok;
+    ok = fclose( file ) == 0 && ok;
+    file = NULL;
+    return ok;
+}
+
+// body of the compression threads, until close
+void PngStream::compress_strips()
+{
+    std::unique_lock< std::mutex > guard( lock );
+    for ( ;; ) {
+        while ( queue.empty() && !closing )
+            wake.wait( guard );
+        if ( queue.empty() )
+            return;
+        Strip* strip = queue.front();
+        queue.pop_front();
+
+        guard.unlock();
+        compress( strip );
+        guard.lock();
+
+        done[strip->index] = strip;
+        write_done_strips();
+    }
+}
+
+/**
+ * Filters and deflates a strip on its own. An empty result means zlib
+ * failed.
+ */
+void PngStream::compress( Strip* strip ) const
+{
+    size_t num_rows = strip->rows.size() / row_bytes;
+    std::vector< unsigned char > filtered( num_rows * ( row_bytes + 1 ) );
+    std::vector< unsigned char > candidate( row_bytes );
+    const unsigned char* above = &strip->above[0];
+    for ( size_t r = 0; r < num_rows; ++r ) {
+        const unsigned char* row = &strip->rows[r * row_bytes];
+        unsigned char* out = &filtered[r * ( row_bytes + 1 )];
+        // stored rows are not worth filtering
+        int best = 0;
+        filter_row( 0, row, above, row_bytes, out + 1 );
+        if ( level > 0 ) {
+            size_t best_cost = filter_cost( out + 1, row_bytes );
+            for ( int f = 1; f < 5; ++f ) {
+                filter_row( f, row, above, row_bytes, &candidate[0] );
+                size_t cost = filter_cost( &candidate[0], row_bytes );
+                if ( cost < best_cost ) {
+                    best = f;
+                    best_cost = cost;
+                    memcpy( out + 1, &candidate[0], row_bytes );
+                }
+            }
+        }
+        out[0] = (unsigned char)best;
+        above = row;
+    }
+    std::vector< unsigned char >().swap( strip->rows );
+
+    strip->length = filtered.size();
+    strip->adler = uint32_t( adler32( adler32( 0, NULL, 0 ), &filtered[0], uInt( filtered.size() ) ) );
+
+    // raw deflate, the zlib header and checksum are written around the strips
+    z_stream z;
+    memset( &z, 0, sizeof( z ) );
+    if ( deflateInit2( &z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+        return;
+    // room for the sync flush marker as well
+    strip->compressed.resize( deflateBound( &z, uLong( filtered.size() ) ) + 16 );
+    z.next_in = &filtered[0];
+    z.avail_in = uInt( filtered.size() );
+    int flush = strip->last ? Z_FINISH : Z_SYNC_FLUSH;
+    bool ok = false;
+    for ( ;; ) {
+        z.next_out = &strip->compressed[z.total_out];
+        z.avail_out = uInt( strip->compressed.size() - z.total_out );
+        int result = deflate( &z, flush );
+        if ( result == Z_STREAM_ERROR )
+            break;
+        // a flush is complete once it leaves output space unused
+        if ( strip->last ? result == Z_STREAM_END : z.avail_out > 0 ) {
+            ok = true;
+            break;
+        }
+        strip->compressed.resize( 2 * strip->compressed.size() );
+    }
+    strip->compressed.resize( ok ? z.total_out : 0 );
+    deflateEnd( &z );
+}
+
+/**
+ * Writes the compressed strips that are next in the file, called with the
+ * lock held. The first strip gets the zlib header in front, the last one
+ * the checksum of all of them after it.
+ */
+void PngStream::write_done_strips()
+{
+    while ( !done.empty() && done.begin()->first == next_write ) {
+        Strip* strip = done.begin()->second;
+        done.erase( done.begin() );
+        failed = failed || strip->compressed.empty();
+
+        adler = next_write == 0 ? strip->adler
+            : uint32_t( adler32_combine( adler, strip->adler, z_off_t( strip->length ) ) );
+
+        std::vector< unsigned char > data;
+        if ( next_write == 0 ) {
+            // deflate with a 32k window, the level is only a hint to readers
+            unsigned char cmf = 0x78;
+            unsigned char flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+            unsigned char flg = (unsigned char)( flevel << 6 );
+            flg = (unsigned char)( flg + 31 - ( cmf * 256 + flg ) % 31 );
+            data.push_back( cmf );
+            data.push_back( flg );
+        }
+        data.insert( data.end(), strip->compressed.begin(), strip->compressed.end() );
+        if ( strip->last ) {
+            unsigned char checksum[4];
+            put_be32( checksum, adler );
+            data.insert( data.end(), checksum, checksum + 4 );
+        }
+        failed = !write_chunk( "IDAT", &data[0], data.size() ) || failed;
+
+        delete strip;
+        next_write++;
+    }
+}
+
+/**
+ * Writes one png chunk: its length, type, data and crc.
+ * @return False if the file can not be written, otherwise return True.
+ */
+bool PngStream::write_chunk( const char* type, const unsigned char* data, size_t size )
+{
+    unsigned char header[8];
+    put_be32( header, uint32_t( size ) );
+    memcpy( header + 4, type, 4 );
+    uLong crc = crc32( 0, header + 4, 4 );
+    if ( size > 0 )
+        crc = crc32( crc, data, uInt( size ) );
+    unsigned char footer[4];
+    put_be32( footer, uint32_t( crc ) );
+    return fwrite( header, sizeof( header ), 1, file ) == 1
+        && ( size == 0 || fwrite( data, size, 1, file ) == 1 )
+        && fwrite( footer, sizeof( footer ), 1, file ) == 1;
+}
+
+} /* _462 */
@@ -0,0 +1,86 @@
+/**
+ * @file pngstream.hpp
+ * @brief Png files written while the image is still being made
+ *
+ * The rows are cut into strips that a pool of threads filters and deflates
+ * independently. Every strip but the last ends on a byte boundary with a
+ * sync flush, so the strips join into one zlib stream, whose adler32 is
+ * combined from theirs. Strips go to disk in order as soon as they are
+ * compressed, the whole image is never held.
+ */
+
+#ifndef _462_APPLICATION_PNGSTREAM_HPP_
+#define _462_APPLICATION_PNGSTREAM_HPP_
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace _462 {
+
+// zlib levels: 1 is fastest, 9 smallest, 0 stores the rows uncompressed
+#define PNG_DEFAULT_LEVEL 6
+#define PNG_FAST_LEVEL 1
+
+class PngStream
+{
+public:
+    PngStream();
+    ~PngStream();
+
+    bool open( const char* filename, int width, int height, int level );
+    void add_rows( const unsigned char* rows, int count );
+    bool close();
+
+    bool is_open() const { return file != NULL; }
+
+private:
+    struct Strip
+    {
+        size_t index;
+        bool last;
+        // the row above the first one, which the filters refer to
+        std::vector< unsigned char > above;
+        // rgba rows, then their filtered and deflated bytes
+        std::vector< unsigned char > rows;
+        std::vector< unsigned char > compressed;
+        // adler32 and length of the filtered bytes
+        uint32_t adler;
+        size_t length;
+    };
+
+    FILE* file;
+    int width, height, level;
+    size_t row_bytes, strip_rows;
+    int rows_added;
+    // the strip being filled by add_rows
+    Strip* current;
+    std::vector< unsigned char > last_row;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector< std::thread > threads;
+    std::deque< Strip* > queue;
+    // compressed strips waiting for the ones before them
+    std::map< size_t, Strip* > done;
+    size_t next_strip, next_write;
+    uint32_t adler;
+    bool closing, failed;
+
+    void compress_strips();
+    void compress( Strip* strip ) const;
+    void write_done_strips();
+    bool write_chunk( const char* type, const unsigned char* data, size_t size );
+
+    PngStream( const PngStream& );
+    PngStream& operator=( const PngStream& );
+};
+
+} /* _462 */
+
+#endif /* _462_APPLICATION_PNGSTREAM_HPP_ */
@@ -14,9 +14,12 @@
 #include "tinyxml/tinyxml.h"
 
 
+#include <chrono>
 #include <iostream>
 #include <map>
 #include <cstring>
+#include <string>
+#include <vector>
 #include <exception>
 #include "math/math.hpp"
 namespace _462 {
@@ -68,6 +71,8 @@ static const char STR_TRIANGLE[] = "triangle";
 static const char STR_MODEL[] = "model";
 static const char STR_MESH[] = "mesh";
 static const char STR_BUMP[] = "bump";
+static const char STR_KEYFRAME[] = "keyframe";
+static const char STR_TIME[] = "t";
     
 static void print_error_header( const TiXmlElement* base )
 {
@@ -202,6 +207,54 @@ static void parse_camera( const TiXmlElement* elem, Camera* camera )
     camera->orientation = normalize( ori );
 }
 
+/**
+ * Parses the keyframe children of a camera or geometry into a track. The
+ * given pose, the one of the element itself, is the pose at time 0 unless
+ * a keyframe at time 0 replaces it. Values a keyframe leaves out are taken
+ * from the keyframe before it in the file.
+ */
+static void parse_keyframes( const TiXmlElement* elem, const Vector3& position,
+                             const Quaternion& orientation, const Vector3& scale,
+                             KeyframeTrack* track )
+{
+    Keyframe key;
+    key.position = position;
+    key.orientation = orientation;
+    key.scale = scale;
+
+    const TiXmlElement* child = elem->FirstChildElement( STR_KEYFRAME );
+    if ( child ) {
+        key.time = 0;
+        track->add_key( key );
+    }
+    while ( child ) {
+        Quaternion ori = key.orientation;
+        parse_attrib_real( child, true, STR_TIME, &key.time );
+        parse_elem( child, false, STR_POSITION, &key.position );
+        parse_elem( child, false, STR_ORIENT,   &ori );
+        parse_elem( child, false, STR_SCALE,    &key.scale );
+        key.orientation = normalize( ori );
+        track->add_key( key );
+        child = child->NextSiblingElement( STR_KEYFRAME );
+    }
+}
+
+static void parse_camera_track( const TiXmlElement* elem, Scene* scene )
+{
+    KeyframeTrack track;
+    parse_keyframes( elem, scene->camera.position, scene->camera.orientation,
+                     Vector3::Ones(), &track );
+    scene->set_camera_track( track );
+}
+
+static void parse_geom_track( const TiXmlElement* elem, Geometry* geom, Scene* scene )
+{
+    KeyframeTrack track;
+    parse_keyframes( elem, geom->position, geom->orientation, geom->scale, &track );
+    if ( !track.empty() )
+        scene->add_geometry_track( geom, track );
+}
+
 static void parse_point_light( const TiXmlElement* elem, SphereLight* light )
 {
     parse_elem( elem, false, STR_ACON,      &light->attenuation.constant );
@@ -366,6 +419,7 @@ bool load_scene( Scene* scene, const char* filename )
         // parse the camera
         elem = get_unique_child( root, true, STR_CAMERA );
         parse_camera( elem, &scene->camera );
+        parse_camera_track( elem, scene );
         // parse background color
         parse_elem( root, true,  STR_BACKGROUND, &scene->background_color );
         // parse refractive index
@@ -444,6 +498,7 @@ bool load_scene( Scene* scene, const char* filename )
             check_mem( geom );
             scene->add_geometry( geom );
             parse_geom_sphere( materials, elem, geom );
+            parse_geom_track( elem, geom, scene );
             elem = elem->NextSiblingElement( STR_SPHERE );
         }
 
@@ -454,6 +509,7 @@ bool load_scene( Scene* scene, const char* filename )
             check_mem( geom );
             scene->add_geometry( geom );
             parse_geom_triangle( materials, triverts, elem, geom );
+            parse_geom_track( elem, geom, scene );
             elem = elem->NextSiblingElement( STR_TRIANGLE );
         }
 
@@ -464,6 +520,7 @@ bool load_scene( Scene* scene, const char* filename )
             check_mem( geom );
             scene->add_geometry( geom );
             parse_geom_model( materials, meshes, elem, geom );
+            parse_geom_track( elem, geom, scene );
             elem = elem->NextSiblingElement( STR_MODEL );
         }
 
@@ -482,5 +539,76 @@ bool load_scene( Scene* scene, const char* filename )
 
 }
 
-} /* _462 */
+bool load_scene_assets( Scene* scene, const char* skybox_filename, bool require_textures )
+{
+    Material* const* materials = scene->get_materials();
+    Mesh* const* meshes = scene->get_meshes();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // gather every texture: materials, bump maps and cube map faces
+    std::vector< Texture* > textures;
+    for ( size_t i = 0; i < scene->num_materials(); ++i ) {
+        textures.push_back( &materials[i]->texture );
+        textures.push_back( &materials[i]->bump );
+    }
+    if ( skybox_filename ) {
+        scene->skybox = new Cubemap( std::string( skybox_filename ) );
+        scene->skybox->init_filenames();
+        for ( size_t i = 0; i < 6; ++i )
+            textures.push_back( &scene->skybox->get_faces()[i] );
+    }
 
+    // every file is decoded once, the other textures with the same
+    // file share the decoded tiles
+    std::map< std::string, Texture* > first_texture;
+    std::vector< std::pair< Texture*, Texture* > > shared_textures;
+    std::vector< Texture* > decoded;
+    for ( size_t i = 0; i < textures.size(); ++i ) {
+        if ( textures[i]->filename.empty() )
+            continue;
+        std::pair< std::map< std::string, Texture* >::iterator, bool > rv =
+            first_texture.insert( std::make_pair( textures[i]->filename, textures[i] ) );
+        if ( rv.second ) {
+            decoded.push_back( textures[i] );
+        } else {
+            shared_textures.push_back( std::make_pair( textures[i], rv.first->second ) );
+        }
+    }
+
+    // decode the textures in parallel, one per thread. a failed texture
+    // only prints an error unless textures are required
+    std::vector< char > loaded( decoded.size() );
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for ( int i = 0; i < (int)decoded.size(); ++i ) {
+        loaded[i] = decoded[i]->load();
+    }
+    for ( size_t i = 0; i < decoded.size(); ++i ) {
+        if ( !loaded[i] && require_textures ) {
+            std::cout << "Error loading texture " << decoded[i]->filename << ", aborting.\n";
+            return false;
+        }
+    }
+
+    // then parse the meshes one after another, each on all threads; inside
+    // the loop above the parse would be a nested region and run on one
+    for ( size_t i = 0; i < scene->num_meshes(); ++i ) {
+        if ( !meshes[i]->load() ) {
+            std::cout << "Error loading mesh, aborting.\n";
+            return false;
+        }
+    }
+    for ( size_t i = 0; i < shared_textures.size(); ++i ) {
+        *shared_textures[i].first = *shared_textures[i].second;
+    }
+    if ( scene->skybox ) {
+        scene->skybox->prefilter();
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Loaded " << decoded.size() + scene->num_meshes() << " assets in "
+              << int( elapsed.count() ) << " ms\n";
+    return true;
+}
+
+} /* _462 */
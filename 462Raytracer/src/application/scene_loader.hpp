@@ -20,6 +20,16 @@ class Scene;
  */
 bool load_scene( Scene* scene, const char* filename );
 
+/**
+ * Loads the textures and meshes of a loaded scene, in parallel, and the
+ * skybox if a cube map directory is given. Does not create gl objects.
+ * @param require_textures Fail if a texture or skybox face can not be
+ *  loaded, instead of rendering without it.
+ * @return True on success, false if a mesh, or a required texture, could
+ *  not be loaded.
+ */
+bool load_scene_assets( Scene* scene, const char* skybox_filename, bool require_textures = false );
+
 } /* _462 */
 
 #endif /* _462_APPLICATOIN_SCENELOADER_HPP_ */
@@ -167,6 +167,13 @@ inline Color3 operator*( real_t s, const Color3& c ) {
 
 Color3 clamp( const Color3& c, real_t min, real_t max );
 
+/**
+ * Relative luminance of a linear color (Rec. 709 primaries).
+ */
+inline real_t luminance( const Color3& c ) {
+    return real_t( 0.2126 ) * c.r + real_t( 0.7152 ) * c.g + real_t( 0.0722 ) * c.b;
+}
+
 /**
  * Outputs a color text formatted as "(r,g,b)".
  */
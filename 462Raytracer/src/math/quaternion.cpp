@@ -177,6 +177,32 @@ Quaternion conjugate( const Quaternion& q )
     return Quaternion( q.w, -q.x, -q.y, -q.z );
 }
 
+Quaternion slerp( const Quaternion& a, const Quaternion& b, real_t t )
+{
+    real_t cosom = a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z;
+    // q and -q are the same rotation, take the one closer to a
+    real_t sign = 1.0;
+    if ( cosom < 0.0 ) {
+        cosom = -cosom;
+        sign = -1.0;
+    }
+
+    real_t s0, s1;
+    if ( cosom > 0.9995 ) {
+        // nearly the same rotation, lerp and normalize
+        s0 = 1.0 - t;
+        s1 = t;
+    } else {
+        real_t omega = acos( cosom );
+        real_t sinom = sin( omega );
+        s0 = sin( ( 1.0 - t ) * omega ) / sinom;
+        s1 = sin( t * omega ) / sinom;
+    }
+    s1 *= sign;
+    return normalize( Quaternion( s0 * a.w + s1 * b.w, s0 * a.x + s1 * b.x,
+                                  s0 * a.y + s1 * b.y, s0 * a.z + s1 * b.z ) );
+}
+
 std::ostream& operator <<( std::ostream& o, const Quaternion& q )
 {
     o << "Quaternion(" << q.w << ", " << q.x << ", " << q.y << ", " << q.z << ")";
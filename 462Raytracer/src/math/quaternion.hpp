@@ -146,6 +146,12 @@ Quaternion normalize( const Quaternion& q );
 
 Quaternion conjugate( const Quaternion& q );
 
+/**
+ * Spherical linear interpolation between two unit quaternions, along the
+ * shorter arc. Returns a at t=0 and b at t=1.
+ */
+Quaternion slerp( const Quaternion& a, const Quaternion& b, real_t t );
+
 std::ostream& operator <<( std::ostream& o, const Quaternion& q );
 
 } /* _462 */
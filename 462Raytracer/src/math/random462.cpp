@@ -14,22 +14,21 @@
 namespace _462{
 
 
-//initializes the (thread-local) random number generator
-std::default_random_engine *init_rand(){
-    std::default_random_engine *ret;
+// a random seed for the generator of a new thread
+static int init_seed(){
     std::uniform_int_distribution<int> dist(0,INT_MAX);
     std::random_device rd;
-    ret=new std::default_random_engine(dist(rd));
-    return ret;
+    return dist(rd);
 }
-std::default_random_engine *generator=init_rand();
+// one generator per thread, threads never share a sequence
+static thread_local std::default_random_engine generator(init_seed());
 /**
  * Generate a uniform random real_t on the interval [0, 1)
  */
 real_t random_uniform()
 {
     std::uniform_real_distribution<real_t> dist = std::uniform_real_distribution<real_t>();
-    return dist(*generator);
+    return dist(generator);
 }
 
 /**
@@ -37,7 +36,7 @@ real_t random_uniform()
  */
 int random_int(int n){
     std::uniform_int_distribution<> dist(0, n-1);
-    return dist(*generator);
+    return dist(generator);
 }
 
 /**
@@ -47,9 +46,21 @@ real_t random_gaussian()
 {
     std::normal_distribution<real_t> dist =
        std::normal_distribution<real_t>();
-    return dist(*generator);
+    return dist(generator);
 }
 
-
+/**
+ * Restart the generator of the calling thread. Nearby seeds are mixed
+ * first, the generator would start them on nearby numbers.
+ */
+void random_seed(uint64_t seed)
+{
+    // splitmix64 finalizer
+    seed += 0x9E3779B97F4A7C15ull;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBull;
+    seed ^= seed >> 31;
+    generator.seed((unsigned)(seed % 2147483646u) + 1u);
+}
 
 }; // _462
@@ -7,6 +7,7 @@
 //
 
 #include <random>
+#include <stdint.h>
 #include <omp.h>
 #include "math/math.hpp"
 namespace _462{
@@ -27,4 +28,10 @@ real_t random_gaussian();
      */
 int random_int(int n);
 
+    /**
+     * Restart the generator of the calling thread from a seed, so the
+     * numbers drawn after it do not depend on what the thread drew before
+     */
+void random_seed(uint64_t seed);
+
 }; // _462
@@ -0,0 +1,154 @@
+/**
+ * @file simd.hpp
+ * @brief Four wide single precision vectors.
+ *
+ * Vec4f holds a Vector3 in the first three lanes of an SSE register, so the
+ * per-component math of the ray-box and ray-triangle tests runs as one
+ * instruction instead of three. The fourth lane is not meaningful, and
+ * the horizontal operations ignore it. Without SSE the same interface is
+ * implemented with plain floats.
+ */
+
+#ifndef _462_MATH_SIMD_HPP_
+#define _462_MATH_SIMD_HPP_
+
+#include "math/vector.hpp"
+#include <algorithm>
+
+#if defined(__SSE__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 1 )
+#define SIMD_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace _462 {
+
+class Vec4f
+{
+public:
+#ifdef SIMD_SSE
+    __m128 v;
+
+    Vec4f() { }
+    Vec4f( __m128 v ) : v( v ) { }
+    explicit Vec4f( float s ) : v( _mm_set1_ps( s ) ) { }
+
+    /// Loads x, y and z of a vector, the fourth lane is 0.
+    static Vec4f load3( const Vector3& a )
+    {
+#ifdef REAL_FLOAT
+        __m128 xy = _mm_loadl_pi( _mm_setzero_ps(), (const __m64*)&a.x );
+        return _mm_movelh_ps( xy, _mm_load_ss( &a.z ) );
+#else
+        return _mm_setr_ps( float( a.x ), float( a.y ), float( a.z ), 0.0f );
+#endif
+    }
+
+    /// Loads four floats, p does not have to be aligned.
+    static Vec4f load( const float* p ) { return _mm_loadu_ps( p ); }
+    /// Stores the four lanes, p does not have to be aligned.
+    void store( float* p ) const { _mm_storeu_ps( p, v ); }
+
+    Vec4f operator+( const Vec4f& b ) const { return _mm_add_ps( v, b.v ); }
+    Vec4f operator-( const Vec4f& b ) const { return _mm_sub_ps( v, b.v ); }
+    Vec4f operator*( const Vec4f& b ) const { return _mm_mul_ps( v, b.v ); }
+    Vec4f operator/( const Vec4f& b ) const { return _mm_div_ps( v, b.v ); }
+
+    /// Lane i of the result is lane n[i] of this vector.
+    template< int n0, int n1, int n2, int n3 >
+    Vec4f shuffle() const { return _mm_shuffle_ps( v, v, _MM_SHUFFLE( n3, n2, n1, n0 ) ); }
+
+    /// Smallest of the first three lanes.
+    float hmin3() const
+    {
+        __m128 m = _mm_min_ss( v, shuffle< 1, 1, 1, 1 >().v );
+        return _mm_cvtss_f32( _mm_min_ss( m, shuffle< 2, 2, 2, 2 >().v ) );
+    }
+
+    /// Largest of the first three lanes.
+    float hmax3() const
+    {
+        __m128 m = _mm_max_ss( v, shuffle< 1, 1, 1, 1 >().v );
+        return _mm_cvtss_f32( _mm_max_ss( m, shuffle< 2, 2, 2, 2 >().v ) );
+    }
+
+    /// Sum of the first three lanes.
+    float hadd3() const
+    {
+        __m128 s = _mm_add_ss( v, shuffle< 1, 1, 1, 1 >().v );
+        return _mm_cvtss_f32( _mm_add_ss( s, shuffle< 2, 2, 2, 2 >().v ) );
+    }
+#else
+    float f[4];
+
+    Vec4f() { }
+    explicit Vec4f( float s ) { f[0] = f[1] = f[2] = f[3] = s; }
+
+    static Vec4f load3( const Vector3& a )
+    {
+        Vec4f r;
+        r.f[0] = float( a.x );
+        r.f[1] = float( a.y );
+        r.f[2] = float( a.z );
+        r.f[3] = 0.0f;
+        return r;
+    }
+
+    static Vec4f load( const float* p ) { Vec4f r; for ( int i = 0; i < 4; ++i ) r.f[i] = p[i]; return r; }
+    void store( float* p ) const { for ( int i = 0; i < 4; ++i ) p[i] = f[i]; }
+
+    Vec4f operator+( const Vec4f& b ) const { Vec4f r; for ( int i = 0; i < 4; ++i ) r.f[i] = f[i] + b.f[i]; return r; }
+    Vec4f operator-( const Vec4f& b ) const { Vec4f r; for ( int i = 0; i < 4; ++i ) r.f[i] = f[i] - b.f[i]; return r; }
+    Vec4f operator*( const Vec4f& b ) const { Vec4f r; for ( int i = 0; i < 4; ++i ) r.f[i] = f[i] * b.f[i]; return r; }
+    Vec4f operator/( const Vec4f& b ) const { Vec4f r; for ( int i = 0; i < 4; ++i ) r.f[i] = f[i] / b.f[i]; return r; }
+
+    template< int n0, int n1, int n2, int n3 >
+    Vec4f shuffle() const
+    {
+        Vec4f r;
+        r.f[0] = f[n0];
+        r.f[1] = f[n1];
+        r.f[2] = f[n2];
+        r.f[3] = f[n3];
+        return r;
+    }
+
+    float hmin3() const { return std::min( std::min( f[0], f[1] ), f[2] ); }
+    float hmax3() const { return std::max( std::max( f[0], f[1] ), f[2] ); }
+    float hadd3() const { return f[0] + f[1] + f[2]; }
+#endif
+};
+
+#ifdef SIMD_SSE
+inline Vec4f min( const Vec4f& a, const Vec4f& b ) { return _mm_min_ps( a.v, b.v ); }
+inline Vec4f max( const Vec4f& a, const Vec4f& b ) { return _mm_max_ps( a.v, b.v ); }
+#else
+inline Vec4f min( const Vec4f& a, const Vec4f& b )
+{
+    Vec4f r;
+    for ( int i = 0; i < 4; ++i ) r.f[i] = std::min( a.f[i], b.f[i] );
+    return r;
+}
+inline Vec4f max( const Vec4f& a, const Vec4f& b )
+{
+    Vec4f r;
+    for ( int i = 0; i < 4; ++i ) r.f[i] = std::max( a.f[i], b.f[i] );
+    return r;
+}
+#endif
+
+/// Dot product of the first three lanes.
+inline float dot3( const Vec4f& a, const Vec4f& b )
+{
+    return ( a * b ).hadd3();
+}
+
+/// Cross product of the first three lanes.
+inline Vec4f cross3( const Vec4f& a, const Vec4f& b )
+{
+    return a.shuffle< 1, 2, 0, 3 >() * b.shuffle< 2, 0, 1, 3 >()
+         - a.shuffle< 2, 0, 1, 3 >() * b.shuffle< 1, 2, 0, 3 >();
+}
+
+} /* _462 */
+
+#endif /* _462_MATH_SIMD_HPP_ */
@@ -0,0 +1,371 @@
+/**
+ * @file batch.cpp
+ * @brief Headless batch renderer
+ *
+ * Renders every job of a manifest without a window or gl context. Jobs of
+ * the same scene share its loaded assets and trees, so a camera change
+ * between them only costs the render itself. See p3/batchjob.hpp for the
+ * manifest format. With -l the frames are rendered by worker processes
+ * started with -w instead, see p3/farm.hpp. With -b the meshes of the
+ * scenes only have their trees built, to time the builder.
+ */
+
+#include "scene/tilecache.hpp"
+#include "scene/numa.hpp"
+#include "p3/batchjob.hpp"
+#include "p3/farm.hpp"
+#include "scene/natfile.hpp"
+#include "scene/model.hpp"
+#include "scene/bvhnode.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+namespace _462 {
+
+// checkpoints of local renders
+struct CheckpointOptions
+{
+    // seconds between two checkpoints of a frame, 0 for none
+    real_t interval;
+    // skip finished frames and pick up the others from their checkpoints
+    bool resume;
+};
+
+static bool file_exists( const std::string& filename )
+{
+    FILE* file = fopen( filename.c_str(), "rb" );
+    if ( file )
+        fclose( file );
+    return file != NULL;
+}
+
+// a checkpoint only resumes the frame of the same scene file and job line
+static NatKey checkpoint_key( const BatchJob& job, int frame )
+{
+    NatKey key;
+    if ( !nat_source_key( job.scene_filename, key ) )
+        memset( &key, 0, sizeof( key ) );
+    char number[16];
+    snprintf( number, sizeof( number ), "#%d", frame );
+    std::string settings = job.text + number;
+    key.extra = nat_checksum( (const unsigned char*)settings.data(), settings.size() );
+    return key;
+}
+
+/**
+ * Renders one frame of a job into its output file.
+ * @return False if the frame failed.
+ */
+static bool render_frame( const BatchJob& job, LoadedScene* loaded, int frame,
+                          const CheckpointOptions& checkpoints, double load_ms )
+{
+    std::string output = frame_filename( job, frame );
+    std::string checkpoint = output + ".ckpt";
+    // an image without a checkpoint next to it was finished
+    if ( checkpoints.resume && file_exists( output ) && !file_exists( checkpoint ) ) {
+        printf( "Skipping '%s', already rendered\n", output.c_str() );
+        return true;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if ( !prepare_frame( job, loaded, frame_time( job, frame ) ) )
+        return false;
+    double init_ms = elapsed_ms( start );
+
+    NatKey key = checkpoint_key( job, frame );
+    if ( checkpoints.interval > 0 )
+        loaded->raytracer.set_checkpoint( checkpoint, key, checkpoints.interval );
+    if ( checkpoints.resume )
+        loaded->raytracer.resume_checkpoint( checkpoint, key );
+
+    const Color3* colors = loaded->raytracer.get_colors();
+    FrameStream stream;
+    if ( streams_output( job, output ) ) {
+        if ( !stream.open( job, output ) ) {
+            std::cout << "Error saving raytraced image to '" << output << "'.\n";
+            return false;
+        }
+        loaded->raytracer.set_rows_done( [&]( size_t first, size_t count ) {
+            stream.add_rows( colors, first, count );
+        } );
+    }
+
+    start = std::chrono::steady_clock::now();
+    loaded->raytracer.raytrace( NULL, NULL );
+    loaded->raytracer.set_rows_done( nullptr );
+    double render_ms = elapsed_ms( start );
+
+    // a streamed output only waits for its last strips here
+    start = std::chrono::steady_clock::now();
+    bool streamed = stream.is_open();
+    if ( ( streamed && !stream.close() )
+         || !save_frame( job, output, colors, loaded->raytracer.get_aovs(), streamed ) ) {
+        std::cout << "Error saving raytraced image to '" << output << "'.\n";
+        return false;
+    }
+    double save_ms = elapsed_ms( start );
+    if ( checkpoints.interval > 0 || checkpoints.resume ) {
+        // a checkpoint still being written would come back
+        nat_wait_writes();
+        remove( checkpoint.c_str() );
+    }
+    printf( "Saved '%s' (%dx%d, %d samples): load %.0f ms, init %.0f ms, render %.0f ms, save %.0f ms\n",
+            output.c_str(), job.width, job.height, job.num_samples,
+            load_ms, init_ms, render_ms, save_ms );
+    return true;
+}
+
+/**
+ * Renders a job, a single image or the frames of a sequence.
+ * @return False if the job failed.
+ */
+static bool render( const BatchJob& job, LoadedScene* loaded,
+                    const CheckpointOptions& checkpoints, double load_ms )
+{
+    for ( int i = 0; i < job.num_frames; ++i ) {
+        // the load is only paid by the first frame
+        if ( !render_frame( job, loaded, i, checkpoints, i == 0 ? load_ms : 0 ) )
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Builds the bvh tree of every mesh in the scenes of the jobs several
+ * times with several bin counts, and prints the fastest build of each and
+ * the SAH cost of its tree. Nothing is rendered.
+ * @return the number of scenes that could not be loaded.
+ */
+static size_t benchmark_bvh( const std::vector< BatchJob >& jobs, int runs )
+{
+    static const int bins[] = { 4, 8, 16, 32, BVH_MAX_BINS };
+    std::set< std::string > scenes;
+    size_t failed = 0;
+    for ( size_t i = 0; i < jobs.size(); ++i ) {
+        const BatchJob& job = jobs[i];
+        if ( !scenes.insert( scene_key( job ) ).second )
+            continue;
+        LoadedScene* loaded = load_job_scene( job );
+        if ( !loaded || !prepare_frame( job, loaded, job.time ) ) {
+            failed++;
+            delete loaded;
+            continue;
+        }
+
+        std::set< const Mesh* > meshes;
+        Geometry* const* geometries = loaded->scene.get_geometries();
+        for ( size_t g = 0; g < loaded->scene.num_geometries(); ++g ) {
+            const Model* model = dynamic_cast< const Model* >( geometries[g] );
+            if ( !model || !meshes.insert( model->mesh ).second )
+                continue;
+            printf( "%s: %lu triangles, best of %d builds\n", model->mesh->filename.c_str(),
+                    (unsigned long)model->mesh->num_triangles(), runs );
+            for ( size_t b = 0; b < sizeof( bins ) / sizeof( bins[0] ); ++b ) {
+                real_t cost = 0;
+                double ms = model->time_bvh_build( bins[b], runs, &cost );
+                printf( "  %2d bins: %8.1f ms, SAH cost %.2f%s\n", bins[b], ms, double( cost ),
+                        bins[b] == BVH_BINS ? " (used)" : "" );
+            }
+        }
+        delete loaded;
+    }
+    return failed;
+}
+
+/**
+ * Renders all jobs in this process.
+ * @return the number of failed jobs.
+ */
+static size_t render_local( const std::vector< BatchJob >& jobs, const CheckpointOptions& checkpoints )
+{
+    // a scene is freed after the last job that uses it
+    std::map< std::string, size_t > last_use;
+    for ( size_t i = 0; i < jobs.size(); ++i )
+        last_use[scene_key( jobs[i] )] = i;
+
+    std::chrono::steady_clock::time_point batch_start = std::chrono::steady_clock::now();
+    std::map< std::string, LoadedScene* > scenes;
+    size_t failed = 0;
+    for ( size_t i = 0; i < jobs.size(); ++i ) {
+        const BatchJob& job = jobs[i];
+        std::string key = scene_key( job );
+        printf( "Job %lu of %lu (line %d): %s\n", (unsigned long)( i + 1 ),
+                (unsigned long)jobs.size(), job.line, job.scene_filename.c_str() );
+
+        double load_ms = 0;
+        std::map< std::string, LoadedScene* >::iterator it = scenes.find( key );
+        if ( it == scenes.end() ) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            it = scenes.insert( std::make_pair( key, load_job_scene( job ) ) ).first;
+            load_ms = elapsed_ms( start );
+        }
+
+        if ( !it->second ) {
+            std::cout << "Error loading scene " << job.scene_filename << ".\n";
+            failed++;
+        } else if ( !render( job, it->second, checkpoints, load_ms ) ) {
+            failed++;
+        }
+
+        if ( last_use[key] == i ) {
+            delete it->second;
+            scenes.erase( it );
+        }
+    }
+
+    printf( "Rendered %lu of %lu jobs in %.0f ms\n", (unsigned long)( jobs.size() - failed ),
+            (unsigned long)jobs.size(), elapsed_ms( batch_start ) );
+    return failed;
+}
+
+} /* _462 */
+
+using namespace _462;
+
+static void print_usage( const char* progname )
+{
+    std::cout << "Usage: " << progname << " manifest [-l port] [-k seconds] [--resume] [-b runs] [-t megabytes] [-a] [-i] [-u]\n"
+        "       " << progname << " -w host:port [-t megabytes] [-a] [-i] [-u]\n"
+        "\n"
+        "Renders every job of the manifest without opening a window. Each\n"
+        "line of the manifest is one job, see p3/batchjob.hpp for its keys.\n"
+        "\n"
+        "Options:\n"
+        "\n"
+        "\t-l port:\n"
+        "\t\tListen on the port and have the frames rendered by the workers\n"
+        "\t\tthat connect to it, tile by tile.\n"
+        "\t-w host:port:\n"
+        "\t\tRender tiles for the coordinator at the address until it is\n"
+        "\t\tdone. The scenes must be found at the same paths as there.\n"
+        "\t-k seconds:\n"
+        "\t\tSave the progress of every frame this often, to the output\n"
+        "\t\tfile name with .ckpt appended. Removed once the frame is done.\n"
+        "\t\tNot available with -l.\n"
+        "\t--resume:\n"
+        "\t\tSkip the frames already rendered and pick up the others from\n"
+        "\t\ttheir last checkpoint, if they have one. Not available with -l.\n"
+        "\t-b runs:\n"
+        "\t\tDo not render, time this many builds of the bvh tree of every\n"
+        "\t\tmesh in the scenes with several bin counts instead.\n"
+        "\t-t megabytes:\n"
+        "\t\tKeep at most this many megabytes of texture tiles in memory.\n"
+        "\t-a:\n"
+        "\t\tPin the worker threads to cpus spread over the memory nodes.\n"
+        "\t-i:\n"
+        "\t\tInterleave the bvh trees and textures over all memory nodes.\n"
+        "\t-u:\n"
+        "\t\tKeep decoded textures in .nat files in the cache directory,\n"
+        "\t\tso later runs do not decode the images again.\n"
+        "\n";
+}
+
+int main( int argc, char* argv[] )
+{
+#ifdef OPENMP
+    omp_set_num_threads( MAX_THREADS );
+#endif
+
+    if ( argc < 2 ) {
+        print_usage( argv[0] );
+        return 1;
+    }
+
+    // the manifest comes first, workers have none
+    const char* manifest = argv[1][0] == '-' ? NULL : argv[1];
+    const char* coordinator = NULL;
+    int port = 0;
+    CheckpointOptions checkpoints = { 0, false };
+    int texture_cache_mb = 0;
+    int bench_runs = 0;
+    bool pin_threads = false;
+    bool interleave = false;
+    bool texture_nat = false;
+    for ( int i = manifest ? 2 : 1; i < argc; i++ ) {
+        if ( strcmp( argv[i], "--resume" ) == 0 ) {
+            checkpoints.resume = true;
+            continue;
+        }
+        switch ( argv[i][1] ) {
+        case 'k':
+            if ( i < argc - 1 )
+                checkpoints.interval = atof( argv[++i] );
+            break;
+        case 'l':
+            if ( i < argc - 1 )
+                port = atoi( argv[++i] );
+            break;
+        case 'w':
+            if ( i < argc - 1 )
+                coordinator = argv[++i];
+            break;
+        case 'b':
+            if ( i < argc - 1 )
+                bench_runs = atoi( argv[++i] );
+            break;
+        case 't':
+            if ( i < argc - 1 )
+                texture_cache_mb = atoi( argv[++i] );
+            break;
+        case 'a':
+            pin_threads = true;
+            break;
+        case 'i':
+            interleave = true;
+            break;
+        case 'u':
+            texture_nat = true;
+            break;
+        default:
+            print_usage( argv[0] );
+            return 1;
+        }
+    }
+    if ( !manifest == !coordinator ) {
+        print_usage( argv[0] );
+        return 1;
+    }
+    // tiles rendered by workers are not checkpointed
+    if ( ( port > 0 || coordinator ) && ( checkpoints.interval > 0 || checkpoints.resume ) ) {
+        std::cout << "-k and --resume only work for renders on this machine, not with -l or -w.\n";
+        return 1;
+    }
+
+    texture_tile_cache().set_budget( size_t( std::max( texture_cache_mb, 0 ) ) << 20 );
+    texture_set_nat_cache( texture_nat );
+    numa_set_interleave( interleave );
+#ifdef OPENMP
+    if ( pin_threads ) {
+#pragma omp parallel
+        numa_pin_thread( omp_get_thread_num() );
+    }
+#endif
+
+    if ( coordinator )
+        return run_worker( coordinator ) ? 0 : 1;
+
+    std::vector< BatchJob > jobs;
+    if ( !read_manifest( manifest, &jobs ) )
+        return 1;
+
+    if ( bench_runs > 0 )
+        return benchmark_bvh( jobs, bench_runs ) > 0 ? 1 : 0;
+    if ( port > 0 ) {
+        int failed = run_coordinator( jobs, port );
+        return failed != 0 ? 1 : 0;
+    }
+    return render_local( jobs, checkpoints ) > 0 ? 1 : 0;
+}
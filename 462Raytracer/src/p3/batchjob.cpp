@@ -0,0 +1,460 @@
+/**
+ * @file batchjob.cpp
+ * @brief Jobs of the batch renderer
+ */
+
+#include "p3/batchjob.hpp"
+#include "application/scene_loader.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace _462 {
+
+#define DEFAULT_WIDTH 800
+#define DEFAULT_HEIGHT 600
+#define DEFAULT_FPS 24
+
+// jobs rendering the same scene with the same skybox share a LoadedScene
+std::string scene_key( const BatchJob& job )
+{
+    return job.scene_filename + "\n" + job.skybox_filename;
+}
+
+static bool parse_reals( const std::string& value, real_t* out, int n )
+{
+    std::istringstream in( value );
+    char comma;
+    for ( int i = 0; i < n; ++i ) {
+        if ( ( i > 0 && !( in >> comma && comma == ',' ) ) || !( in >> out[i] ) )
+            return false;
+    }
+    return in.eof() || ( in >> std::ws ).eof();
+}
+
+// parses a comma separated list of AOV names into AovChannel bits
+static bool parse_aovs( const std::string& value, int* out )
+{
+    static const struct { const char* name; int bits; } names[] = {
+        { "depth", AOV_DEPTH }, { "normal", AOV_NORMAL }, { "albedo", AOV_ALBEDO },
+        { "id", AOV_OBJECT_ID }, { "direct", AOV_DIRECT }, { "samples", AOV_SAMPLES },
+        { "variance", AOV_VARIANCE },
+        { "all", AOV_ALL }
+    };
+    *out = 0;
+    std::istringstream in( value );
+    std::string name;
+    while ( std::getline( in, name, ',' ) ) {
+        size_t i = 0;
+        while ( i < sizeof( names ) / sizeof( names[0] ) && name != names[i].name )
+            i++;
+        if ( i == sizeof( names ) / sizeof( names[0] ) )
+            return false;
+        *out |= names[i].bits;
+    }
+    return *out != 0;
+}
+
+/**
+ * Parses one line of the manifest.
+ * @return False if the line has an unknown key or a bad value.
+ */
+bool parse_job( const std::string& text, BatchJob* job )
+{
+    job->width = DEFAULT_WIDTH;
+    job->height = DEFAULT_HEIGHT;
+    job->num_samples = 1;
+    job->raytracer_opt.focus = 0;
+    job->raytracer_opt.gloss = 0;
+    job->raytracer_opt.shadow_cache = false;
+    job->raytracer_opt.aovs = 0;
+    job->raytracer_opt.env_samples = 0;
+    job->raytracer_opt.node_stats = false;
+    job->aovs = 0;
+    job->denoise = default_denoise_options();
+    job->denoise.passes = 0;
+    job->has_position = job->has_orientation = job->has_fov = false;
+    job->time = 0;
+    job->num_frames = 1;
+    job->fps = DEFAULT_FPS;
+    job->tonemap = default_tonemap();
+    job->exr_half = true;
+    job->png_level = PNG_DEFAULT_LEVEL;
+
+    job->text = text;
+
+    std::istringstream in( text );
+    std::string token;
+    while ( in >> token ) {
+        size_t eq = token.find( '=' );
+        if ( eq == std::string::npos ) {
+            std::cout << "Expected key=value, got '" << token << "'";
+            return false;
+        }
+        std::string key = token.substr( 0, eq );
+        std::string value = token.substr( eq + 1 );
+        real_t r[4];
+        bool ok = true;
+
+        if ( key == "scene" ) {
+            job->scene_filename = value;
+        } else if ( key == "output" ) {
+            job->output_filename = value;
+        } else if ( key == "skybox" ) {
+            job->skybox_filename = value;
+        } else if ( key == "width" ) {
+            job->width = atoi( value.c_str() );
+            ok = job->width > 0;
+        } else if ( key == "height" ) {
+            job->height = atoi( value.c_str() );
+            ok = job->height > 0;
+        } else if ( key == "samples" ) {
+            job->num_samples = atoi( value.c_str() );
+            ok = job->num_samples > 0;
+        } else if ( key == "gloss" ) {
+            ok = parse_reals( value, r, 1 );
+            job->raytracer_opt.gloss = r[0];
+        } else if ( key == "shadow_cache" ) {
+            job->raytracer_opt.shadow_cache = value == "1";
+        } else if ( key == "node_stats" ) {
+            job->raytracer_opt.node_stats = value == "1";
+        } else if ( key == "env_light" ) {
+            int samples = atoi( value.c_str() );
+            ok = samples >= 0;
+            job->raytracer_opt.env_samples = size_t( std::max( samples, 0 ) );
+        } else if ( key == "position" ) {
+            ok = job->has_position = parse_reals( value, r, 3 );
+            job->position = Vector3( r[0], r[1], r[2] );
+        } else if ( key == "orientation" ) {
+            ok = job->has_orientation = parse_reals( value, r, 4 );
+            job->orientation = normalize( Quaternion( Vector3( r[0], r[1], r[2] ), r[3] ) );
+        } else if ( key == "fov" ) {
+            ok = job->has_fov = parse_reals( value, r, 1 ) && r[0] > 0;
+            job->fov = r[0];
+        } else if ( key == "time" ) {
+            ok = parse_reals( value, r, 1 );
+            job->time = r[0];
+        } else if ( key == "frames" ) {
+            job->num_frames = atoi( value.c_str() );
+            ok = job->num_frames > 0;
+        } else if ( key == "fps" ) {
+            ok = parse_reals( value, r, 1 ) && r[0] > 0;
+            job->fps = r[0];
+        } else if ( key == "exposure" ) {
+            ok = parse_reals( value, r, 1 );
+            job->tonemap.exposure = r[0];
+        } else if ( key == "gamma" ) {
+            ok = parse_reals( value, r, 1 ) && r[0] > 0;
+            job->tonemap.gamma = r[0];
+        } else if ( key == "exr" ) {
+            ok = value == "half" || value == "float";
+            job->exr_half = value == "half";
+        } else if ( key == "png_level" ) {
+            job->png_level = atoi( value.c_str() );
+            ok = value.size() == 1 && isdigit( value[0] );
+        } else if ( key == "aovs" ) {
+            ok = parse_aovs( value, &job->aovs );
+        } else if ( key == "denoise" ) {
+            job->denoise.passes = atoi( value.c_str() );
+            ok = job->denoise.passes >= 0 && job->denoise.passes <= DENOISE_MAX_PASSES;
+        } else if ( key == "denoise_sigma" ) {
+            ok = parse_reals( value, r, 1 ) && r[0] > 0;
+            job->denoise.sigma_color = r[0];
+        } else {
+            std::cout << "Unknown key '" << key << "'";
+            return false;
+        }
+
+        if ( !ok ) {
+            std::cout << "Bad value '" << value << "' for " << key;
+            return false;
+        }
+    }
+
+    if ( job->scene_filename.empty() || job->output_filename.empty() ) {
+        std::cout << "A job needs a scene and an output";
+        return false;
+    }
+    // the denoiser is guided by AOVs that are not written
+    job->raytracer_opt.aovs = job->aovs | ( job->denoise.passes > 0 ? DENOISE_AOVS : 0 );
+    return true;
+}
+
+/**
+ * Reads all jobs of a manifest.
+ * @return False if the manifest can not be read or has a bad line.
+ */
+bool read_manifest( const char* filename, std::vector< BatchJob >* jobs )
+{
+    std::ifstream file( filename );
+    if ( !file ) {
+        std::cout << "Cannot open manifest '" << filename << "'.\n";
+        return false;
+    }
+
+    std::string text;
+    for ( int line = 1; std::getline( file, text ); ++line ) {
+        size_t start = text.find_first_not_of( " \t\r" );
+        if ( start == std::string::npos || text[start] == '#' )
+            continue;
+        BatchJob job;
+        job.line = line;
+        if ( !parse_job( text, &job ) ) {
+            std::cout << " on line " << line << " of '" << filename << "'.\n";
+            return false;
+        }
+        jobs->push_back( job );
+    }
+    return true;
+}
+
+/**
+ * Loads the scene of a job with its assets.
+ * @return the loaded scene, NULL if the scene, a mesh, a texture or the
+ *  skybox can not be loaded; a job never renders without them.
+ */
+LoadedScene* load_job_scene( const BatchJob& job )
+{
+    LoadedScene* loaded = new LoadedScene();
+    const char* skybox = job.skybox_filename.empty() ? NULL : job.skybox_filename.c_str();
+    if ( !load_scene( &loaded->scene, job.scene_filename.c_str() )
+         || !load_scene_assets( &loaded->scene, skybox, true ) ) {
+        delete loaded;
+        return NULL;
+    }
+    loaded->camera = loaded->scene.camera;
+    return loaded;
+}
+
+double elapsed_ms( std::chrono::steady_clock::time_point start )
+{
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/**
+ * Moves the scene to a frame of a job, applies the camera overrides of the
+ * job and brings the raytracer up to date, rebuilding only what changed.
+ * @return False if the raytracer could not be initialized.
+ */
+bool prepare_frame( const BatchJob& job, LoadedScene* loaded, real_t time )
+{
+    Scene& scene = loaded->scene;
+    scene.camera = loaded->camera;
+    scene.set_time( time );
+    if ( job.has_position )
+        scene.camera.position = job.position;
+    if ( job.has_orientation )
+        scene.camera.orientation = job.orientation;
+    if ( job.has_fov )
+        scene.camera.fov = job.fov;
+    scene.camera.aspect = real_t( job.width ) / real_t( job.height );
+
+    if ( !loaded->raytracer.initialize( &scene, job.num_samples, job.width, job.height, job.raytracer_opt ) ) {
+        std::cout << "Raytracer initialization failed.\n";
+        return false;
+    }
+    return true;
+}
+
+real_t frame_time( const BatchJob& job, int frame )
+{
+    return job.time + real_t( frame ) / job.fps;
+}
+
+/**
+ * @return the output of a single image job, or output_0007.png for
+ *  frame 7 of a sequence written to output.png.
+ */
+std::string frame_filename( const BatchJob& job, int frame )
+{
+    const std::string& output = job.output_filename;
+    if ( job.num_frames == 1 )
+        return output;
+
+    char number[16];
+    snprintf( number, sizeof( number ), "_%04d", frame );
+    size_t dot = output.rfind( '.' );
+    size_t slash = output.find_last_of( "/\\" );
+    if ( dot == std::string::npos || ( slash != std::string::npos && dot < slash ) )
+        return output + number;
+    return output.substr( 0, dot ) + number + output.substr( dot );
+}
+
+// ext is in lower case, the file name may be in any case
+static bool has_extension( const std::string& filename, const std::string& ext )
+{
+    if ( filename.size() < ext.size() )
+        return false;
+    std::string end = filename.substr( filename.size() - ext.size() );
+    for ( size_t i = 0; i < end.size(); ++i )
+        end[i] = char( tolower( end[i] ) );
+    return end == ext;
+}
+
+/**
+ * The file the AOVs of an output go to: the output itself if it is an exr
+ * file, otherwise the output with .aov.exr in place of its extension.
+ */
+std::string aov_filename( const std::string& output )
+{
+    if ( has_extension( output, ".exr" ) )
+        return output;
+    size_t dot = output.rfind( '.' );
+    size_t slash = output.find_last_of( "/\\" );
+    if ( dot == std::string::npos || ( slash != std::string::npos && dot < slash ) )
+        return output + ".aov.exr";
+    return output.substr( 0, dot ) + ".aov.exr";
+}
+
+// one float channel of a value of every pixel
+template< typename Getter >
+static void add_aov_channel( std::vector< ExrChannel >* channels, const char* name,
+                             const AovPixel* aovs, size_t count, bool half, Getter get )
+{
+    ExrChannel channel;
+    channel.name = name;
+    channel.half = half;
+    channel.values.resize( count );
+    for ( size_t i = 0; i < count; ++i )
+        channel.values[i] = float( get( aovs[i] ) );
+    channels->push_back( channel );
+}
+
+/**
+ * Whether the output of a frame is written while it renders, see
+ * FrameStream. Denoised frames are only written once they are complete.
+ */
+bool streams_output( const BatchJob& job, const std::string& output )
+{
+    return has_extension( output, ".png" ) && job.denoise.passes == 0;
+}
+
+FrameStream::FrameStream() : job( NULL ) { }
+
+// a frame that failed leaves no .part file behind
+FrameStream::~FrameStream()
+{
+    if ( png.is_open() ) {
+        png.close();
+        remove( ( output + ".part" ).c_str() );
+    }
+}
+
+/**
+ * Creates the .part file of the output.
+ * @return False if it can not be written, otherwise return True.
+ */
+bool FrameStream::open( const BatchJob& job, const std::string& output )
+{
+    this->job = &job;
+    this->output = output;
+    return png.open( ( output + ".part" ).c_str(), job.width, job.height, job.png_level );
+}
+
+/**
+ * Tone maps finished rows of the frame and adds them to the file.
+ * @param colors The colors of the whole frame.
+ * @param first The lowest finished row, count rows from there up are added,
+ *  the top one first.
+ */
+void FrameStream::add_rows( const Color3* colors, size_t first, size_t count )
+{
+    size_t row_size = 4 * size_t( job->width );
+    rows.resize( row_size * count );
+    tonemap_image( colors + first * job->width, &rows[0], count * job->width, job->tonemap );
+    for ( size_t i = count; i-- > 0; )
+        png.add_rows( &rows[i * row_size], 1 );
+}
+
+/**
+ * Finishes the file and moves it to the output.
+ * @return False if it could not be written or is missing rows, otherwise
+ *  return True.
+ */
+bool FrameStream::close()
+{
+    std::string partial = output + ".part";
+    if ( !png.close() ) {
+        remove( partial.c_str() );
+        return false;
+    }
+    return rename( partial.c_str(), output.c_str() ) == 0;
+}
+
+/**
+ * Writes a rendered frame to its output, denoised if the job asks for it,
+ * and its AOVs if it has any. Depth, object ids and sample counts are
+ * always stored as full floats, the other channels follow the exr setting
+ * of the job.
+ * @param aovs The AOVs of the frame, or NULL.
+ * @param streamed The output was already written by a FrameStream, only
+ *  the AOVs are left.
+ * @return False if a file can not be written, otherwise return True.
+ */
+bool save_frame( const BatchJob& job, const std::string& output,
+                 const Color3* colors, const AovPixel* aovs, bool streamed )
+{
+    size_t count = size_t( job.width ) * job.height;
+    // the direct and indirect split is of the colors as rendered
+    std::vector< Color3 > denoised;
+    const Color3* image = colors;
+    if ( aovs && job.denoise.passes > 0 ) {
+        denoised.assign( colors, colors + count );
+        denoise_image( &denoised[0], aovs, job.width, job.height, job.denoise );
+        image = &denoised[0];
+    }
+
+    int mask = aovs ? job.aovs : 0;
+    std::string aov_output = aov_filename( output );
+    if ( !mask || aov_output != output ) {
+        if ( !streamed && !save_render( output.c_str(), image, job.width, job.height,
+                                        job.tonemap, job.exr_half, job.png_level ) )
+            return false;
+        if ( !mask )
+            return true;
+    }
+
+    bool half = job.exr_half;
+    std::vector< ExrChannel > channels;
+    exr_add_colors( &channels, "", image, count, half );
+    if ( mask & AOV_DEPTH )
+        add_aov_channel( &channels, "Z", aovs, count, false, []( const AovPixel& p ) { return p.depth; } );
+    if ( mask & AOV_NORMAL ) {
+        add_aov_channel( &channels, "N.X", aovs, count, half, []( const AovPixel& p ) { return p.normal.x; } );
+        add_aov_channel( &channels, "N.Y", aovs, count, half, []( const AovPixel& p ) { return p.normal.y; } );
+        add_aov_channel( &channels, "N.Z", aovs, count, half, []( const AovPixel& p ) { return p.normal.z; } );
+    }
+    if ( mask & AOV_ALBEDO ) {
+        std::vector< Color3 > albedo( count );
+        for ( size_t i = 0; i < count; ++i )
+            albedo[i] = aovs[i].albedo;
+        exr_add_colors( &channels, "albedo", &albedo[0], count, half );
+    }
+    if ( mask & AOV_OBJECT_ID )
+        add_aov_channel( &channels, "id", aovs, count, false, []( const AovPixel& p ) { return p.object_id; } );
+    if ( mask & AOV_DIRECT ) {
+        std::vector< Color3 > direct( count ), indirect( count );
+        for ( size_t i = 0; i < count; ++i ) {
+            direct[i] = aovs[i].direct;
+            indirect[i] = colors[i] - aovs[i].direct;
+        }
+        exr_add_colors( &channels, "direct", &direct[0], count, half );
+        exr_add_colors( &channels, "indirect", &indirect[0], count, half );
+    }
+    if ( mask & AOV_VARIANCE ) {
+        add_aov_channel( &channels, "variance.direct", aovs, count, false,
+                         []( const AovPixel& p ) { return p.direct_variance; } );
+        add_aov_channel( &channels, "variance.indirect", aovs, count, false,
+                         []( const AovPixel& p ) { return p.indirect_variance; } );
+    }
+    if ( mask & AOV_SAMPLES )
+        add_aov_channel( &channels, "samples", aovs, count, false, []( const AovPixel& p ) { return p.samples; } );
+    return hdr_save_exr_channels( aov_output.c_str(), channels, job.width, job.height );
+}
+
+} /* _462 */
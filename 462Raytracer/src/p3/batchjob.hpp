@@ -0,0 +1,145 @@
+/**
+ * @file batchjob.hpp
+ * @brief Jobs of the batch renderer
+ *
+ * A manifest has one job per line, as key=value pairs separated by
+ * spaces. Empty lines and lines starting with '#' are skipped.
+ *
+ *   scene=<file>            the scene to render, required
+ *   output=<file>           the image to write, required; .exr and .pfm
+ *                           files keep the float colors, other names are
+ *                           tone mapped and written as png
+ *   width=<n> height=<n>    image size, 800x600 by default
+ *   samples=<n>             samples per pixel, 1 by default
+ *   skybox=<dir>            cube map directory
+ *   env_light=<n>           light the scene with the skybox too, with n
+ *                           shadow rays per lit point; 0, off, by default
+ *   gloss=<r>               gloss effect value
+ *   shadow_cache=<0|1>      cache the last occluder of every light
+ *   node_stats=<0|1>        print the pixels traced on every memory node
+ *                           and their time, on machines with several
+ *   position=<x,y,z>        camera position, the scene camera by default
+ *   orientation=<x,y,z,a>   camera rotation as axis and radians
+ *   fov=<r>                 camera field of view in radians
+ *   time=<r>                time of the scene animation in seconds, 0 by default
+ *   frames=<n>              render n frames of the animation from time on,
+ *                           numbered output_0000.png, output_0001.png, ...
+ *   fps=<r>                 frames per second of the sequence, 24 by default
+ *   exposure=<r>            tone map scale in stops, 0 by default
+ *   gamma=<r>               tone map display gamma, 1 (linear) by default
+ *   exr=<half|float>        exr channel precision, half by default
+ *   png_level=<n>           zlib level of png output, from 1, fastest, to 9,
+ *                           smallest; 0 stores it uncompressed, 6 by default
+ *   aovs=<list>             extra buffers to write, a comma separated list of
+ *                           depth, normal, albedo, id, direct, variance,
+ *                           samples or all.
+ *                           They go into the output as more channels if it
+ *                           is an exr file, otherwise into output.aov.exr
+ *                           along with the colors.
+ *   denoise=<n>             filter the noise with n passes of the denoiser,
+ *                           5 is a good start, 12 at most; 0, off, by
+ *                           default
+ *   denoise_sigma=<r>       lighting difference the denoiser still blurs,
+ *                           in standard deviations of the noise, 4 by default
+ *
+ * The frames of a sequence share one raytracer, each frame only refits the
+ * trees of the geometries that moved since the last one. Png output that
+ * is not denoised is compressed and written while the frame renders.
+ */
+
+#ifndef _462_BATCHJOB_HPP_
+#define _462_BATCHJOB_HPP_
+
+#include "scene/scene.hpp"
+#include "p3/raytracer.hpp"
+#include "application/hdrimage.hpp"
+#include "p3/denoise.hpp"
+#include "application/pngstream.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace _462 {
+
+struct BatchJob
+{
+    // the manifest line the job was parsed from
+    std::string text;
+    // line of the job in the manifest
+    int line;
+    std::string scene_filename;
+    std::string skybox_filename;
+    std::string output_filename;
+    int width, height;
+    int num_samples;
+    RaytracerOptions raytracer_opt;
+    // camera overrides, the scene camera is used for those not given
+    bool has_position, has_orientation, has_fov;
+    Vector3 position;
+    Quaternion orientation;
+    real_t fov;
+    // animation time of the first frame, number of frames and frame rate
+    real_t time;
+    int num_frames;
+    real_t fps;
+    // how png output is made from the float colors, and the precision of exr output
+    ToneMap tonemap;
+    bool exr_half;
+    int png_level;
+    // AovChannel bits of the AOVs to write, raytracer_opt.aovs also has
+    // the ones the denoiser needs
+    int aovs;
+    DenoiseOptions denoise;
+};
+
+/**
+ * The png output of a frame, written while the frame renders. It goes to
+ * a .part file first, which replaces the output once it is complete.
+ */
+class FrameStream
+{
+public:
+    FrameStream();
+    ~FrameStream();
+
+    bool open( const BatchJob& job, const std::string& output );
+    void add_rows( const Color3* colors, size_t first, size_t count );
+    bool close();
+
+    bool is_open() const { return png.is_open(); }
+
+private:
+    const BatchJob* job;
+    std::string output;
+    PngStream png;
+    // tone mapped rows on their way to the stream
+    std::vector< unsigned char > rows;
+};
+
+// a scene with its assets and trees, kept between the jobs that use it
+struct LoadedScene
+{
+    Scene scene;
+    Camera camera;
+    Raytracer raytracer;
+};
+
+bool parse_job( const std::string& text, BatchJob* job );
+bool read_manifest( const char* filename, std::vector< BatchJob >* jobs );
+
+std::string scene_key( const BatchJob& job );
+LoadedScene* load_job_scene( const BatchJob& job );
+bool prepare_frame( const BatchJob& job, LoadedScene* loaded, real_t time );
+
+real_t frame_time( const BatchJob& job, int frame );
+std::string frame_filename( const BatchJob& job, int frame );
+std::string aov_filename( const std::string& output );
+bool streams_output( const BatchJob& job, const std::string& output );
+bool save_frame( const BatchJob& job, const std::string& output,
+                 const Color3* colors, const AovPixel* aovs, bool streamed );
+double elapsed_ms( std::chrono::steady_clock::time_point start );
+
+} /* _462 */
+
+#endif /* _462_BATCHJOB_HPP_ */
@@ -0,0 +1,310 @@
+/**
+ * @file denoise.cpp
+ * @brief Denoising renders with their AOVs as guides
+ *
+ * Every pass reads a 5x5 B3 spline kernel whose taps are 2^pass pixels
+ * apart, so five passes cover 125 pixels while reading 25 taps each.
+ *
+ * The direct and the indirect lighting are filtered apart, as reflections
+ * have edges the guides do not show. The direct lighting is divided by
+ * the albedo first and multiplied by it at the end, so textures stay
+ * sharp. Lighting differences are measured against the noise the samples
+ * of the pixels showed, as in SVGF (Schied et al. 2017): where the samples
+ * agreed only similar neighbors are blended, and the variance left after
+ * every pass is carried along, so the weight tightens as the noise goes.
+ */
+
+#include "p3/denoise.hpp"
+#include "math/simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace _462 {
+
+#define DEFAULT_DENOISE_PASSES 5
+#define DEFAULT_SIGMA_COLOR 4
+#define DEFAULT_SIGMA_DEPTH 0.05
+#define DEFAULT_SIGMA_ALBEDO 0.1
+// albedo below this is not divided out, it would only amplify the noise
+#define DENOISE_MIN_ALBEDO 0.01f
+// keeps the color weight finite where there is no noise at all
+#define DENOISE_MIN_DEVIATION 1e-4f
+// averaged normals shorter than this come from samples on different surfaces
+#define MIXED_NORMAL_LENGTH 0.95
+
+// weights of the taps of a pass along one axis
+static const float KERNEL[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+// rec. 709 luminance of the rgb lanes
+static const float LUMINANCE[4] = { 0.2126f, 0.7152f, 0.0722f, 0.0f };
+// masks the lanes of a tap summed with weight w, the colors, and with w^2,
+// the variance
+static const float VARIANCE_WEIGHTS[2][4] = { { 1, 1, 1, 0 }, { 0, 0, 0, 1 } };
+
+// what the filter compares of a pixel, laid out for Vec4f loads
+struct DenoiseGuide
+{
+    float normal[4];
+    float albedo[4];
+    float depth;
+    int object_id;
+    // the albedo divided out of the direct lighting
+    float modulation[4];
+};
+
+// the lighting of a pixel: the direct rgb and its luminance variance, then
+// the same of the indirect lighting
+#define LIGHTING_FLOATS 8
+
+DenoiseOptions default_denoise_options()
+{
+    DenoiseOptions opt = { DEFAULT_DENOISE_PASSES, DEFAULT_SIGMA_COLOR,
+                           DEFAULT_SIGMA_DEPTH, DEFAULT_SIGMA_ALBEDO };
+    return opt;
+}
+
+// the albedo the lighting of a pixel is divided by
+static float modulation( real_t albedo )
+{
+    return albedo > DENOISE_MIN_ALBEDO ? float( albedo ) : 1.0f;
+}
+
+// normal weight, cos^64 of the angle between the normals
+static float normal_weight( float cos_n )
+{
+    float w = std::max( cos_n, 0.0f );
+    for ( int i = 0; i < 6; ++i )
+        w *= w;
+    return w;
+}
+
+// geometry weight of a tap, without the kernel, 0 across edges of the guides
+static float guide_weight( const DenoiseGuide& gp, const DenoiseGuide& gq,
+                           float inv_depth, float inv_sigma_albedo2 )
+{
+    if ( gq.object_id != gp.object_id )
+        return 0;
+    Vec4f da = Vec4f::load( gq.albedo ) - Vec4f::load( gp.albedo );
+    float e = dot3( da, da ) * inv_sigma_albedo2 + std::fabs( gq.depth - gp.depth ) * inv_depth;
+    // the background has no normals to compare
+    float wn = gp.object_id < 0 ? 1.0f
+        : normal_weight( dot3( Vec4f::load( gp.normal ), Vec4f::load( gq.normal ) ) );
+    return wn * std::exp( -e );
+}
+
+/**
+ * Standard deviations of the direct and indirect lighting of every pixel,
+ * from their variance blurred over the 3x3 pixels around it, as a single
+ * pixel's estimate from a few samples is noisy itself.
+ */
+static void blur_deviation( const float* lighting, const DenoiseGuide* guides,
+                            int width, int height, float* deviation )
+{
+    static const float BLUR[3] = { 0.25f, 0.5f, 0.25f };
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for ( int y = 0; y < height; ++y ) {
+        for ( int x = 0; x < width; ++x ) {
+            size_t p = size_t( y ) * width + x;
+            float direct = 0, indirect = 0, weight = 0;
+            for ( int j = 0; j < 3; ++j ) {
+                int qy = y + j - 1;
+                for ( int i = 0; i < 3; ++i ) {
+                    int qx = x + i - 1;
+                    if ( qy < 0 || qy >= height || qx < 0 || qx >= width )
+                        continue;
+                    size_t q = size_t( qy ) * width + qx;
+                    if ( guides[q].object_id != guides[p].object_id )
+                        continue;
+                    float w = BLUR[i] * BLUR[j];
+                    direct += w * lighting[LIGHTING_FLOATS * q + 3];
+                    indirect += w * lighting[LIGHTING_FLOATS * q + 7];
+                    weight += w;
+                }
+            }
+            deviation[2 * p] = std::sqrt( direct / weight ) + DENOISE_MIN_DEVIATION;
+            deviation[2 * p + 1] = std::sqrt( indirect / weight ) + DENOISE_MIN_DEVIATION;
+        }
+    }
+}
+
+/**
+ * One pass of the filter, from in to out. The direct and the indirect
+ * lighting share the weights of the guides, each has its own color weight.
+ * @param step Distance between two taps in pixels.
+ * @param deviation Blurred deviations of the lighting, see blur_deviation.
+ */
+static void a_trous_pass( const float* in, float* out, const DenoiseGuide* guides,
+                          const float* deviation, int width, int height, int step,
+                          const DenoiseOptions& opt )
+{
+    float inv_sigma_albedo2 = float( 1 / ( opt.sigma_albedo * opt.sigma_albedo ) );
+    Vec4f lum_weights = Vec4f::load( LUMINANCE );
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for ( int y = 0; y < height; ++y ) {
+        for ( int x = 0; x < width; ++x ) {
+            size_t p = size_t( y ) * width + x;
+            const DenoiseGuide& gp = guides[p];
+            const float* lp = &in[LIGHTING_FLOATS * p];
+            float direct_lum = dot3( Vec4f::load( lp ), lum_weights );
+            float indirect_lum = dot3( Vec4f::load( lp + 4 ), lum_weights );
+            float inv_direct_dev = 1.0f / ( float( opt.sigma_color ) * deviation[2 * p] );
+            float inv_indirect_dev = 1.0f / ( float( opt.sigma_color ) * deviation[2 * p + 1] );
+            // the depth of a surface changes with the distance of the taps
+            float inv_depth = 1.0f / ( float( opt.sigma_depth ) * step * std::max( gp.depth, 1e-3f ) );
+
+            // lane 3 of the sums collects the variance, weighted by w^2
+            Vec4f direct_sum( 0.0f ), indirect_sum( 0.0f );
+            float direct_weight = 0, indirect_weight = 0;
+            for ( int j = 0; j < 5; ++j ) {
+                int qy = y + ( j - 2 ) * step;
+                if ( qy < 0 || qy >= height )
+                    continue;
+                for ( int i = 0; i < 5; ++i ) {
+                    int qx = x + ( i - 2 ) * step;
+                    if ( qx < 0 || qx >= width )
+                        continue;
+                    size_t q = size_t( qy ) * width + qx;
+                    float w = KERNEL[i] * KERNEL[j] * guide_weight( gp, guides[q], inv_depth, inv_sigma_albedo2 );
+                    if ( w < 1e-6f )
+                        continue;
+
+                    const float* lq = &in[LIGHTING_FLOATS * q];
+                    Vec4f dq = Vec4f::load( lq );
+                    Vec4f iq = Vec4f::load( lq + 4 );
+                    float wd = w * std::exp( -std::fabs( dot3( dq, lum_weights ) - direct_lum ) * inv_direct_dev );
+                    float wi = w * std::exp( -std::fabs( dot3( iq, lum_weights ) - indirect_lum ) * inv_indirect_dev );
+                    direct_sum = direct_sum + dq * Vec4f::load( VARIANCE_WEIGHTS[0] ) * Vec4f( wd )
+                                 + dq * Vec4f::load( VARIANCE_WEIGHTS[1] ) * Vec4f( wd * wd );
+                    indirect_sum = indirect_sum + iq * Vec4f::load( VARIANCE_WEIGHTS[0] ) * Vec4f( wi )
+                                   + iq * Vec4f::load( VARIANCE_WEIGHTS[1] ) * Vec4f( wi * wi );
+                    direct_weight += wd;
+                    indirect_weight += wi;
+                }
+            }
+            // the center tap always has weight, so the sums are never 0
+            float norm_d[4], norm_i[4];
+            norm_d[0] = norm_d[1] = norm_d[2] = 1.0f / direct_weight;
+            norm_d[3] = norm_d[0] * norm_d[0];
+            norm_i[0] = norm_i[1] = norm_i[2] = 1.0f / indirect_weight;
+            norm_i[3] = norm_i[0] * norm_i[0];
+            ( direct_sum * Vec4f::load( norm_d ) ).store( &out[LIGHTING_FLOATS * p] );
+            ( indirect_sum * Vec4f::load( norm_i ) ).store( &out[LIGHTING_FLOATS * p + 4] );
+        }
+    }
+}
+
+/**
+ * Variance of the lighting of the pixels traced with a single sample,
+ * which have none of their own: the spread of the lighting over the
+ * 5x5 pixels of the same surface around them.
+ */
+static void spatial_variance( float* lighting, const DenoiseGuide* guides, const AovPixel* aovs,
+                              int width, int height )
+{
+    std::vector< float > variance( 2 * size_t( width ) * height, -1.0f );
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for ( int y = 0; y < height; ++y ) {
+        for ( int x = 0; x < width; ++x ) {
+            size_t p = size_t( y ) * width + x;
+            if ( aovs[p].samples > 1 )
+                continue;
+            float sum[2] = { 0, 0 }, sum2[2] = { 0, 0 };
+            int n = 0;
+            for ( int qy = std::max( y - 2, 0 ); qy <= std::min( y + 2, height - 1 ); ++qy ) {
+                for ( int qx = std::max( x - 2, 0 ); qx <= std::min( x + 2, width - 1 ); ++qx ) {
+                    size_t q = size_t( qy ) * width + qx;
+                    if ( guides[q].object_id != guides[p].object_id )
+                        continue;
+                    for ( int k = 0; k < 2; ++k ) {
+                        const float* l = &lighting[LIGHTING_FLOATS * q + 4 * k];
+                        float lum = LUMINANCE[0] * l[0] + LUMINANCE[1] * l[1] + LUMINANCE[2] * l[2];
+                        sum[k] += lum;
+                        sum2[k] += lum * lum;
+                    }
+                    n++;
+                }
+            }
+            for ( int k = 0; k < 2; ++k )
+                variance[2 * p + k] = std::max( sum2[k] / n - ( sum[k] / n ) * ( sum[k] / n ), 0.0f );
+        }
+    }
+    for ( size_t p = 0; p < variance.size() / 2; ++p ) {
+        if ( variance[2 * p] >= 0 ) {
+            lighting[LIGHTING_FLOATS * p + 3] = variance[2 * p];
+            lighting[LIGHTING_FLOATS * p + 7] = variance[2 * p + 1];
+        }
+    }
+}
+
+/**
+ * Denoises the colors of a render in place.
+ * @param aovs The AOVs of the render, with at least DENOISE_AOVS kept.
+ */
+void denoise_image( Color3* colors, const AovPixel* aovs, int width, int height,
+                    const DenoiseOptions& opt )
+{
+    if ( opt.passes <= 0 )
+        return;
+
+    size_t count = size_t( width ) * height;
+    std::vector< DenoiseGuide > guides( count );
+    std::vector< float > lighting( LIGHTING_FLOATS * count ), filtered( LIGHTING_FLOATS * count );
+    std::vector< float > deviation( 2 * count );
+
+#ifdef OPENMP
+#pragma omp parallel for
+#endif
+    for ( long i = 0; i < (long)count; ++i ) {
+        const AovPixel& aov = aovs[i];
+        DenoiseGuide& guide = guides[i];
+        // averaged normals are shorter at edges, only their direction counts
+        real_t len = length( aov.normal );
+        Vector3 normal = len > 0 ? aov.normal / len : Vector3::Zero();
+        float* light = &lighting[LIGHTING_FLOATS * i];
+        for ( int c = 0; c < 3; ++c ) {
+            guide.normal[c] = float( normal[c] );
+            guide.albedo[c] = float( aov.albedo[c] );
+            guide.modulation[c] = modulation( aov.albedo[c] );
+            light[c] = float( aov.direct[c] ) / guide.modulation[c];
+            light[4 + c] = float( colors[i][c] - aov.direct[c] );
+        }
+        guide.normal[3] = guide.albedo[3] = guide.modulation[3] = 0;
+        guide.depth = float( aov.depth );
+        // the samples of a pixel on an edge saw different surfaces, it is
+        // left as it is instead of being blended with either of them
+        guide.object_id = aov.object_id >= 0 && len < MIXED_NORMAL_LENGTH ? -2 - int( i ) : aov.object_id;
+        // the variance of the direct lighting is divided by the albedo as well
+        float lum_modulation = LUMINANCE[0] * guide.modulation[0] + LUMINANCE[1] * guide.modulation[1]
+                               + LUMINANCE[2] * guide.modulation[2];
+        light[3] = float( aov.direct_variance ) / ( lum_modulation * lum_modulation );
+        light[7] = float( aov.indirect_variance );
+    }
+    spatial_variance( &lighting[0], &guides[0], aovs, width, height );
+
+    // passes wider than the image would only compare pixels with themselves
+    for ( int pass = 0; pass < opt.passes && pass < DENOISE_MAX_PASSES
+                        && ( 1 << pass ) < std::max( width, height ); ++pass ) {
+        blur_deviation( &lighting[0], &guides[0], width, height, &deviation[0] );
+        a_trous_pass( &lighting[0], &filtered[0], &guides[0], &deviation[0],
+                      width, height, 1 << pass, opt );
+        lighting.swap( filtered );
+    }
+
+#ifdef OPENMP
+#pragma omp parallel for
+#endif
+    for ( long i = 0; i < (long)count; ++i ) {
+        const float* light = &lighting[LIGHTING_FLOATS * i];
+        for ( int c = 0; c < 3; ++c )
+            colors[i][c] = light[c] * guides[i].modulation[c] + light[4 + c];
+    }
+}
+
+} /* _462 */
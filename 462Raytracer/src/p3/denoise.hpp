@@ -0,0 +1,46 @@
+/**
+ * @file denoise.hpp
+ * @brief Denoising renders with their AOVs as guides
+ *
+ * An edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). The
+ * lighting is blurred over ever wider footprints, but not across the
+ * edges the depth, normal, albedo and object id buffers of the render
+ * show, nor across jumps in the lighting larger than its noise. A few samples per
+ * pixel then look like many more, as long as the noise is finer than the
+ * widest pass.
+ */
+
+#ifndef _462_DENOISE_HPP_
+#define _462_DENOISE_HPP_
+
+#include "p3/raytracer.hpp"
+
+namespace _462 {
+
+// the AOVs the denoiser needs from the raytracer
+#define DENOISE_AOVS ( AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO | AOV_OBJECT_ID | AOV_DIRECT | AOV_VARIANCE )
+// the most passes; the taps of the last one are 2048 pixels apart
+#define DENOISE_MAX_PASSES 12
+
+struct DenoiseOptions
+{
+    // filter passes, the footprint doubles with each; 0 turns it off, at
+    // most DENOISE_MAX_PASSES
+    int passes;
+    // lighting difference that still gets blurred together, in standard
+    // deviations of the noise of the pixel; the higher the smoother
+    real_t sigma_color;
+    // relative depth difference per pixel between the same surface
+    real_t sigma_depth;
+    // albedo difference between the same surface
+    real_t sigma_albedo;
+};
+
+DenoiseOptions default_denoise_options();
+
+void denoise_image( Color3* colors, const AovPixel* aovs, int width, int height,
+                    const DenoiseOptions& opt );
+
+} /* _462 */
+
+#endif /* _462_DENOISE_HPP_ */
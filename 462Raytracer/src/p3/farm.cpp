@@ -0,0 +1,673 @@
+/**
+ * @file farm.cpp
+ * @brief Rendering batch jobs on worker processes
+ *
+ * Every message is a type and a payload length followed by the payload,
+ * all integers in network byte order. The coordinator sends a frame as the
+ * manifest line of its job, with the time of the frame appended, and then
+ * tiles of it. A worker answers the frame once it has loaded it, or with a
+ * failure if it cannot load or initialize it, and then every tile with its
+ * pixels.
+ */
+
+#include "p3/farm.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace _462 {
+
+// size of the square tiles frames are split into
+#define FARM_TILE_SIZE 32
+// tiles sent to a worker ahead of its results, so it never waits for the next one
+#define FARM_TILES_IN_FLIGHT 2
+// how long a worker keeps trying to reach the coordinator, in seconds
+#define FARM_CONNECT_RETRIES 30
+// floats sent for the AOVs of a pixel
+#define FARM_AOV_FLOATS 15
+// largest payload of a message, that of a full tile with AOVs
+#define FARM_MAX_MESSAGE ( 20 + ( 12 + 4 * FARM_AOV_FLOATS ) * FARM_TILE_SIZE * FARM_TILE_SIZE )
+// seconds a worker gets for a tile before it is taken as hung, or that many
+// times the slowest tile of the frame if longer
+#define FARM_TILE_TIMEOUT 60
+#define FARM_TILE_TIMEOUT_FACTOR 8
+// longest wait for a message before deadlines are checked, in milliseconds
+#define FARM_POLL_MS 1000
+
+enum FarmMessage
+{
+    // coordinator to worker: frame id, then the manifest line of the frame
+    FARM_FRAME = 1,
+    // coordinator to worker: frame id, x, y, width, height
+    FARM_TILE = 2,
+    // worker to coordinator: the tile, then its pixels as 3 floats each,
+    // then FARM_AOV_FLOATS floats per pixel if the job keeps AOVs
+    FARM_RESULT = 3,
+    // worker to coordinator: frame id of a frame it cannot render
+    FARM_FAILED = 4,
+    // coordinator to worker: no more work
+    FARM_QUIT = 5,
+    // worker to coordinator: frame id of a frame it has loaded and is
+    // about to render the tiles of
+    FARM_READY = 6
+};
+
+struct FarmTile
+{
+    uint32_t frame;
+    uint32_t x, y, width, height;
+};
+
+#ifndef _WIN32
+
+static bool send_all( int fd, const void* data, size_t size )
+{
+    const char* p = (const char*)data;
+    while ( size > 0 ) {
+        ssize_t n = send( fd, p, size, MSG_NOSIGNAL );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+        p += n;
+        size -= size_t( n );
+    }
+    return true;
+}
+
+static bool recv_all( int fd, void* data, size_t size )
+{
+    char* p = (char*)data;
+    while ( size > 0 ) {
+        ssize_t n = recv( fd, p, size, 0 );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+        p += n;
+        size -= size_t( n );
+    }
+    return true;
+}
+
+static bool send_message( int fd, uint32_t type, const void* payload, size_t size )
+{
+    uint32_t header[2] = { htonl( type ), htonl( uint32_t( size ) ) };
+    return send_all( fd, header, sizeof( header ) ) && ( size == 0 || send_all( fd, payload, size ) );
+}
+
+/**
+ * Reads one whole message.
+ * @return False if the connection was closed or broke, or the message is
+ *  longer than any valid one.
+ */
+static bool recv_message( int fd, uint32_t* type, std::vector< unsigned char >* payload )
+{
+    uint32_t header[2];
+    if ( !recv_all( fd, header, sizeof( header ) ) )
+        return false;
+    *type = ntohl( header[0] );
+    uint32_t size = ntohl( header[1] );
+    if ( size > FARM_MAX_MESSAGE )
+        return false;
+    payload->resize( size );
+    return payload->empty() || recv_all( fd, &( *payload )[0], payload->size() );
+}
+
+static void write_tile( unsigned char* out, const FarmTile& tile )
+{
+    uint32_t fields[5] = { htonl( tile.frame ), htonl( tile.x ), htonl( tile.y ),
+                           htonl( tile.width ), htonl( tile.height ) };
+    memcpy( out, fields, sizeof( fields ) );
+}
+
+static bool read_tile( const std::vector< unsigned char >& payload, FarmTile* tile )
+{
+    uint32_t fields[5];
+    if ( payload.size() < sizeof( fields ) )
+        return false;
+    memcpy( fields, &payload[0], sizeof( fields ) );
+    tile->frame = ntohl( fields[0] );
+    tile->x = ntohl( fields[1] );
+    tile->y = ntohl( fields[2] );
+    tile->width = ntohl( fields[3] );
+    tile->height = ntohl( fields[4] );
+    return true;
+}
+
+// colors travel as 32-bit floats, whatever the precision of real_t
+static void write_colors( unsigned char* out, const Color3* colors, size_t count )
+{
+    for ( size_t i = 0; i < count; ++i ) {
+        for ( int c = 0; c < 3; ++c ) {
+            float value = float( colors[i][c] );
+            uint32_t bits;
+            memcpy( &bits, &value, 4 );
+            bits = htonl( bits );
+            memcpy( out + 4 * ( 3 * i + c ), &bits, 4 );
+        }
+    }
+}
+
+static void read_colors( const unsigned char* in, Color3* colors, size_t count )
+{
+    for ( size_t i = 0; i < count; ++i ) {
+        for ( int c = 0; c < 3; ++c ) {
+            uint32_t bits;
+            memcpy( &bits, in + 4 * ( 3 * i + c ), 4 );
+            bits = ntohl( bits );
+            float value;
+            memcpy( &value, &bits, 4 );
+            colors[i][c] = value;
+        }
+    }
+}
+
+static void write_aov( unsigned char* out, const AovPixel& aov )
+{
+    Color3 values[5] = { Color3( aov.depth, aov.normal.x, aov.normal.y ),
+                         Color3( aov.normal.z, aov.albedo.r, aov.albedo.g ),
+                         Color3( aov.albedo.b, aov.direct.r, aov.direct.g ),
+                         Color3( aov.direct.b, aov.direct_variance, aov.indirect_variance ),
+                         Color3( real_t( aov.object_id ), real_t( aov.samples ), 0 ) };
+    write_colors( out, values, 5 );
+}
+
+static void read_aov( const unsigned char* in, AovPixel* aov )
+{
+    Color3 values[5];
+    read_colors( in, values, 5 );
+    aov->depth = values[0].r;
+    aov->normal = Vector3( values[0].g, values[0].b, values[1].r );
+    aov->albedo = Color3( values[1].g, values[1].b, values[2].r );
+    aov->direct = Color3( values[2].g, values[2].b, values[3].r );
+    aov->direct_variance = values[3].g;
+    aov->indirect_variance = values[3].b;
+    aov->object_id = int( values[4].r );
+    aov->samples = int( values[4].g );
+}
+
+// a tile sent to a worker, and since when the worker has been on it
+struct FarmAssignment
+{
+    FarmTile tile;
+    std::chrono::steady_clock::time_point started;
+};
+
+// a connected worker and the tiles it has not answered yet
+struct FarmWorker
+{
+    int fd;
+    std::string name;
+    // the last frame sent to the worker, 0 if none
+    uint32_t frame;
+    // whether the worker has loaded that frame; its tiles only run against
+    // the clock from then on
+    bool ready;
+    std::vector< FarmAssignment > assigned;
+    size_t tiles_done;
+};
+
+static int listen_on( int port )
+{
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if ( fd < 0 )
+        return -1;
+    int one = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_ANY );
+    addr.sin_port = htons( uint16_t( port ) );
+    if ( bind( fd, (sockaddr*)&addr, sizeof( addr ) ) != 0 || listen( fd, 64 ) != 0 ) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_worker( int listen_fd, std::vector< FarmWorker >* workers )
+{
+    sockaddr_in addr;
+    socklen_t len = sizeof( addr );
+    int fd = accept( listen_fd, (sockaddr*)&addr, &len );
+    if ( fd < 0 )
+        return;
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    setsockopt( fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof( one ) );
+    // a worker that stops halfway through a message is dropped
+    timeval timeout = { FARM_TILE_TIMEOUT, 0 };
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+
+    char host[INET_ADDRSTRLEN] = "?";
+    inet_ntop( AF_INET, &addr.sin_addr, host, sizeof( host ) );
+    char name[64];
+    snprintf( name, sizeof( name ), "%s:%d", host, int( ntohs( addr.sin_port ) ) );
+
+    FarmWorker worker = { fd, name, 0, false, std::vector< FarmAssignment >(), 0 };
+    workers->push_back( worker );
+    printf( "Worker %s connected, %lu workers\n", name, (unsigned long)workers->size() );
+}
+
+// closes a worker and puts its unanswered tiles of the current frame back in the queue
+static void drop_worker( std::vector< FarmWorker >* workers, size_t index,
+                         uint32_t frame, std::deque< FarmTile >* queue, const char* reason = "lost" )
+{
+    FarmWorker& worker = ( *workers )[index];
+    size_t requeued = 0;
+    for ( size_t i = 0; i < worker.assigned.size(); ++i ) {
+        if ( worker.assigned[i].tile.frame == frame ) {
+            queue->push_front( worker.assigned[i].tile );
+            requeued++;
+        }
+    }
+    printf( "Worker %s %s, %lu tiles requeued\n", worker.name.c_str(), reason, (unsigned long)requeued );
+    close( worker.fd );
+    workers->erase( workers->begin() + index );
+}
+
+/**
+ * Renders one frame on the workers.
+ * @param stream Gets every row of tiles once it is complete, or NULL.
+ * @return False if a worker could not render the frame.
+ */
+static bool render_frame_on_farm( const BatchJob& job, int frame_index, uint32_t frame,
+                                  int listen_fd, std::vector< FarmWorker >* workers,
+                                  Color3* image, AovPixel* aovs, FrameStream* stream )
+{
+    char time_text[64];
+    snprintf( time_text, sizeof( time_text ), " time=%.9g frames=1", double( frame_time( job, frame_index ) ) );
+    std::string text = job.text + time_text;
+    if ( 4 + text.size() > FARM_MAX_MESSAGE ) {
+        std::cout << "Manifest line too long to send to workers.\n";
+        return false;
+    }
+    std::vector< unsigned char > frame_message( 4 + text.size() );
+    uint32_t frame_net = htonl( frame );
+    memcpy( &frame_message[0], &frame_net, 4 );
+    memcpy( &frame_message[4], text.data(), text.size() );
+
+    // the top rows of tiles go first, the stream needs them first
+    int tile_rows = ( job.height + FARM_TILE_SIZE - 1 ) / FARM_TILE_SIZE;
+    int tiles_per_row = ( job.width + FARM_TILE_SIZE - 1 ) / FARM_TILE_SIZE;
+    std::vector< int > tiles_left( tile_rows, tiles_per_row );
+    int next_stream_row = tile_rows - 1;
+    std::deque< FarmTile > queue;
+    for ( int y = ( tile_rows - 1 ) * FARM_TILE_SIZE; y >= 0; y -= FARM_TILE_SIZE ) {
+        for ( int x = 0; x < job.width; x += FARM_TILE_SIZE ) {
+            FarmTile tile = { frame, uint32_t( x ), uint32_t( y ),
+                              uint32_t( std::min( FARM_TILE_SIZE, job.width - x ) ),
+                              uint32_t( std::min( FARM_TILE_SIZE, job.height - y ) ) };
+            queue.push_back( tile );
+        }
+    }
+    size_t remaining = queue.size();
+    for ( size_t i = 0; i < workers->size(); ++i )
+        ( *workers )[i].tiles_done = 0;
+
+    std::vector< unsigned char > payload;
+    bool waiting = false;
+    std::chrono::steady_clock::duration slowest_tile( 0 );
+    while ( remaining > 0 ) {
+        // keep every worker busy
+        for ( size_t i = 0; i < workers->size(); ) {
+            FarmWorker& worker = ( *workers )[i];
+            bool ok = true;
+            while ( ok && !queue.empty() && worker.assigned.size() < FARM_TILES_IN_FLIGHT ) {
+                if ( worker.frame != frame ) {
+                    ok = send_message( worker.fd, FARM_FRAME, &frame_message[0], frame_message.size() );
+                    worker.frame = frame;
+                    worker.ready = false;
+                }
+                unsigned char tile_message[20];
+                write_tile( tile_message, queue.front() );
+                ok = ok && send_message( worker.fd, FARM_TILE, tile_message, sizeof( tile_message ) );
+                if ( ok ) {
+                    FarmAssignment assignment = { queue.front(), std::chrono::steady_clock::now() };
+                    worker.assigned.push_back( assignment );
+                    queue.pop_front();
+                }
+            }
+            if ( ok )
+                i++;
+            else
+                drop_worker( workers, i, frame, &queue );
+        }
+
+        if ( workers->empty() && !waiting )
+            printf( "Waiting for workers...\n" );
+        waiting = workers->empty();
+
+        std::vector< pollfd > fds( workers->size() + 1 );
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for ( size_t i = 0; i < workers->size(); ++i ) {
+            fds[i + 1].fd = ( *workers )[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if ( poll( &fds[0], fds.size(), FARM_POLL_MS ) < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            return false;
+        }
+
+        // answers first, workers dropped here shift the ones after them
+        for ( size_t i = fds.size() - 1; i > 0; --i ) {
+            if ( !fds[i].revents )
+                continue;
+            FarmWorker& worker = ( *workers )[i - 1];
+            uint32_t type;
+            if ( !recv_message( worker.fd, &type, &payload ) ) {
+                drop_worker( workers, i - 1, frame, &queue );
+                continue;
+            }
+
+            if ( type == FARM_FAILED ) {
+                printf( "Worker %s failed to render the frame\n", worker.name.c_str() );
+                for ( size_t j = 0; j < workers->size(); ++j )
+                    ( *workers )[j].assigned.clear();
+                return false;
+            }
+
+            // loading the scene does not count against the first tiles
+            if ( type == FARM_READY && payload.size() == 4 ) {
+                uint32_t ready_frame;
+                memcpy( &ready_frame, &payload[0], 4 );
+                if ( ntohl( ready_frame ) == frame && worker.frame == frame ) {
+                    worker.ready = true;
+                    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                    for ( size_t j = 0; j < worker.assigned.size(); ++j )
+                        worker.assigned[j].started = now;
+                }
+                continue;
+            }
+
+            FarmTile tile;
+            if ( type != FARM_RESULT || !read_tile( payload, &tile ) ) {
+                drop_worker( workers, i - 1, frame, &queue );
+                continue;
+            }
+            // results of an earlier, failed frame may still arrive
+            if ( tile.frame != frame )
+                continue;
+
+            size_t k = 0;
+            while ( k < worker.assigned.size() && !( worker.assigned[k].tile.x == tile.x && worker.assigned[k].tile.y == tile.y
+                                                     && worker.assigned[k].tile.frame == frame ) )
+                k++;
+            size_t row_size = 12 * size_t( tile.width );
+            size_t aov_size = aovs ? 4 * FARM_AOV_FLOATS : 0;
+            size_t num_pixels = size_t( tile.width ) * tile.height;
+            if ( k == worker.assigned.size() || tile.width != worker.assigned[k].tile.width
+                 || tile.height != worker.assigned[k].tile.height
+                 || payload.size() != 20 + ( 12 + aov_size ) * num_pixels ) {
+                drop_worker( workers, i - 1, frame, &queue );
+                continue;
+            }
+            for ( uint32_t row = 0; row < tile.height; ++row ) {
+                read_colors( &payload[20 + row * row_size],
+                             image + size_t( tile.y + row ) * job.width + tile.x, tile.width );
+            }
+            for ( size_t p = 0; aovs && p < num_pixels; ++p ) {
+                size_t index = size_t( tile.y + p / tile.width ) * job.width + tile.x + p % tile.width;
+                read_aov( &payload[20 + 12 * num_pixels + aov_size * p], &aovs[index] );
+            }
+            // tiles are rendered in order, the next one starts now
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            slowest_tile = std::max( slowest_tile, now - worker.assigned[k].started );
+            worker.assigned.erase( worker.assigned.begin() + k );
+            for ( size_t j = 0; j < worker.assigned.size(); ++j )
+                worker.assigned[j].started = now;
+            worker.tiles_done++;
+            remaining--;
+
+            tiles_left[tile.y / FARM_TILE_SIZE]--;
+            while ( stream && next_stream_row >= 0 && tiles_left[next_stream_row] == 0 ) {
+                int y = next_stream_row * FARM_TILE_SIZE;
+                stream->add_rows( image, y, std::min( FARM_TILE_SIZE, job.height - y ) );
+                next_stream_row--;
+            }
+        }
+
+        // workers that take far longer than the others on a tile are taken
+        // as hung, and their tiles go to the rest. Workers still loading
+        // the frame are not timed.
+        std::chrono::steady_clock::duration timeout = std::max<std::chrono::steady_clock::duration>(
+            std::chrono::seconds( FARM_TILE_TIMEOUT ), FARM_TILE_TIMEOUT_FACTOR * slowest_tile );
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for ( size_t i = workers->size(); i > 0; --i ) {
+            const FarmWorker& worker = ( *workers )[i - 1];
+            const std::vector< FarmAssignment >& assigned = worker.assigned;
+            if ( worker.ready && !assigned.empty() && assigned[0].tile.frame == frame
+                 && now - assigned[0].started > timeout )
+                drop_worker( workers, i - 1, frame, &queue, "timed out" );
+        }
+
+        if ( fds[0].revents )
+            accept_worker( listen_fd, workers );
+    }
+
+    for ( size_t i = 0; i < workers->size(); ++i ) {
+        printf( "  %s rendered %lu tiles\n", ( *workers )[i].name.c_str(),
+                (unsigned long)( *workers )[i].tiles_done );
+    }
+    return true;
+}
+
+/**
+ * Renders all frames of all jobs on the workers that connect to the port,
+ * and saves them here.
+ * @return the number of failed jobs, -1 if the port can not be listened on.
+ */
+int run_coordinator( const std::vector< BatchJob >& jobs, int port )
+{
+    int listen_fd = listen_on( port );
+    if ( listen_fd < 0 ) {
+        std::cout << "Cannot listen on port " << port << ".\n";
+        return -1;
+    }
+    printf( "Listening for workers on port %d\n", port );
+
+    std::vector< FarmWorker > workers;
+    std::chrono::steady_clock::time_point batch_start = std::chrono::steady_clock::now();
+    uint32_t frame = 0;
+    int failed = 0;
+    for ( size_t i = 0; i < jobs.size(); ++i ) {
+        const BatchJob& job = jobs[i];
+        printf( "Job %lu of %lu (line %d): %s\n", (unsigned long)( i + 1 ),
+                (unsigned long)jobs.size(), job.line, job.scene_filename.c_str() );
+        std::vector< Color3 > image( size_t( job.width ) * size_t( job.height ) );
+        std::vector< AovPixel > aovs( job.raytracer_opt.aovs ? image.size() : 0 );
+        AovPixel* aovs_data = aovs.empty() ? NULL : &aovs[0];
+        bool ok = true;
+        for ( int f = 0; ok && f < job.num_frames; ++f ) {
+            std::string output = frame_filename( job, f );
+            FrameStream stream;
+            bool streamed = streams_output( job, output );
+            if ( streamed && !stream.open( job, output ) ) {
+                std::cout << "Error saving raytraced image to '" << output << "'.\n";
+                ok = false;
+                break;
+            }
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            ok = render_frame_on_farm( job, f, ++frame, listen_fd, &workers, &image[0], aovs_data,
+                                       streamed ? &stream : NULL );
+            if ( !ok )
+                break;
+            double render_ms = elapsed_ms( start );
+            if ( ( streamed && !stream.close() )
+                 || !save_frame( job, output, &image[0], aovs_data, streamed ) ) {
+                std::cout << "Error saving raytraced image to '" << output << "'.\n";
+                ok = false;
+                break;
+            }
+            printf( "Saved '%s' (%dx%d, %d samples): render %.0f ms on %lu workers\n",
+                    output.c_str(), job.width, job.height, job.num_samples, render_ms,
+                    (unsigned long)workers.size() );
+        }
+        if ( !ok )
+            failed++;
+    }
+
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        send_message( workers[i].fd, FARM_QUIT, NULL, 0 );
+        close( workers[i].fd );
+    }
+    close( listen_fd );
+    printf( "Rendered %lu of %lu jobs in %.0f ms\n", (unsigned long)( jobs.size() - failed ),
+            (unsigned long)jobs.size(), elapsed_ms( batch_start ) );
+    return failed;
+}
+
+static int connect_to( const char* address )
+{
+    std::string text( address );
+    size_t colon = text.rfind( ':' );
+    if ( colon == std::string::npos ) {
+        std::cout << "Expected host:port, got '" << address << "'.\n";
+        return -1;
+    }
+    std::string host = text.substr( 0, colon );
+    std::string port = text.substr( colon + 1 );
+
+    addrinfo hints;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    // the coordinator may still be starting
+    for ( int attempt = 0; attempt < FARM_CONNECT_RETRIES; ++attempt ) {
+        addrinfo* result = NULL;
+        if ( getaddrinfo( host.c_str(), port.c_str(), &hints, &result ) == 0 ) {
+            for ( addrinfo* ai = result; ai; ai = ai->ai_next ) {
+                int fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+                if ( fd < 0 )
+                    continue;
+                if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 ) {
+                    freeaddrinfo( result );
+                    int one = 1;
+                    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+                    return fd;
+                }
+                close( fd );
+            }
+            freeaddrinfo( result );
+        }
+        sleep( 1 );
+    }
+    std::cout << "Cannot connect to '" << address << "'.\n";
+    return -1;
+}
+
+/**
+ * Renders the tiles a coordinator hands out until it has no more work.
+ * Scenes are loaded once and kept while the frames use them.
+ * @return False if the coordinator could not be reached.
+ */
+bool run_worker( const char* address )
+{
+    int fd = connect_to( address );
+    if ( fd < 0 )
+        return false;
+    printf( "Connected to %s\n", address );
+
+    LoadedScene* loaded = NULL;
+    std::string loaded_key;
+    BatchJob job;
+    uint32_t frame = 0;
+    bool ready = false;
+    size_t tiles = 0;
+    std::vector< unsigned char > payload;
+    std::vector< unsigned char > result;
+    std::vector< Color3 > colors;
+    uint32_t type;
+    while ( recv_message( fd, &type, &payload ) && type != FARM_QUIT ) {
+        if ( type == FARM_FRAME && payload.size() >= 4 ) {
+            uint32_t frame_net;
+            memcpy( &frame_net, &payload[0], 4 );
+            frame = ntohl( frame_net );
+            std::string text( payload.begin() + 4, payload.end() );
+            ready = parse_job( text, &job );
+            if ( ready && ( !loaded || scene_key( job ) != loaded_key ) ) {
+                delete loaded;
+                loaded = load_job_scene( job );
+                loaded_key = scene_key( job );
+            }
+            ready = ready && loaded && prepare_frame( job, loaded, job.time );
+            if ( !ready ) {
+                std::cout << "Cannot render frame " << frame << ".\n";
+                if ( !send_message( fd, FARM_FAILED, &frame_net, 4 ) )
+                    break;
+            } else if ( !send_message( fd, FARM_READY, &frame_net, 4 ) ) {
+                break;
+            }
+        } else if ( type == FARM_TILE ) {
+            FarmTile tile;
+            if ( !read_tile( payload, &tile ) )
+                break;
+            // tiles of a frame that failed are not answered
+            if ( !ready || tile.frame != frame )
+                continue;
+            if ( tile.x + tile.width > uint32_t( job.width ) || tile.y + tile.height > uint32_t( job.height ) )
+                break;
+            size_t num_pixels = size_t( tile.width ) * tile.height;
+            colors.resize( num_pixels );
+            loaded->raytracer.raytrace_tile( &colors[0], tile.x, tile.y, tile.width, tile.height );
+            const AovPixel* aovs = loaded->raytracer.get_aovs();
+            result.resize( 20 + ( 12 + ( aovs ? 4 * FARM_AOV_FLOATS : 0 ) ) * num_pixels );
+            write_tile( &result[0], tile );
+            write_colors( &result[20], &colors[0], num_pixels );
+            for ( size_t p = 0; aovs && p < num_pixels; ++p ) {
+                size_t index = size_t( tile.y + p / tile.width ) * job.width + tile.x + p % tile.width;
+                write_aov( &result[20 + 12 * num_pixels + 4 * FARM_AOV_FLOATS * p], aovs[index] );
+            }
+            if ( !send_message( fd, FARM_RESULT, &result[0], result.size() ) )
+                break;
+            tiles++;
+        } else {
+            break;
+        }
+    }
+
+    delete loaded;
+    close( fd );
+    printf( "Rendered %lu tiles\n", (unsigned long)tiles );
+    return true;
+}
+
+#else
+
+int run_coordinator( const std::vector< BatchJob >& jobs, int port )
+{
+    std::cout << "Render workers are not supported on this platform.\n";
+    return -1;
+}
+
+bool run_worker( const char* address )
+{
+    std::cout << "Render workers are not supported on this platform.\n";
+    return false;
+}
+
+#endif
+
+} /* _462 */
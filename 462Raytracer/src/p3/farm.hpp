@@ -0,0 +1,26 @@
+/**
+ * @file farm.hpp
+ * @brief Rendering batch jobs on worker processes
+ *
+ * The coordinator listens on a port and splits every frame of its jobs
+ * into tiles. Workers, on the same host or on others, connect to it, load
+ * the scene of each job themselves and send back the pixels of the tiles
+ * they are given. The tiles of a worker that disconnects are handed to the
+ * others, and workers may join at any time.
+ */
+
+#ifndef _462_FARM_HPP_
+#define _462_FARM_HPP_
+
+#include "p3/batchjob.hpp"
+
+#include <vector>
+
+namespace _462 {
+
+int run_coordinator( const std::vector< BatchJob >& jobs, int port );
+bool run_worker( const char* address );
+
+} /* _462 */
+
+#endif /* _462_FARM_HPP_ */
@@ -9,9 +9,13 @@
 #include "application/application.hpp"
 #include "application/camera_roam.hpp"
 #include "application/imageio.hpp"
+#include "application/hdrimage.hpp"
+#include "application/pngstream.hpp"
 #include "application/scene_loader.hpp"
 #include "application/opengl.hpp"
 #include "scene/scene.hpp"
+#include "scene/tilecache.hpp"
+#include "scene/numa.hpp"
 #include "p3/raytracer.hpp"
 
 #include <SDL.h>
@@ -19,6 +23,8 @@
 #include <stdlib.h>
 #include <iostream>
 #include <cstring>
+#include <map>
+#include <vector>
 
 namespace _462 {
 
@@ -63,6 +69,14 @@ struct Options
     int width, height;
     int num_samples;
     RaytracerOptions raytracer_opt;
+    // memory budget of the texture tile cache in megabytes, 0 keeps all textures in memory
+    int texture_cache_mb;
+    // pin the worker threads to cpus spread over the memory nodes
+    bool pin_threads;
+    // interleave the scene data over the memory nodes
+    bool interleave;
+    // keep decoded textures in .nat files
+    bool texture_nat;
 };
 
 class RaytracerApplication : public Application
@@ -119,35 +133,30 @@ bool RaytracerApplication::initialize()
 
     try {
 
+        if ( !load_scene_assets( &scene, options.skybox_filename ) )
+            return false;
+
         Material* const* materials = scene.get_materials();
         Mesh* const* meshes = scene.get_meshes();
 
-        // load all textures
-        for ( size_t i = 0; i < scene.num_materials(); ++i )
+        // gl objects can only be created on this thread
+        for ( size_t i = 0; load_gl && i < scene.num_materials(); ++i )
     {
-            if ( !materials[i]->load() ||
-         ( load_gl && !materials[i]->create_gl_data() ) )
+            if ( !materials[i]->create_gl_data() )
         {
                 std::cout << "Error loading texture, aborting.\n";
                 return false;
             }
         }
 
-        // load all meshes
-        for ( size_t i = 0; i < scene.num_meshes(); ++i )
+        for ( size_t i = 0; load_gl && i < scene.num_meshes(); ++i )
     {
-            if ( !meshes[i]->load() ||
-         ( load_gl && !meshes[i]->create_gl_data() ) )
+            if ( !meshes[i]->create_gl_data() )
         {
                 std::cout << "Error loading mesh, aborting.\n";
                 return false;
             }
         }
-		// load cube map
-		if (options.skybox_filename){
-			scene.skybox = new Cubemap(std::string(options.skybox_filename));
-			scene.skybox->load();
-		}
     }
     catch ( std::bad_alloc const& )
     {
@@ -269,7 +278,7 @@ void RaytracerApplication::handle_event( const SDL_Event& event )
         case KEY_SEND_PHOTONS:
             raytracer.initialize(&scene, options.num_samples, 0, 0, options.raytracer_opt);
             queue_render_photon=true;
-            
+            break;
         case KEY_SCREENSHOT:
             output_image();
             break;
@@ -342,6 +351,14 @@ void RaytracerApplication::output_image()
 
     assert( buf_width > 0 && buf_height > 0 );
 
+    // the raytracer may have been initialized for something else since
+    const Color3* colors = raytracer.get_colors();
+    if ( !colors || raytracer.get_width() != size_t( buf_width )
+         || raytracer.get_height() != size_t( buf_height ) ) {
+        std::cout << "No image to output.\n";
+        return;
+    }
+
     filename = options.output_filename;
 
     // if we weren't given a file, use a default name
@@ -351,7 +368,9 @@ void RaytracerApplication::output_image()
         filename = buf;
     }
 
-    if (imageio_save_image(filename, buffer, buf_width, buf_height))
+    // .exr and .pfm names keep the float colors of the raytrace
+    if (save_render(filename, colors, buf_width, buf_height,
+                    default_tonemap(), true, PNG_DEFAULT_LEVEL))
     {
         std::cout << "Saved raytraced image to '" << filename << "'.\n";
     } else {
@@ -471,7 +490,7 @@ using namespace _462;
 static void print_usage( const char* progname )
 {
     std::cout << "Usage: " << progname <<
-    "input_scene [-n num_samples] [-r] [-d width"
+    "input_scene [-n num_samples] [-r] [-c] [-a] [-i] [-p] [-u] [-d width"
     " height] [-o output_file]\n"
         "\n" \
         "Options:\n" \
@@ -482,11 +501,33 @@ static void print_usage( const char* progname )
         "\t-d width height\n" \
         "\t\tThe dimensions of image to raytrace (and window if using\n" \
         "\t\tand opengl context. Defaults to width=800, height=600.\n" \
+        "\t-c:\n" \
+        "\t\tCache the last occluder of every light and test it before\n" \
+        "\t\ttraversing the scene for each shadow ray.\n" \
+        "\t-t megabytes:\n" \
+        "\t\tKeep at most this many megabytes of texture tiles in memory,\n" \
+        "\t\tthe rest is read back from a temporary file when needed.\n" \
+        "\t-e samples:\n" \
+        "\t\tLight the scene with the skybox as well, sending this many\n" \
+        "\t\tshadow rays toward it from every lit point.\n" \
+        "\t-u:\n" \
+        "\t\tKeep decoded textures in .nat files in the cache directory,\n" \
+        "\t\tso later runs do not decode the images again.\n" \
+        "\t-a:\n" \
+        "\t\tPin the worker threads to cpus, alternating between the\n" \
+        "\t\tmemory nodes of the machine.\n" \
+        "\t-i:\n" \
+        "\t\tInterleave the bvh trees and textures over all memory nodes,\n" \
+        "\t\tinstead of placing them on the node that built them.\n" \
+        "\t-p:\n" \
+        "\t\tPrint the pixels traced on every memory node and their time\n" \
+        "\t\tafter a raytrace, on machines with several nodes.\n" \
         "\t-s input_scene:\n" \
         "\t\tThe scene file to load and raytrace.\n" \
         "\toutput_file:\n" \
         "\t\tThe output file in which to write the rendered images.\n" \
         "\t\tIf not specified, default timestamped filenames are used.\n" \
+        "\t\tNames ending in .exr or .pfm keep the unclamped colors.\n" \
         "\n" \
         "Instructions:\n" \
         "\n" \
@@ -523,6 +564,14 @@ static bool parse_args( Options* opt, int argc, char* argv[] )
     opt->num_samples = 1;
     opt->raytracer_opt.focus = 0;
     opt->raytracer_opt.gloss = 0;
+    opt->raytracer_opt.shadow_cache = false;
+    opt->raytracer_opt.aovs = 0;
+    opt->raytracer_opt.env_samples = 0;
+    opt->raytracer_opt.node_stats = false;
+    opt->texture_cache_mb = 0;
+    opt->pin_threads = false;
+    opt->interleave = false;
+    opt->texture_nat = false;
     for (int i = 2; i < argc; i++)
     {
         switch (argv[i][1])
@@ -557,6 +606,29 @@ static bool parse_args( Options* opt, int argc, char* argv[] )
             if (i < argc - 1)
                 opt->raytracer_opt.gloss = atof(argv[++i]);
             break;
+        case 'c':
+            opt->raytracer_opt.shadow_cache = true;
+            break;
+        case 'e':
+            if (i < argc - 1)
+                opt->raytracer_opt.env_samples = std::max(atoi(argv[++i]), 0);
+            break;
+        case 'p':
+            opt->raytracer_opt.node_stats = true;
+            break;
+        case 't':
+            if (i < argc - 1)
+                opt->texture_cache_mb = atoi(argv[++i]);
+            break;
+        case 'a':
+            opt->pin_threads = true;
+            break;
+        case 'i':
+            opt->interleave = true;
+            break;
+        case 'u':
+            opt->texture_nat = true;
+            break;
 		default:
 			break;
         }
@@ -585,6 +657,17 @@ int main( int argc, char* argv[] )
         return 1;
     }
 
+    texture_tile_cache().set_budget( size_t( std::max( opt.texture_cache_mb, 0 ) ) << 20 );
+    texture_set_nat_cache( opt.texture_nat );
+    numa_set_interleave( opt.interleave );
+#ifdef OPENMP
+    // the threads of the first team are kept for later parallel regions
+    if ( opt.pin_threads ) {
+#pragma omp parallel
+        numa_pin_thread( omp_get_thread_num() );
+    }
+#endif
+
     RaytracerApplication app( opt );
 
     // load the given scene
@@ -78,6 +78,7 @@ void organizePhotons(){
     
 }
 void PhotonMap::update_photons(){
+#ifndef _462_HEADLESS
     if(!geometry_array){
         glGenBuffers(1, &geometry_array);
         assert(geometry_array);
@@ -107,8 +108,10 @@ void PhotonMap::update_photons(){
     geometry_array_size=all_raw_photons->size();
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     delete[] temp;
+#endif
 }
 void PhotonMap::render_photons(){
+#ifndef _462_HEADLESS
     if(geometry_array_size>0){
         glEnableClientState(GL_VERTEX_ARRAY);
         glEnableClientState(GL_COLOR_ARRAY);
@@ -121,5 +124,6 @@ void PhotonMap::render_photons(){
         glEnableClientState(GL_COLOR_ARRAY);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
+#endif
 }
 }
\ No newline at end of file
@@ -41,6 +41,20 @@ Vector3 random_hemisphere(Vector3 d){
 	return Vector3::Zero();
 }
 
+//return a unit vector around the unit normal n, with a density of cos / pi
+Vector3 random_cosine_hemisphere(Vector3 n){
+	// a uniform point of the unit disk, lifted onto the hemisphere
+	real_t r = sqrt(random_uniform());
+	real_t phi = real_t(2 * PI) * random_uniform();
+	real_t x = r * cos(phi);
+	real_t y = r * sin(phi);
+	real_t z = sqrt(std::max(real_t(0), real_t(1) - x * x - y * y));
+	Vector3 t = fabs(n.x) > real_t(0.5) ? Vector3(0, 1, 0) : Vector3(1, 0, 0);
+	Vector3 u = normalize(cross(t, n));
+	Vector3 v = cross(n, u);
+	return x * u + y * v + z * n;
+}
+
 Vector3 random_orthnormal_square(Vector3 d, real_t a){
 	Vector3 w = normalize(d);
 	real_t x, y, z, res;
@@ -15,6 +15,7 @@ Vector3 random_sphere();
 Vector3 random_hemisphere_indexed(real_t k, real_t n);
 Vector3 random_sphere_indexed(int k,int n);
 Vector3 random_hemisphere(Vector3 d);
+Vector3 random_cosine_hemisphere(Vector3 n);
 Vector3 random_orthnormal_square(Vector3 d, real_t a);
 }
 
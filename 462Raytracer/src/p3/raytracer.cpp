@@ -10,22 +10,57 @@
 
 #include "raytracer.hpp"
 #include "scene/scene.hpp"
+#include "scene/tilecache.hpp"
+#include "scene/numa.hpp"
 #include "math/quickselect.hpp"
 #include "p3/randomgeo.hpp"
-#include <SDL_timer.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 namespace _462 {
 
 #define MAX_RECURSIVE_DEPTH 3
 
+// length of the shadow rays toward the skybox, beyond any geometry
+#define ENVIRONMENT_DISTANCE 1e20f
+
 //number of rows to render before updating the result
 static const unsigned STEP_SIZE = 1;
 static const unsigned CHUNK_SIZE = 1;
+// pixels of a row a thread traces at once, timed together for the node stats
+static const int PIXEL_BLOCK = 16;
+
+// index of the calling render thread
+static int thread_index(){
+#ifdef OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+// number of render threads
+static int thread_count(){
+#ifdef OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
 
 Raytracer::Raytracer() {
         scene = 0;
         width = 0;
         height = 0;
+        focus = 0;
+        gloss = 0;
+        bvh_root = NULL;
+        checkpoint_interval = 0;
+        restored_rows = 0;
+        env_samples = 0;
+        checkpoint_writing.reset(new std::atomic<bool>(false));
+        select_integrator();
     }
 
 Raytracer::~Raytracer() { }
@@ -33,6 +68,9 @@ Raytracer::~Raytracer() { }
 /**
  * Initializes the raytracer for the given scene. Overrides any previous
  * initializations. May be invoked before a previous raytrace completes.
+ * When called again for the same scene, only what changed since the last
+ * call is rebuilt: moving the camera reuses everything, moved geometries
+ * refit the bvh tree and new geometries build it again.
  * @param scene The scene to raytrace.
  * @param width The width of the image being raytraced.
  * @param height The height of the image being raytraced.
@@ -44,22 +82,91 @@ bool Raytracer::initialize(Scene* scene, size_t num_samples,
 {
     printf("Initializing Raytracer... \n");
 
+    int changes;
+    if (this->scene != scene || !bvh_root) {
+        scene->initialize();
+        changes = SCENE_GEOMETRY | SCENE_LIGHTS;
+    } else {
+        changes = scene->update();
+    }
+
     this->scene = scene;
     this->num_samples = num_samples;
     this->width = width;
     this->height = height;
 
     current_row = 0;
+    checkpoint_filename.clear();
+    rows_done = nullptr;
+    colors.assign(width * height, Color3::Black());
+    restored_rows = 0;
+
+    aovs.assign(opt.aovs ? width * height : 0, AovPixel());
+    aov_samples.assign(opt.aovs ? thread_count() : 0, AovSample());
+    object_ids.clear();
+    for (size_t i = 0; opt.aovs && i < scene->num_geometries(); ++i)
+        object_ids[scene->get_geometries()[i]] = int(i);
 
     projector.init(scene->camera);
-    scene->initialize();
-    photonMap.initialize(scene);
-	bvh_root = scene->gen_bvh_tree();
+    if (changes & SCENE_GEOMETRY) {
+        bvh_root = scene->gen_bvh_tree();
+    } else if (changes & SCENE_TRANSFORMS) {
+        bvh_root->refit();
+    }
+    if (changes != SCENE_UNCHANGED)
+        photonMap.initialize(scene);
+    if (changes & SCENE_LIGHTS)
+        light_tree.build(scene->get_lights(), scene->num_lights());
     gloss = opt.gloss;
+    env_samples = scene->skybox ? opt.env_samples : 0;
+    select_integrator();
+
+    // the old occluders were deleted along with the old bvh tree
+    use_shadow_cache = opt.shadow_cache;
+    shadow_caches.clear();
+    shadow_caches.resize(thread_count());
+    for (size_t i = 0; i < shadow_caches.size(); ++i){
+        shadow_caches[i].occluders.assign(scene->num_lights(), NULL);
+        shadow_caches[i].lookups = 0;
+        shadow_caches[i].hits = 0;
+    }
+
+    use_node_stats = opt.node_stats && numa_num_nodes() > 1;
+    node_stats.assign(use_node_stats ? thread_count() : 0, NodeStats());
+    for (size_t i = 0; i < node_stats.size(); ++i)
+        memset(&node_stats[i], 0, sizeof(NodeStats));
     
     return true;
 }
 
+// every combination of features, indexed by its TraceFeature bits
+#define INTEGRATOR(F) { &Raytracer::trace_pixel_t<F>, &Raytracer::trace_ray_t<F> }
+
+/**
+* Pick the integrator specialized for the features in use, after anything
+* they depend on changed: the gloss option, the focus, the skybox or the
+* AOVs.
+*/
+void Raytracer::select_integrator(){
+    static const struct{
+        TracePixelFn pixel;
+        TraceRayFn ray;
+    } integrators[TRACE_ALL + 1] = {
+        INTEGRATOR(0), INTEGRATOR(1), INTEGRATOR(2), INTEGRATOR(3),
+        INTEGRATOR(4), INTEGRATOR(5), INTEGRATOR(6), INTEGRATOR(7),
+        INTEGRATOR(8), INTEGRATOR(9), INTEGRATOR(10), INTEGRATOR(11),
+        INTEGRATOR(12), INTEGRATOR(13), INTEGRATOR(14), INTEGRATOR(15)
+    };
+
+    int features = 0;
+    if (gloss > EPS) features |= TRACE_GLOSS;
+    if (focus > EPS) features |= TRACE_DOF;
+    if (scene && scene->skybox != NULL) features |= TRACE_SKYBOX;
+    if (!aovs.empty()) features |= TRACE_AOV;
+    trace_pixel_fn = integrators[features].pixel;
+    trace_ray_fn = integrators[features].ray;
+}
+
 /**
 * Trace a ray at giving depth, include reflection color 
 * and refraction color.
@@ -68,28 +175,53 @@ bool Raytracer::initialize(Scene* scene, size_t num_samples,
 * @return the result color of the input ray.
 */
 Color3 Raytracer::trace_ray(Ray &ray, size_t depth){
+	return (this->*trace_ray_fn)(ray, depth);
+}
+
+template<int F>
+Color3 Raytracer::trace_ray_t(Ray &ray, size_t depth){
 	if (depth > MAX_RECURSIVE_DEPTH) return Color3::Black();
 
-	//Geometry* const * geoms = scene->get_geometries();
-	real_t min_t = INFINITY;
-	//size_t min_i = 0;
-	Intersection info = default_intersection();
+	HitRecord rec = default_hit_record();
+
+	if (bvh_root->intersect_test(ray, rec)){
+		// only the closest hit is shaded
+		Intersection info;
+		rec.geometry->shade(ray, rec, info);
+
+		// the first hit of a camera ray goes to the AOVs
+		if ((F & TRACE_AOV) && depth == 0){
+			AovSample& sample = aov_samples[thread_index()];
+			std::unordered_map<const Geometry*, int>::const_iterator id = object_ids.find(rec.geometry->owner);
+			sample.hit = true;
+			sample.depth = rec.t;
+			sample.normal = info.normal;
+			sample.albedo = info.tex_Color * info.diffuse;
+			sample.direct = Color3::Black();
+			sample.object_id = id == object_ids.end() ? -1 : id->second;
+		}
 
-	bvh_root->intersect_test(ray, min_t, info);
-	if (min_t != INFINITY){
 		// caculate reflection color
 		Vector3 reflect_dir = ray.d - (real_t)(2) * (ray.d * info.normal) * info.normal;
 
 		// gloss effect
-        if(gloss > EPS)
+        if(F & TRACE_GLOSS)
             reflect_dir += random_orthnormal_square(reflect_dir,gloss);
 
 		Ray reflect_ray = Ray(info.position, normalize(reflect_dir));
+		// secondary rays keep growing the ray cone of this ray
+		reflect_ray.width = ray.width_at(rec.t);
+		reflect_ray.spread = ray.spread;
+		// half the gloss lobe widens the cone, so glossy reflections of the
+		// skybox and of textures are looked up blurred and the jitter of the
+		// reflected rays has less detail left to alias
+		if (F & TRACE_GLOSS)
+			reflect_ray.spread += gloss * real_t(0.5);
 		Vector3 refract_dir;
 		real_t c = (real_t)0;
         real_t one = (real_t)1;
 		// if specular color of material is black, then we don't need compute the reflection color
-		Color3 reflect_color = info.specular == Color3::Black() ? Color3::Black() : info.specular * info.tex_Color * trace_ray(reflect_ray, depth + 1);
+		Color3 reflect_color = info.specular == Color3::Black() ? Color3::Black() : info.specular * info.tex_Color * trace_ray_t<F>(reflect_ray, depth + 1);
 
 		if (info.refractive_index > EPS){
 			// caculate refraction color
@@ -113,24 +245,39 @@ Color3 Raytracer::trace_ray(Ray &ray, size_t depth){
 			real_t R = R0 + (one - R0) * std::pow(one - c, (real_t)5);
 
 			Ray refrac_ray = Ray(info.position, refract_dir);
-			Color3 refract_color = refract_dir == Vector3::Zero() ? Color3::Black() : trace_ray(refrac_ray, depth + 1);
+			refrac_ray.width = reflect_ray.width;
+			refrac_ray.spread = ray.spread;
+			Color3 refract_color = refract_dir == Vector3::Zero() ? Color3::Black() : trace_ray_t<F>(refrac_ray, depth + 1);
 			return  R * reflect_color + (one - R) * refract_color;
 		}
 		else{
 			// only have reflection color
             Color3 color = compute_illumination(info);
+			if ((F & TRACE_AOV) && depth == 0)
+				aov_samples[thread_index()].direct = color;
 			return color + reflect_color;
 		}
 		
 	}
 	
 	// rendering skybox
-	if (scene->skybox != NULL){
-		return scene->skybox->texCube(ray.d);
+	Color3 background;
+	if (F & TRACE_SKYBOX){
+		background = scene->skybox->texCube(ray.d, ray.spread);
 	}
 	else{
-		return scene->background_color;
+		background = scene->background_color;
+	}
+	if ((F & TRACE_AOV) && depth == 0){
+		AovSample& sample = aov_samples[thread_index()];
+		sample.hit = false;
+		sample.depth = 0;
+		sample.normal = Vector3::Zero();
+		sample.albedo = background;
+		sample.direct = background;
+		sample.object_id = -1;
 	}
+	return background;
 }
 
 
@@ -141,36 +288,134 @@ Color3 Raytracer::trace_ray(Ray &ray, size_t depth){
 */
 Color3 Raytracer::compute_illumination(const Intersection& info){
 	Color3 res = info.ambient * scene->ambient_light;
-	const SphereLight* lights = scene->get_lights();
-	for (size_t i = 0; i < scene->num_lights(); ++i){
-		
-		// basical blin-phone lighting
-		const SphereLight& light = lights[i];
-		Vector3 l = light.position - info.position;
-		real_t d = length(l);
-		real_t atten = (light.attenuation.constant
-						+ d * light.attenuation.linear
-						+ d * d * light.attenuation.quadratic);
-        atten = real_t(1) / atten;
-        
-		real_t zero = (real_t)0;
 
-		// shadow test, for soft shadow effect, will emit several rays with shadow test.
-		// Blend result based on the percentage of rays pass the shadow test.
-        real_t b = real_t(0);
-        for (size_t si = 0; si < DIRECT_SAMPLE_COUNT; ++si){
-            Vector3 soft_light_position = l + random_sphere() * light.radius;
-            Ray s_r = Ray(info.position, normalize(soft_light_position));
-
-			if (bvh_root->shadow_test(s_r, d)) b++;
-        }
-        b /= (real_t)DIRECT_SAMPLE_COUNT;
-        b = real_t(1) - b;
-		res += light.color * atten * b * info.diffuse * std::max(info.normal * normalize(l), zero);
+	if (scene->num_lights() <= LIGHT_TREE_THRESHOLD){
+		for (size_t i = 0; i < scene->num_lights(); ++i){
+			res += compute_light(info, i, DIRECT_SAMPLE_COUNT);
+		}
+	}
+	else{
+		// too many lights to visit all of them, so pick a few from the light tree
+		// and weight every picked light by the probability of picking it.
+		Color3 direct = Color3::Black();
+		for (size_t si = 0; si < LIGHT_SAMPLE_COUNT; ++si){
+			size_t index;
+			real_t pdf;
+			if (light_tree.sample(info.position, info.normal, random_uniform(), index, pdf)){
+				direct += compute_light(info, index, 1) * (real_t(1) / pdf);
+			}
+		}
+		res += direct * (real_t(1) / LIGHT_SAMPLE_COUNT);
+	}
+	if (env_samples > 0){
+		res += compute_environment(info);
 	}
 	return res * info.tex_Color;
 }
 
+/**
+* Compute the diffuse lighting of the skybox. Each shadow ray goes either
+* toward a direction picked by the brightness of the sky, which finds a
+* small sun, or by the cosine of the surface, which suits a broad sky; it
+* is weighted by the density of both choices together.
+* @param info The intersection information include material and position
+* @return result color of lighting, without texture color
+*/
+Color3 Raytracer::compute_environment(const Intersection& info){
+	Color3 res = Color3::Black();
+	real_t half = real_t(0.5);
+	for (size_t si = 0; si < env_samples; ++si){
+		Vector3 d;
+		Color3 radiance;
+		real_t light_pdf;
+		if (random_uniform() < half){
+			if (!scene->skybox->sample_light(random_uniform(), random_uniform(), random_uniform(),
+			                                 d, radiance, light_pdf)){
+				break;
+			}
+		}
+		else{
+			d = random_cosine_hemisphere(info.normal);
+			radiance = scene->skybox->light_radiance(d, light_pdf);
+		}
+		real_t cos_l = info.normal * d;
+		if (cos_l <= real_t(0)){
+			continue;
+		}
+		Ray s_r = Ray(info.position, d);
+		if (!bvh_root->shadow_test(s_r, ENVIRONMENT_DISTANCE)){
+			// a lambertian surface reflects cos / pi of the light
+			real_t bsdf_pdf = cos_l / real_t(PI);
+			res += radiance * (bsdf_pdf / (half * light_pdf + half * bsdf_pdf));
+		}
+	}
+	return res * info.diffuse * (real_t(1) / env_samples);
+}
+
+/**
+* Compute the diffuse lighting of one light by giving intersection information
+* @param info The intersection information include material and position
+* @param light_index Index of the light to compute
+* @param shadow_samples Number of shadow rays sent to the light
+* @return result color of lighting, without texture color
+*/
+Color3 Raytracer::compute_light(const Intersection& info, size_t light_index, size_t shadow_samples){
+	const SphereLight& light = scene->get_lights()[light_index];
+	// basical blin-phone lighting
+	Vector3 l = light.position - info.position;
+	real_t d = length(l);
+	real_t atten = (light.attenuation.constant
+					+ d * light.attenuation.linear
+					+ d * d * light.attenuation.quadratic);
+	atten = real_t(1) / atten;
+
+	real_t zero = (real_t)0;
+	real_t cos_l = info.normal * normalize(l);
+	if (cos_l <= zero) return Color3::Black();
+
+	// shadow test, for soft shadow effect, will emit several rays with shadow test.
+	// Blend result based on the percentage of rays pass the shadow test.
+	real_t b = real_t(0);
+	for (size_t si = 0; si < shadow_samples; ++si){
+		Vector3 soft_light_position = l + random_sphere() * light.radius;
+		Ray s_r = Ray(info.position, normalize(soft_light_position));
+
+		if (shadow_test(s_r, d, light_index)) b++;
+	}
+	b /= (real_t)shadow_samples;
+	b = real_t(1) - b;
+	return light.color * atten * b * info.diffuse * cos_l;
+}
+
+/**
+* Shadow test toward a light. With the shadow cache enabled, the last
+* primitive that blocked this light for the current thread is tested first,
+* and the bvh tree is only traversed if it does not block the ray.
+* @param r The shadow ray.
+* @param dis Distance to the light.
+* @param light_index Index of the light the ray is sent to.
+* @return True if the ray is blocked.
+*/
+bool Raytracer::shadow_test(const Ray& r, real_t dis, size_t light_index){
+	if (!use_shadow_cache){
+		return bvh_root->shadow_test(r, dis);
+	}
+
+	ShadowCache& cache = shadow_caches[thread_index()];
+	Geometry*& occluder = cache.occluders[light_index];
+	cache.lookups++;
+	if (occluder != NULL && occluder->shadow_test(r, dis)){
+		cache.hits++;
+		return true;
+	}
+
+	Geometry* found = bvh_root->shadow_occluder(r, dis);
+	if (found != NULL){
+		occluder = found;
+	}
+	return found != NULL;
+}
+
 /**
 * Compute refraction direction of giving incoming direction
 * @param dir The incoming ray direction
@@ -207,15 +452,38 @@ Color3 Raytracer::trace_pixel(size_t x,
                   size_t y,
                   size_t width,
                   size_t height)
+{
+    return (this->*trace_pixel_fn)(x, y, width, height);
+}
+
+template<int F>
+Color3 Raytracer::trace_pixel_t(size_t x,
+                  size_t y,
+                  size_t width,
+                  size_t height)
 {
     assert(x < width);
     assert(y < height);
 
+    // every pixel draws the same random numbers wherever and whenever it
+    // is traced: by any thread, on a worker, or after a resume
+    random_seed(uint64_t(y) * width + x);
+
     real_t dx = real_t(1)/width;
     real_t dy = real_t(1)/height;
 
     Color3 res = Color3::Black();
 
+    // sums of the first hits of the samples, for the AOVs
+    real_t hit_depth = 0;
+    size_t hits = 0;
+    Vector3 normal = Vector3::Zero();
+    Color3 albedo = Color3::Black();
+    Color3 direct = Color3::Black();
+    int object_id = -1;
+    // luminance sums and sums of squares of the direct and indirect lighting
+    real_t direct_sum = 0, direct_sum2 = 0, indirect_sum = 0, indirect_sum2 = 0;
+
     for (unsigned int iter = 0; iter < num_samples; iter++)
     {
         // pick a point within the pixel boundaries to fire our
@@ -224,18 +492,54 @@ Color3 Raytracer::trace_pixel(size_t x,
         real_t j = real_t(2)*(real_t(y) + random_uniform())*dy - real_t(1);
 
         Ray r = Ray(scene->camera.get_position(), projector.get_pixel_dir(i, j));
+        r.spread = projector.get_pixel_spread(height);
 
 		// Depth of View
-        if(focus > EPS){
+        if(F & TRACE_DOF){
             real_t ap = (real_t)0.3f;
             Vector3 focus_point = r.atTime(focus);
             r.e += random_orthnormal_square(r.d, ap);
             r.d = normalize(focus_point - r.e);
         }
         
-		res += trace_ray(r, 0);
+        Color3 color = trace_ray_t<F>(r, 0);
+		res += color;
+
+        if (F & TRACE_AOV){
+            const AovSample& sample = aov_samples[thread_index()];
+            real_t direct_lum = luminance(sample.direct);
+            real_t indirect_lum = luminance(color - sample.direct);
+            direct_sum += direct_lum;
+            direct_sum2 += direct_lum * direct_lum;
+            indirect_sum += indirect_lum;
+            indirect_sum2 += indirect_lum * indirect_lum;
+            if (sample.hit){
+                hit_depth += sample.depth;
+                hits++;
+            }
+            normal += sample.normal;
+            albedo += sample.albedo;
+            direct += sample.direct;
+            if (iter == 0) object_id = sample.object_id;
+        }
     }
-    return res*(real_t(1)/num_samples);
+
+    real_t inv_samples = real_t(1)/num_samples;
+    if (F & TRACE_AOV){
+        AovPixel& pixel = aovs[y * width + x];
+        pixel.depth = hits > 0 ? hit_depth / hits : 0;
+        pixel.normal = normal * inv_samples;
+        pixel.albedo = albedo * inv_samples;
+        pixel.direct = direct * inv_samples;
+        // unbiased sample variance, divided by n for the variance of the mean
+        real_t n = real_t(num_samples);
+        real_t norm = num_samples > 1 ? real_t(1) / (n * (n - 1)) : 0;
+        pixel.direct_variance = std::max(direct_sum2 - direct_sum * direct_sum / n, real_t(0)) * norm;
+        pixel.indirect_variance = std::max(indirect_sum2 - indirect_sum * indirect_sum / n, real_t(0)) * norm;
+        pixel.object_id = object_id;
+        pixel.samples = int(num_samples);
+    }
+    return res*inv_samples;
 }
 
 
@@ -259,16 +563,15 @@ void Raytracer::trace_focus(size_t x, size_t y){
     real_t j = real_t(2) * real_t(y) * dy - real_t(1);
 
     Ray r = Ray(scene->camera.get_position(), projector.get_pixel_dir(i, j));
-    real_t t = INFINITY;
-    Intersection info;
+    HitRecord rec = default_hit_record();
     
-    bvh_root->intersect_test(r,t,info);
-    if(t != INFINITY){
-        std::cout<< "focus at : " << t<<std::endl;
-        focus = t;
+    if(bvh_root->intersect_test(r, rec)){
+        std::cout<< "focus at : " << rec.t<<std::endl;
+        focus = rec.t;
     }else{
         focus = real_t(0);
     }
+    select_integrator();
 }
     
 /**
@@ -276,7 +579,8 @@ void Raytracer::trace_focus(size_t x, size_t y){
  * max_time duration and then return, even if the raytrace is not copmlete.
  * The results should be placed in the given buffer.
  * @param buffer The buffer into which to place the color data. It is
- *  32-bit RGBA (4 bytes per pixel), in row-major order.
+ *  32-bit RGBA (4 bytes per pixel), in row-major order. May be null when
+ *  only the float colors are wanted, see get_colors.
  * @param max_time, If non-null, the maximum suggested time this
  *  function raytrace before returning, in seconds. If null, the raytrace
  *  should run to completion.
@@ -288,20 +592,30 @@ bool Raytracer::raytrace(unsigned char* buffer, real_t* max_time)
     
     static const size_t PRINT_INTERVAL = 64;
 
-    // the time in milliseconds that we should stop
-    unsigned int end_time = 0;
-    bool is_done;
+    // the time that we should stop
+    std::chrono::steady_clock::time_point end_time;
+    bool is_done = false;
 
     if (max_time)
     {
-        // convert duration to milliseconds
-        unsigned int duration = (unsigned int) (*max_time * 1000);
-        end_time = SDL_GetTicks() + duration;
+        end_time = std::chrono::steady_clock::now()
+            + std::chrono::microseconds((long long)(*max_time * 1000000));
     }
 
+    // rows picked up from a checkpoint are not traced again
+    size_t restored_start = (height - restored_rows) * width;
+    if (buffer) {
+        for (size_t i = restored_start; i < height * width; i++)
+            colors[i].to_array4(&buffer[4 * i]);
+    }
+    if (restored_rows > 0 && rows_done)
+        rows_done(height - restored_rows, restored_rows);
+    restored_rows = 0;
+
     // until time is up, run the raytrace. we render an entire group of
-    // rows at once for simplicity and efficiency.
-    for (; !max_time || end_time > SDL_GetTicks(); current_row += STEP_SIZE)
+    // rows at once for simplicity and efficiency. rows go from the top of
+    // the image down, the order image files store them in.
+    for (; !max_time || end_time > std::chrono::steady_clock::now(); current_row += STEP_SIZE)
     {
         // we're done if we finish the last row
         is_done = current_row >= height;
@@ -310,8 +624,9 @@ bool Raytracer::raytrace(unsigned char* buffer, real_t* max_time)
 
         int loop_upper = std::min(current_row + STEP_SIZE, height);
 
-        for (int c_row = current_row; c_row < loop_upper; c_row++)
+        for (int step_row = current_row; step_row < loop_upper; step_row++)
         {
+            int c_row = height - 1 - step_row;
             /*
              * This defines a critical region of code that should be
              * executed sequentially.
@@ -322,23 +637,223 @@ bool Raytracer::raytrace(unsigned char* buffer, real_t* max_time)
                     printf("Raytracing (Row %d)\n", c_row);
             }
             
+            int num_blocks = (width + PIXEL_BLOCK - 1) / PIXEL_BLOCK;
         // This tells OpenMP that this loop can be parallelized.
 #pragma omp parallel for schedule(dynamic, CHUNK_SIZE)
-            for (int x = 0; x < width; x++)
+            for (int block = 0; block < num_blocks; block++)
             {
-                // trace a pixel
-                Color3 color = trace_pixel(x, c_row, width, height);
-                // write the result to the buffer, always use 1.0 as the alpha
-                color.to_array4(&buffer[4 * (c_row * width + x)]);
+                std::chrono::steady_clock::time_point start;
+                if (use_node_stats) start = std::chrono::steady_clock::now();
+                int x_end = std::min(int(width), (block + 1) * PIXEL_BLOCK);
+                for (int x = block * PIXEL_BLOCK; x < x_end; x++)
+                {
+                    // trace a pixel
+                    Color3 color = trace_pixel(x, c_row, width, height);
+                    colors[c_row * width + x] = color;
+                    // write the result to the buffer, always use 1.0 as the alpha
+                    if (buffer)
+                        color.to_array4(&buffer[4 * (c_row * width + x)]);
+                }
+                if (use_node_stats) {
+                    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                    NodeStats& stats = node_stats[thread_index()];
+                    int node = std::min(numa_current_node(), STATS_MAX_NODES - 1);
+                    stats.pixels[node] += x_end - block * PIXEL_BLOCK;
+                    stats.ms[node] += elapsed.count();
+                }
             }
 #pragma omp barrier
 
         }
+
+        if (rows_done)
+            rows_done(height - loop_upper, loop_upper - current_row);
+
+        if (!checkpoint_filename.empty() && std::chrono::steady_clock::now() - last_checkpoint
+                >= std::chrono::duration<double>(checkpoint_interval))
+            save_checkpoint(loop_upper);
     }
 
     if (is_done) printf("Done raytracing!\n");
 
+    if (is_done && use_shadow_cache){
+        size_t lookups = 0, hits = 0;
+        for (size_t i = 0; i < shadow_caches.size(); ++i){
+            lookups += shadow_caches[i].lookups;
+            hits += shadow_caches[i].hits;
+        }
+        printf("Shadow cache: %lu of %lu shadow rays skipped the bvh tree\n",
+               (unsigned long)hits, (unsigned long)lookups);
+    }
+
+    const TileCache& tile_cache = texture_tile_cache();
+    if (is_done && tile_cache.enabled()){
+        printf("Texture cache: %lu of %lu shared tile lookups read a tile from disk\n",
+               (unsigned long)tile_cache.num_misses(), (unsigned long)tile_cache.num_lookups());
+    }
+
+    if (is_done && use_node_stats)
+        print_node_stats();
+
     return is_done;
 }
 
+/**
+ * The colors of the last raytrace before they are rounded to bytes, in the
+ * same order as the buffer given to raytrace, get_width by get_height of
+ * them. Valid until the next initialize, NULL if it was given no image.
+ */
+const Color3* Raytracer::get_colors() const
+{
+    return colors.empty() ? NULL : &colors[0];
+}
+
+// size of the image given to the last initialize
+size_t Raytracer::get_width() const
+{
+    return width;
+}
+
+size_t Raytracer::get_height() const
+{
+    return height;
+}
+
+/**
+ * The AOVs of the last raytrace, in the same order as its colors, or NULL
+ * if none were asked for in the options given to initialize.
+ */
+const AovPixel* Raytracer::get_aovs() const
+{
+    return aovs.empty() ? NULL : &aovs[0];
+}
+
+/**
+ * Raytraces a rectangle of the image at once, for render workers that
+ * only own part of the image.
+ * @param colors The colors of the tile, in row-major order,
+ *  tile_width * tile_height pixels. The AOVs of the tile, if kept, are
+ *  found at its pixels in get_aovs.
+ * @param x, y The top left pixel of the tile in the image.
+ * @param tile_width, tile_height The size of the tile, it must lie inside
+ *  the image given to initialize.
+ */
+void Raytracer::raytrace_tile(Color3* colors, size_t x, size_t y,
+                              size_t tile_width, size_t tile_height)
+{
+    int num_pixels = int(tile_width * tile_height);
+#pragma omp parallel for schedule(dynamic, CHUNK_SIZE)
+    for (int i = 0; i < num_pixels; i++)
+    {
+        colors[i] = trace_pixel(x + i % tile_width, y + i / tile_width, width, height);
+    }
+}
+
+/**
+ * Write a checkpoint of a full raytrace every so often, so an interrupted
+ * render can be picked up again with resume_checkpoint. Has to be called
+ * after initialize, which turns checkpoints off again.
+ * @param filename The checkpoint file, replaced by every checkpoint.
+ * @param key Identifies the scene and settings of the render, a checkpoint
+ *  is only resumed with the same key.
+ * @param interval Seconds between two checkpoints.
+ */
+void Raytracer::set_checkpoint(const std::string& filename, const NatKey& key, real_t interval)
+{
+    checkpoint_filename = filename;
+    checkpoint_key = key;
+    checkpoint_interval = interval;
+    last_checkpoint = std::chrono::steady_clock::now();
+}
+
+/**
+ * Have a function called with the rows finished by raytrace, while it
+ * runs, from the top of the image down. Rows resumed from a checkpoint
+ * are passed to the first call. Has to be called after initialize, which
+ * removes it again.
+ * @param callback Called with the first finished row and the number of
+ *  rows from there up, or nullptr for none.
+ */
+void Raytracer::set_rows_done(const std::function<void(size_t, size_t)>& callback)
+{
+    rows_done = callback;
+}
+
+/**
+ * Save the colors of the finished rows. The file is written on another
+ * thread; while the last checkpoint is still being written, this one is
+ * skipped and the next row tries again.
+ * @param rows Number of finished rows.
+ */
+void Raytracer::save_checkpoint(size_t rows)
+{
+    if (checkpoint_writing->exchange(true))
+        return;
+    NatWriter writer;
+    // the finished rows are the top ones
+    size_t start = (height - rows) * width;
+    writer.add_section(NAT_CHECKPOINT_COLORS, sizeof(Color3), &colors[start], rows * width);
+    if (!aovs.empty())
+        writer.add_section(NAT_CHECKPOINT_AOVS, sizeof(AovPixel), &aovs[start], rows * width);
+    std::shared_ptr<std::atomic<bool> > writing = checkpoint_writing;
+    writer.write_background(checkpoint_filename, checkpoint_key, rows,
+                            [writing](bool) { *writing = false; });
+    last_checkpoint = std::chrono::steady_clock::now();
+}
+
+/**
+ * Pick up a raytrace from its last checkpoint. The next raytrace copies the
+ * restored rows to the buffer and starts on the first row not finished.
+ * Has to be called after initialize.
+ * @param filename The checkpoint file.
+ * @param key The key the checkpoint was written with.
+ * @return False if there is no checkpoint for this key, otherwise return True.
+ */
+bool Raytracer::resume_checkpoint(const std::string& filename, const NatKey& key)
+{
+    // small next to the render, and a damaged one would be kept in the image
+    NatReader reader;
+    if (!reader.open(filename, key, true))
+        return false;
+    uint64_t rows = reader.get_flags();
+    uint64_t count;
+    const Color3* saved = (const Color3*)reader.section(NAT_CHECKPOINT_COLORS, sizeof(Color3), count);
+    if (!saved || rows > height || count != rows * width)
+        return false;
+
+    if (!aovs.empty()) {
+        uint64_t aov_count;
+        const AovPixel* saved_aovs = (const AovPixel*)reader.section(NAT_CHECKPOINT_AOVS, sizeof(AovPixel), aov_count);
+        if (!saved_aovs || aov_count != count)
+            return false;
+        std::copy(saved_aovs, saved_aovs + count, aovs.begin() + (height - rows) * width);
+    }
+
+    std::copy(saved, saved + count, colors.begin() + (height - rows) * width);
+    current_row = rows;
+    restored_rows = rows;
+    printf("Resumed from row %lu of %lu\n", (unsigned long)rows, (unsigned long)height);
+    return true;
+}
+
+/**
+ * Print the pixels traced on every memory node and the average time per
+ * pixel there. Threads that moved between nodes count on each of them.
+ */
+void Raytracer::print_node_stats() const
+{
+    for (int node = 0; node < std::min(numa_num_nodes(), STATS_MAX_NODES); ++node) {
+        size_t pixels = 0, threads = 0;
+        double ms = 0;
+        for (size_t i = 0; i < node_stats.size(); ++i) {
+            pixels += node_stats[i].pixels[node];
+            ms += node_stats[i].ms[node];
+            if (node_stats[i].pixels[node] > 0) threads++;
+        }
+        printf("Node %d: %lu threads traced %lu pixels, %.2f us per pixel\n",
+               node, (unsigned long)threads, (unsigned long)pixels,
+               pixels > 0 ? 1000.0 * ms / pixels : 0.0);
+    }
+}
+
 } /* _462 */
@@ -19,6 +19,14 @@
 #include "p3/photonmap.hpp"
 #include "p3/util.hpp"
 #include "scene/bvhnode.hpp"
+#include "scene/lighttree.hpp"
+#include "scene/natfile.hpp"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
 namespace _462 {
 
 class Scene;
@@ -28,6 +36,107 @@ struct Intersection;
 struct RaytracerOptions{
     real_t focus;
     real_t gloss;
+    // try the last occluder of each light before traversing the bvh tree
+    bool shadow_cache;
+    // AovChannel bits of the extra buffers to keep, 0 for none
+    int aovs;
+    // shadow rays sent toward the skybox from every lit point, 0 lights
+    // the scene with its lights alone
+    size_t env_samples;
+    // time the pixels of every memory node, on machines with several
+    bool node_stats;
+};
+
+// extra buffers of a render, kept next to its colors
+enum AovChannel{
+    AOV_DEPTH = 1,
+    AOV_NORMAL = 2,
+    AOV_ALBEDO = 4,
+    AOV_OBJECT_ID = 8,
+    // direct lighting, and the indirect rest of the color
+    AOV_DIRECT = 16,
+    AOV_SAMPLES = 32,
+    // spread of the samples of the direct and the indirect lighting
+    AOV_VARIANCE = 64,
+    AOV_ALL = 127
+};
+
+/**
+ * What the samples of a pixel saw at their first hit, averaged like its
+ * color. They come out of the same trace as the color, so they line up
+ * with it exactly.
+ */
+struct AovPixel{
+    // distance from the camera to the first hit, averaged over the samples
+    // that hit something, 0 if none did
+    real_t depth;
+    // world normal of the first hit, zero for samples that hit nothing
+    Vector3 normal;
+    // texture times diffuse color of the first hit, or the background
+    Color3 albedo;
+    // lighting of the first hit, or the background. The color minus this
+    // came through reflections and refractions.
+    Color3 direct;
+    // variance of the mean luminance of the direct and of the indirect
+    // lighting, estimated from its samples; 0 with a single sample
+    real_t direct_variance;
+    real_t indirect_variance;
+    // index of the scene geometry the first sample hit, -1 for none
+    int object_id;
+    // samples traced for the pixel
+    int samples;
+};
+
+/**
+ * The first hit of the sample a render thread is tracing, recorded by
+ * the integrator while AOVs are kept.
+ */
+struct AovSample{
+    bool hit;
+    real_t depth;
+    Vector3 normal;
+    Color3 albedo;
+    Color3 direct;
+    int object_id;
+    // keep the samples of different threads on different cache lines
+    char padding[64];
+};
+
+/**
+ * Remembers the last primitive found blocking the way to each light.
+ * There is one cache per render thread, so the pixels traced by a thread
+ * try that primitive first before traversing the bvh tree.
+ */
+struct ShadowCache{
+    std::vector<Geometry*> occluders;
+    size_t lookups;
+    size_t hits;
+    // keep the caches of different threads on different cache lines
+    char padding[64];
+};
+
+// features of the scene the integrator is specialized for, the tests for
+// features that are off are compiled out of its hot loop
+enum TraceFeature{
+    TRACE_GLOSS = 1,
+    TRACE_DOF = 2,
+    TRACE_SKYBOX = 4,
+    TRACE_AOV = 8,
+    TRACE_ALL = 15
+};
+
+// most memory nodes render statistics are kept for
+#define STATS_MAX_NODES 8
+
+/**
+ * Pixels traced by one render thread and the time spent on them, by the
+ * memory node the thread ran on. Comparing the nodes shows how much
+ * remote memory accesses slow a node down.
+ */
+struct NodeStats{
+    size_t pixels[STATS_MAX_NODES];
+    double ms[STATS_MAX_NODES];
+    char padding[64];
 };
     
 class Raytracer
@@ -44,6 +153,18 @@ public:
     Color3 trace_ray(Ray &ray, size_t depth);
     
     bool raytrace(unsigned char* buffer, real_t* max_time);
+
+    const Color3* get_colors() const;
+    const AovPixel* get_aovs() const;
+    size_t get_width() const;
+    size_t get_height() const;
+
+    void raytrace_tile(Color3* colors, size_t x, size_t y,
+                       size_t tile_width, size_t tile_height);
+
+    void set_checkpoint(const std::string& filename, const NatKey& key, real_t interval);
+    void set_rows_done(const std::function<void(size_t, size_t)>& callback);
+    bool resume_checkpoint(const std::string& filename, const NatKey& key);
     
     void trace_focus(size_t x, size_t y);
     
@@ -59,7 +180,7 @@ private:
     // the dimensions of the image to trace
     size_t width, height;
 
-    // the next row to raytrace
+    // the number of rows raytraced so far, from the top down
     size_t current_row;
 
     unsigned int num_samples;
@@ -73,8 +194,58 @@ private:
 	// bvhtree root
 	BvhNode* bvh_root;
 
+	// light tree used to sample scenes with many lights
+	LightTree light_tree;
+
+	// shadow rays toward the skybox per lit point, 0 without skybox light
+	size_t env_samples;
+
+	// shadow caches, one per render thread
+	bool use_shadow_cache;
+	std::vector<ShadowCache> shadow_caches;
+
+	// per node statistics, one per render thread, kept on multi node
+	// machines when the options ask for them
+	bool use_node_stats;
+	std::vector<NodeStats> node_stats;
+	void print_node_stats() const;
+
+	// checkpoint of the finished rows, written every checkpoint_interval
+	// seconds while checkpoint_filename is set
+	std::string checkpoint_filename;
+	NatKey checkpoint_key;
+	real_t checkpoint_interval;
+	std::chrono::steady_clock::time_point last_checkpoint;
+	// set while a checkpoint is being written in the background
+	std::shared_ptr<std::atomic<bool> > checkpoint_writing;
+	// colors of the traced pixels before they are rounded to bytes
+	std::vector<Color3> colors;
+	// extra buffers of the render and the first hits of the samples being
+	// traced, one per render thread, while AOVs are kept
+	std::vector<AovPixel> aovs;
+	std::vector<AovSample> aov_samples;
+	// index of each scene geometry, for the object ids
+	std::unordered_map<const Geometry*, int> object_ids;
+	// called with the rows raytrace finishes
+	std::function<void(size_t, size_t)> rows_done;
+	// rows restored from a checkpoint, copied to the buffer by the next raytrace
+	size_t restored_rows;
+	void save_checkpoint(size_t rows);
+
 	Color3 compute_illumination(const Intersection& info);
+	Color3 compute_light(const Intersection& info, size_t light_index, size_t shadow_samples);
+	Color3 compute_environment(const Intersection& info);
+	bool shadow_test(const Ray& r, real_t dis, size_t light_index);
 	bool refract(const Vector3& dir, const Vector3& norm, real_t n, Vector3& t_dir);
+
+	// the integrator specialized for the features of the current render
+	typedef Color3 (Raytracer::*TracePixelFn)(size_t x, size_t y, size_t width, size_t height);
+	TracePixelFn trace_pixel_fn;
+	typedef Color3 (Raytracer::*TraceRayFn)(Ray& ray, size_t depth);
+	TraceRayFn trace_ray_fn;
+	void select_integrator();
+	template<int F> Color3 trace_ray_t(Ray& ray, size_t depth);
+	template<int F> Color3 trace_pixel_t(size_t x, size_t y, size_t width, size_t height);
 };
 
 } /* _462 */
@@ -34,6 +34,12 @@ namespace _462 {
 //the number of samples used in the direct (shadow) estimate
 #define DIRECT_SAMPLE_COUNT 4
 
+//scenes with more lights than this sample lights from the light tree instead of visiting all of them
+#define LIGHT_TREE_THRESHOLD 8
+
+//the number of lights picked from the light tree in each direct estimate
+#define LIGHT_SAMPLE_COUNT DIRECT_SAMPLE_COUNT
+
 real_t computeFresnelCoefficient(Intersection &next,Ray &ray,real_t index,real_t newIndex);
 Vector3 reflect(Vector3 norm,Vector3 inc);
 Vector3 refract(Vector3 norm,Vector3 inc,real_t ratio);
@@ -0,0 +1,56 @@
+/**
+* @file animation.cpp
+* @brief keyframed transforms of cameras and geometries
+*/
+
+#include "scene/animation.hpp"
+#include <algorithm>
+
+namespace _462{
+
+	static bool key_before(const Keyframe& a, const Keyframe& b){
+		return a.time < b.time;
+	}
+
+	/**
+	* Add a key, keeping the keys sorted. A key at the same time as an
+	* existing one goes after it.
+	* @param key The pose and its time.
+	*/
+	void KeyframeTrack::add_key(const Keyframe& key){
+		keys.insert(std::upper_bound(keys.begin(), keys.end(), key, key_before), key);
+	}
+
+	void KeyframeTrack::clear(){
+		keys.clear();
+	}
+
+	bool KeyframeTrack::empty() const{
+		return keys.empty();
+	}
+
+	/**
+	* Interpolate the pose at a time. The track must not be empty.
+	* @param time Time in seconds.
+	* @return the interpolated pose.
+	*/
+	Keyframe KeyframeTrack::sample(real_t time) const{
+		Keyframe probe;
+		probe.time = time;
+		std::vector<Keyframe>::const_iterator next =
+			std::upper_bound(keys.begin(), keys.end(), probe, key_before);
+		if (next == keys.begin()) return keys.front();
+		if (next == keys.end()) return keys.back();
+
+		const Keyframe& a = *(next - 1);
+		const Keyframe& b = *next;
+		real_t t = (time - a.time) / (b.time - a.time);
+		Keyframe rv;
+		rv.time = time;
+		rv.position = a.position + (b.position - a.position) * t;
+		rv.orientation = slerp(a.orientation, b.orientation, t);
+		rv.scale = a.scale + (b.scale - a.scale) * t;
+		return rv;
+	}
+
+} /* _462 */
@@ -0,0 +1,42 @@
+/**
+* @file animation.hpp
+* @brief keyframed transforms of cameras and geometries
+*
+* A track is a list of poses at given times. Between two keys the position
+* and scale are interpolated linearly and the orientation with slerp, along
+* the shorter arc, so turns of half a circle or more need keys in between.
+* Before the first key and after the last one the pose is held.
+*/
+
+#ifndef _462_SCENE_ANIMATION_HPP_
+#define _462_SCENE_ANIMATION_HPP_
+
+#include "math/vector.hpp"
+#include "math/quaternion.hpp"
+#include <vector>
+
+namespace _462 {
+
+	struct Keyframe{
+		// time of the key in seconds
+		real_t time;
+		Vector3 position;
+		Quaternion orientation;
+		Vector3 scale;
+	};
+
+	class KeyframeTrack{
+	public:
+		void add_key(const Keyframe& key);
+		void clear();
+
+		bool empty() const;
+		Keyframe sample(real_t time) const;
+	private:
+		// sorted by time
+		std::vector<Keyframe> keys;
+	};
+
+} /* _462 */
+
+#endif /* _462_SCENE_ANIMATION_HPP_ */
@@ -0,0 +1,130 @@
+/**
+* @file arena.cpp
+* @brief bump allocator for scene data
+*/
+
+#include "scene/arena.hpp"
+#include "scene/numa.hpp"
+#include <cstdint>
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace _462{
+
+	// blocks start small, so small models waste little, and double up to the max
+	#define ARENA_MIN_BLOCK (64 * 1024)
+	#define ARENA_MAX_BLOCK (32 * 1024 * 1024)
+	// blocks this large are aligned to and backed by huge pages where possible
+	#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+	// bytes an ArenaRange takes from its arena at a time
+	#define ARENA_RANGE_CHUNK (64 * 1024)
+
+	Arena::Arena() : next(NULL), end(NULL) { }
+
+	Arena::~Arena(){
+		clear();
+	}
+
+	/**
+	* Allocate memory that stays valid until the arena is cleared. Safe to
+	* call from several threads.
+	* @param size Number of bytes.
+	* @param align Alignment of the memory, a power of two.
+	* @return the memory, never NULL.
+	*/
+	void* Arena::allocate(size_t size, size_t align){
+		std::lock_guard<std::mutex> guard(lock);
+		unsigned char* p = (unsigned char*)((uintptr_t(next) + align - 1) & ~uintptr_t(align - 1));
+		if (next == NULL || p + size > end){
+			add_block(size + align);
+			p = (unsigned char*)((uintptr_t(next) + align - 1) & ~uintptr_t(align - 1));
+		}
+		next = p + size;
+		return p;
+	}
+
+	ArenaRange::ArenaRange(Arena& arena) : arena(arena), next(NULL), end(NULL) { }
+
+	/**
+	* Allocate memory that stays valid until the arena is cleared, from the
+	* current chunk of the range. Only one thread may use a range.
+	* @param size Number of bytes.
+	* @param align Alignment of the memory, a power of two.
+	* @return the memory, never NULL.
+	*/
+	void* ArenaRange::allocate(size_t size, size_t align){
+		unsigned char* p = (unsigned char*)((uintptr_t(next) + align - 1) & ~uintptr_t(align - 1));
+		if (next == NULL || p + size > end){
+			// larger objects do not fit a chunk, they come from the arena alone
+			if (size + align > ARENA_RANGE_CHUNK) return arena.allocate(size, align);
+			next = (unsigned char*)arena.allocate(ARENA_RANGE_CHUNK, align);
+			end = next + ARENA_RANGE_CHUNK;
+			p = next;
+		}
+		next = p + size;
+		return p;
+	}
+
+	/**
+	* Map a new block, twice as large as the last one, and bump from it.
+	* @param min_size The block has at least this many bytes.
+	*/
+	void Arena::add_block(size_t min_size){
+		size_t size = blocks.empty() ? ARENA_MIN_BLOCK : blocks.back().size * 2;
+		if (size > ARENA_MAX_BLOCK) size = ARENA_MAX_BLOCK;
+		if (size < min_size) size = min_size;
+
+		unsigned char* base = NULL;
+#ifndef _WIN32
+		if (size >= ARENA_HUGE_PAGE){
+			size = (size + ARENA_HUGE_PAGE - 1) & ~size_t(ARENA_HUGE_PAGE - 1);
+			// map one huge page more, then trim both ends to an aligned block
+			size_t mapped = size + ARENA_HUGE_PAGE;
+			void* m = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (m != MAP_FAILED){
+				unsigned char* raw = (unsigned char*)m;
+				base = (unsigned char*)((uintptr_t(raw) + ARENA_HUGE_PAGE - 1) & ~uintptr_t(ARENA_HUGE_PAGE - 1));
+				if (base > raw) munmap(raw, base - raw);
+				if (raw + mapped > base + size) munmap(base + size, raw + mapped - (base + size));
+#ifdef MADV_HUGEPAGE
+				madvise(base, size, MADV_HUGEPAGE);
+#endif
+			}
+		}
+		else{
+			void* m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (m != MAP_FAILED) base = (unsigned char*)m;
+		}
+#else
+		base = (unsigned char*)malloc(size);
+#endif
+		if (base == NULL) throw std::bad_alloc();
+		numa_interleave(base, size);
+
+		Block b = { base, size };
+		blocks.push_back(b);
+		next = base;
+		end = base + size;
+	}
+
+	/**
+	* Release all memory at once. Everything allocated before is invalid.
+	*/
+	void Arena::clear(){
+		std::lock_guard<std::mutex> guard(lock);
+		for (size_t i = 0; i < blocks.size(); ++i){
+#ifndef _WIN32
+			munmap(blocks[i].base, blocks[i].size);
+#else
+			free(blocks[i].base);
+#endif
+		}
+		blocks.clear();
+		next = NULL;
+		end = NULL;
+	}
+
+} /* _462 */
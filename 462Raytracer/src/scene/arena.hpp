@@ -0,0 +1,81 @@
+/**
+* @file arena.hpp
+* @brief bump allocator for scene data
+*
+* Objects with many small instances, like the triangles of models and the
+* nodes of bvh trees, are carved out of large blocks one after another, so
+* they sit packed in memory in the order they were made. Nothing is freed
+* on its own, the whole arena is released at once. Destructors are not
+* run, so only objects that own no other memory may live in an arena.
+* Threads that make many objects at once take an ArenaRange each.
+*/
+
+#ifndef _462_SCENE_ARENA_HPP_
+#define _462_SCENE_ARENA_HPP_
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace _462 {
+
+	class Arena{
+	public:
+		Arena();
+		~Arena();
+
+		void* allocate(size_t size, size_t align);
+		void clear();
+
+		// construct an object of a type with a public default constructor
+		template<typename T>
+		T* create(){
+			return new (allocate(sizeof(T), alignof(T))) T();
+		}
+	private:
+		struct Block{
+			unsigned char* base;
+			size_t size;
+		};
+		std::vector<Block> blocks;
+		// free space of the last block
+		unsigned char* next;
+		unsigned char* end;
+		std::mutex lock;
+
+		void add_block(size_t min_size);
+
+		// prevent copy/assignment
+		Arena(const Arena&);
+		Arena& operator=(const Arena&);
+	};
+
+	// a chunk of an arena that one thread bumps from without the lock of the
+	// arena, which is only taken for the next chunk once this one is used up
+	class ArenaRange{
+	public:
+		ArenaRange(Arena& arena);
+
+		void* allocate(size_t size, size_t align);
+		Arena& get_arena() const { return arena; }
+
+		// construct an object of a type with a public default constructor
+		template<typename T>
+		T* create(){
+			return new (allocate(sizeof(T), alignof(T))) T();
+		}
+	private:
+		Arena& arena;
+		// free space of the current chunk
+		unsigned char* next;
+		unsigned char* end;
+
+		// prevent copy/assignment
+		ArenaRange(const ArenaRange&);
+		ArenaRange& operator=(const ArenaRange&);
+	};
+
+} /* _462 */
+
+#endif /* _462_SCENE_ARENA_HPP_ */
@@ -43,7 +43,14 @@ public:
 	}
 
     bool intersects(const Ray &ray) const;
+    bool intersects(const Ray &ray, real_t t_max) const;
     real_t dim(int i){return upper[i]-lower[i];}
+    //surface area of the box, 0 for an empty box
+    real_t surface_area() const{
+        Vector3 d=upper-lower;
+        if(d.x<0 || d.y<0 || d.z<0) return 0;
+        return 2*(d.x*d.y+d.y*d.z+d.z*d.x);
+    }
     void assertIn(Vector3 other){
         for(int i =0;i<3;i++){
             assert(lower[i]<=other[i] && other[i]<=upper[i]);
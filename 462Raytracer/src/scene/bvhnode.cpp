@@ -8,134 +8,202 @@
 */
 
 #include "bvhnode.hpp"
+#include <algorithm>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
 
 namespace _462{
+
+	// subtrees with more primitives than this are built as separate tasks
+	#define BVH_TASK_SIZE 4096
+
+	// a primitive during the build, its box and center are computed once
+	struct BvhNode::BuildPrim{
+		Bound box;
+		Vector3 center;
+		Geometry* geometry;
+	};
 	/**
-	* Build a bounding volume hierarchy tree by giving geometries 
-	* @param geo_list The whole list of geometries we want to add to tree.
-	* @param axis The x, y or z axis that current node use to divide child node.
-	* @param start Start index of belonging geometries of current node. Inclusive.
-	* @param end End index of belonging geometries of current node. Inclusive.
-	* @return the bvh node.
+	* Build a bounding volume hierarchy tree with the surface area heuristic,
+	* evaluated at the given number of splits per node. Large subtrees are
+	* built as OpenMP tasks, on the threads of the current parallel region or
+	* of a new one. Every task allocates its nodes from its own ArenaRange,
+	* so the arena is only locked once per chunk of nodes.
+	* @param geo_list The geometries to add to the tree, left unchanged.
+	* @param arena Where the nodes are allocated, they live as long as it.
+	* @param bins Bins per node, up to BVH_MAX_BINS; other than BVH_BINS
+	*  only to compare trees.
+	* @return the root node.
 	*/
-	BvhNode::BvhNode(std::vector< Geometry* >& geo_list, int axis, size_t start, size_t end){
-		size_t n = end - start + 1;
-		if (n <= 0){
-			left = NULL;
-			right = NULL;
-			return;
-		}
-		if (n == 1){
-			left = geo_list[start];
-			right = NULL;
-			box = geo_list[start]->box;
-		}
-		else if (n == 2){
-			left = geo_list[start];
-			right = geo_list[end];
-			box = Bound(left->box, right->box);
+	BvhNode* BvhNode::build(const std::vector<Geometry* >& geo_list, Arena& arena, int bins){
+		size_t n = geo_list.size();
+		ArenaRange range(arena);
+		if (n == 0){
+			return new_node(range);
 		}
-		else {
-			//find the midpoint of the box 
-			Bound limit = geo_list[start]->box;
-			for (size_t i = start + 1; i <= end; ++i){
-				limit = Bound(limit, geo_list[i]->box);
-			}
-			Vector3 midpoint = limit.get_center();
-
-			// partition geo_list into left and right by the midpoint
-			size_t i = start, j = end;
-			// quick partition
-			while (i < j){
-				switch (axis)
-				{
-				// use x axis to divide
-				case 0:
-					while (i < j && geo_list[i]->box.get_center().x <= midpoint.x)
-					{
-						i++;
-					}
-					while (i < j && geo_list[j]->box.get_center().x > midpoint.x){
-						j--;
-					}
-					break;
-				// use y axis to divide
-				case 1:
-					while (i < j && geo_list[i]->box.get_center().y <= midpoint.y)
-					{
-						i++;
-					}
-					while (i < j && geo_list[j]->box.get_center().y > midpoint.y){
-						j--;
-					}
-					break;
-				// use z axis to divide
-				case 2:
-					while (i < j && geo_list[i]->box.get_center().z <= midpoint.z)
-					{
-						i++;
-					}
-					while (i < j && geo_list[j]->box.get_center().z > midpoint.z){
-						j--;
-					}
-					break;
-				default:
-					//should not go to here!!!
-					assert(false);
-					break;
-				} /* end switch */
-				if (i < j){
-					// swap i, j 
-					Geometry* g = geo_list[i];
-					geo_list[i] = geo_list[j];
-					geo_list[j] = g;
-				}
-			}/* end while*/
 
-			// get new left node and right node
+		std::vector<BuildPrim> prims(n);
+		for (size_t i = 0; i < n; ++i){
+			prims[i].box = geo_list[i]->box;
+			prims[i].center = prims[i].box.get_center();
+			prims[i].geometry = geo_list[i];
+		}
 
-			left = new BvhNode(geo_list, (axis + 1) % 3, start, i - 1);
-			right = new BvhNode(geo_list, (axis + 1) % 3, j, end);
+		bins = std::max(2, std::min(bins, BVH_MAX_BINS));
+		BvhNode* root = NULL;
+#ifdef OPENMP
+		if (!omp_in_parallel()){
+#pragma omp parallel
+#pragma omp single
+			root = build_range(&prims[0], n, range, bins);
+			return root;
+		}
+#endif
+		root = build_range(&prims[0], n, range, bins);
+		return root;
+	}
 
-			box = Bound(left->box,right->box);
+	/**
+	* Build a node over a range of primitives, which is reordered.
+	* @param prims The primitives of the node.
+	* @param n Number of primitives, at least 1.
+	* @param range Where the nodes are allocated, used by this task only.
+	* @param bins Bins the splits are evaluated at.
+	* @return the new node.
+	*/
+	BvhNode* BvhNode::build_range(BuildPrim* prims, size_t n, ArenaRange& range, int bins){
+		BvhNode* node = new_node(range);
+		if (n <= 2){
+			node->left = prims[0].geometry;
+			node->right = n == 2 ? prims[1].geometry : NULL;
+			node->box = n == 2 ? Bound(prims[0].box, prims[1].box) : prims[0].box;
+			return node;
 		}
+
+		size_t mid = split(prims, n, bins);
+		Geometry* left = NULL;
+		Geometry* right = NULL;
+		if (n > BVH_TASK_SIZE){
+			Arena& arena = range.get_arena();
+#ifdef OPENMP
+#pragma omp task shared(left, arena)
+#endif
+			{
+				ArenaRange task_range(arena);
+				left = build_child(prims, mid, task_range, bins);
+			}
+			right = build_child(prims + mid, n - mid, range, bins);
+#ifdef OPENMP
+#pragma omp taskwait
+#endif
+		}
+		else{
+			left = build_child(prims, mid, range, bins);
+			right = build_child(prims + mid, n - mid, range, bins);
+		}
+
+		node->left = left;
+		node->right = right;
+		node->left_node = mid > 1;
+		node->right_node = n - mid > 1;
+		node->box = Bound(left->box, right->box);
+		return node;
 	}
 
+	// a single primitive is its own subtree
+	Geometry* BvhNode::build_child(BuildPrim* prims, size_t n, ArenaRange& range, int bins){
+		return n == 1 ? prims[0].geometry : build_range(prims, n, range, bins);
+	}
+
+	BvhNode* BvhNode::new_node(ArenaRange& range){
+		return new (range.allocate(sizeof(BvhNode), alignof(BvhNode))) BvhNode();
+	}
 
 	/**
-	* Performs a recursively intersection test of giving ray
-	* @param r The ray used to do intersection test
-	* @param t Output intersection time t.
-	* @param info Output intersection information.
-	* @return True if find a intersection otherwise return False.
+	* Partition primitives at the cheapest split of the surface area heuristic
+	* along the longest axis of their centers.
+	* @param prims The primitives to partition.
+	* @param n Number of primitives, at least 3.
+	* @param bins Number of splits evaluated, at most BVH_MAX_BINS.
+	* @return the number of primitives in the left part, in [1, n - 1].
 	*/
-	bool BvhNode::intersect_test(const Ray& r, real_t& t, Intersection& info){
-		if (box.intersects(r)){
-			Intersection lrec, rrec;
-			real_t lt, rt;
-			bool left_hit = left != NULL && left->intersect_test(r, lt, lrec);
-			bool right_hit = right != NULL && right->intersect_test(r, rt, rrec);
-			if (left_hit && right_hit){
-				if (lt < rt){
-					t = lt;
-					info = lrec;
-				}
-				else{
-					t = rt;
-					info = rrec;
+	size_t BvhNode::split(BuildPrim* prims, size_t n, int bins){
+		Bound limit = Bound(prims[0].center);
+		for (size_t i = 1; i < n; ++i){
+			limit = Bound(limit, Bound(prims[i].center));
+		}
+		int axis = 0;
+		if (limit.dim(1) > limit.dim(axis)) axis = 1;
+		if (limit.dim(2) > limit.dim(axis)) axis = 2;
+		real_t lower = limit.lower[axis];
+		real_t extent = limit.dim(axis);
+
+		if (extent > 0){
+			// sort the primitives into bins by their center
+			Bound bin_box[BVH_MAX_BINS];
+			size_t bin_count[BVH_MAX_BINS] = { 0 };
+			real_t scale = bins / extent;
+			for (size_t i = 0; i < n; ++i){
+				int b = std::min(bins - 1, int((prims[i].center[axis] - lower) * scale));
+				bin_box[b] = Bound(bin_box[b], prims[i].box);
+				bin_count[b]++;
+			}
+
+			// area and count right of every split, then sweep from the left
+			real_t right_area[BVH_MAX_BINS];
+			size_t right_count[BVH_MAX_BINS];
+			Bound acc;
+			size_t count = 0;
+			for (int b = bins - 1; b > 0; --b){
+				acc = Bound(acc, bin_box[b]);
+				count += bin_count[b];
+				right_area[b] = acc.surface_area();
+				right_count[b] = count;
+			}
+
+			int best = -1;
+			real_t best_cost = INFINITY;
+			acc = Bound();
+			count = 0;
+			for (int b = 1; b < bins; ++b){
+				acc = Bound(acc, bin_box[b - 1]);
+				count += bin_count[b - 1];
+				if (count == 0 || right_count[b] == 0) continue;
+				real_t cost = acc.surface_area() * count + right_area[b] * right_count[b];
+				if (cost < best_cost){
+					best_cost = cost;
+					best = b;
 				}
-				return true;
 			}
-			else if (left_hit){
-				t = lt;
-				info = lrec;
-				return true;
-			}else if (right_hit){
-				t = rt;
-				info = rrec;
-				return true;
+
+			if (best > 0){
+				BuildPrim* mid = std::partition(prims, prims + n, [&](const BuildPrim& p){
+					return std::min(bins - 1, int((p.center[axis] - lower) * scale)) < best;
+				});
+				return size_t(mid - prims);
 			}
-			else return false;
+		}
+
+		// all centers in one bin, split by count
+		std::nth_element(prims, prims + n / 2, prims + n, [&](const BuildPrim& a, const BuildPrim& b){
+			return a.center[axis] < b.center[axis];
+		});
+		return n / 2;
+	}
+
+	/**
+	* Performs a recursively intersection test of giving ray
+	* @param r The ray used to do intersection test
+	* @param rec Closest hit found so far, updated if a closer one is found.
+	* @return True if find a closer intersection otherwise return False.
+	*/
+	bool BvhNode::intersect_test(const Ray& r, HitRecord& rec){
+		if (box.intersects(r, rec.t)){
+			bool left_hit = left != NULL && left->intersect_test(r, rec);
+			bool right_hit = right != NULL && right->intersect_test(r, rec);
+			return left_hit || right_hit;
 		}
 		return false;
 	}
@@ -158,6 +226,136 @@ namespace _462{
 		return false;
 	}
 
+	/**
+	* Performs a recursively shadow test of giving ray, and find the primitive
+	* which blocks the ray.
+	* @param r The ray used to do intersection test
+	* @param t Distance to the light.
+	* @return The blocking primitive, or NULL if the ray reaches the light.
+	*/
+	Geometry* BvhNode::shadow_occluder(const Ray &r, real_t t){
+		if (box.intersects(r)){
+			Geometry* occluder = left != NULL ? left->shadow_occluder(r, t) : NULL;
+			if (occluder == NULL && right != NULL){
+				occluder = right->shadow_occluder(r, t);
+			}
+			return occluder;
+		}
+		return NULL;
+	}
+
+	/**
+	* Append this node and its subtree to a flat node list, in pre-order.
+	* @param prim_index Index of every primitive of the tree.
+	* @param nodes The list to append to.
+	*/
+	void BvhNode::flatten(const std::unordered_map<const Geometry*, int32_t>& prim_index, std::vector<BvhFlatNode>& nodes) const{
+		size_t index = nodes.size();
+		nodes.push_back(BvhFlatNode());
+		int32_t children[2];
+		Geometry* child[2] = { left, right };
+		for (size_t i = 0; i < 2; ++i){
+			std::unordered_map<const Geometry*, int32_t>::const_iterator it = child[i] ? prim_index.find(child[i]) : prim_index.end();
+			if (child[i] == NULL){
+				children[i] = BVH_FLAT_NONE;
+			}
+			else if (it != prim_index.end()){
+				children[i] = -(it->second + 1);
+			}
+			else{
+				// anything else in the tree is an inner node
+				children[i] = int32_t(nodes.size());
+				static_cast<const BvhNode*>(child[i])->flatten(prim_index, nodes);
+			}
+		}
+		nodes[index].left = children[0];
+		nodes[index].right = children[1];
+	}
+
+	/**
+	* Rebuild a tree from its flat node list, and fit the boxes to the primitives.
+	* @param nodes The flat node list, root first.
+	* @param num_nodes Number of nodes in the list.
+	* @param prims The primitives the node list refers to.
+	* @param arena Where the nodes are allocated.
+	* @return the root, or NULL if the list is not a valid tree.
+	*/
+	BvhNode* BvhNode::unflatten(const BvhFlatNode* nodes, size_t num_nodes, const std::vector<Geometry*>& prims, Arena& arena){
+		if (num_nodes == 0) return NULL;
+
+		// children always come after their parent, so there are no cycles
+		for (size_t i = 0; i < num_nodes; ++i){
+			int32_t children[2] = { nodes[i].left, nodes[i].right };
+			for (size_t j = 0; j < 2; ++j){
+				int32_t c = children[j];
+				if (c == BVH_FLAT_NONE) continue;
+				if (c < 0 ? size_t(-(int64_t(c) + 1)) >= prims.size() : (size_t(c) <= i || size_t(c) >= num_nodes)){
+					return NULL;
+				}
+			}
+		}
+		ArenaRange range(arena);
+		return unflatten_node(nodes, 0, prims, range);
+	}
+
+	BvhNode* BvhNode::unflatten_node(const BvhFlatNode* nodes, size_t index, const std::vector<Geometry*>& prims, ArenaRange& range){
+		BvhNode* node = new_node(range);
+		int32_t children[2] = { nodes[index].left, nodes[index].right };
+		Geometry* child[2] = { NULL, NULL };
+		for (size_t j = 0; j < 2; ++j){
+			int32_t c = children[j];
+			if (c == BVH_FLAT_NONE) continue;
+			child[j] = c < 0 ? prims[size_t(-(int64_t(c) + 1))] : unflatten_node(nodes, size_t(c), prims, range);
+		}
+		node->left = child[0];
+		node->right = child[1];
+		node->left_node = children[0] >= 0;
+		node->right_node = children[1] >= 0;
+		node->refit_box();
+		return node;
+	}
+
+	/**
+	* Recompute the boxes of the tree bottom up after its primitives moved,
+	* keeping the structure. Much faster than a build, but the tree gets
+	* worse the further the primitives move relative to each other.
+	*/
+	void BvhNode::refit(){
+		if (left_node) static_cast<BvhNode*>(left)->refit();
+		if (right_node) static_cast<BvhNode*>(right)->refit();
+		refit_box();
+	}
+
+	/**
+	* Expected cost of a ray through the tree under the surface area
+	* heuristic: the boxes it tests and the primitives it intersects, each
+	* weighted by the chance to reach it, the area of its parent box over
+	* that of the root. Lower is better; compares trees over the same
+	* primitives.
+	*/
+	real_t BvhNode::sah_cost() const{
+		real_t area = box.surface_area();
+		return area > 0 ? sah_area() / area : 0;
+	}
+
+	// the box tests and intersections of the subtree, weighted by area
+	real_t BvhNode::sah_area() const{
+		int children = (left != NULL) + (right != NULL);
+		real_t cost = box.surface_area() * children;
+		if (left_node) cost += static_cast<const BvhNode*>(left)->sah_area();
+		if (right_node) cost += static_cast<const BvhNode*>(right)->sah_area();
+		return cost;
+	}
+
+	void BvhNode::refit_box(){
+		if (left && right){
+			box = Bound(left->box, right->box);
+		}
+		else if (left){
+			box = left->box;
+		}
+	}
+
 	/**
 	* Render function since it inherited from Geometry class which is abstract.
 	*/
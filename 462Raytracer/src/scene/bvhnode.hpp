@@ -9,20 +9,57 @@
 
 #ifndef _462_SCENE_BVHNODE_HPP_
 #define _462_SCENE_BVHNODE_HPP_
+#include "scene/arena.hpp"
 #include "scene/bound.hpp"
 #include "scene/scene.hpp"
+#include <stdint.h>
+#include <unordered_map>
 
 namespace _462 {
+	// a node of a tree stored by index, used to save a tree to a file.
+	// children are node indices if >= 0, primitive -(child + 1) if < 0
+	struct BvhFlatNode{
+		int32_t left;
+		int32_t right;
+	};
+
+	// no child
+	#define BVH_FLAT_NONE INT32_MIN
+
+	// number of bins the surface area heuristic evaluates splits at, and the
+	// most a build may be asked for
+	#define BVH_BINS 16
+	#define BVH_MAX_BINS 64
+
 	class BvhNode : public Geometry{
 	public:
-		BvhNode(std::vector<Geometry* >& geo_list, int axis, size_t start, size_t end);
+		static BvhNode* build(const std::vector<Geometry* >& geo_list, Arena& arena, int bins = BVH_BINS);
+		void refit();
+		real_t sah_cost() const;
+
+		static BvhNode* unflatten(const BvhFlatNode* nodes, size_t num_nodes, const std::vector<Geometry*>& prims, Arena& arena);
+		void flatten(const std::unordered_map<const Geometry*, int32_t>& prim_index, std::vector<BvhFlatNode>& nodes) const;
 		virtual void render() const;
 
-		virtual bool intersect_test(const Ray& r, real_t& t, Intersection& info);
+		virtual bool intersect_test(const Ray& r, HitRecord& rec);
 		virtual bool shadow_test(const Ray &r, real_t dis);
+		virtual Geometry* shadow_occluder(const Ray &r, real_t dis);
 	private:
 		Geometry* left;
 		Geometry* right;
+		// which children are nodes of this tree, refit recurses into them
+		bool left_node;
+		bool right_node;
+
+		BvhNode() : left(NULL), right(NULL), left_node(false), right_node(false) { }
+		struct BuildPrim;
+		static BvhNode* new_node(ArenaRange& range);
+		static BvhNode* build_range(BuildPrim* prims, size_t n, ArenaRange& range, int bins);
+		static Geometry* build_child(BuildPrim* prims, size_t n, ArenaRange& range, int bins);
+		static size_t split(BuildPrim* prims, size_t n, int bins);
+		real_t sah_area() const;
+		static BvhNode* unflatten_node(const BvhFlatNode* nodes, size_t index, const std::vector<Geometry*>& prims, ArenaRange& range);
+		void refit_box();
 	};
 
 } /* 462 */
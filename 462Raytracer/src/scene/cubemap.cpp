@@ -1,10 +1,20 @@
 #include "cubemap.hpp"
+#include <algorithm>
+#include <cmath>
 
 namespace _462 {
 
+// the environment light is sampled from the first level at most this many
+// texels wide, small enough to search quickly
+#define CUBEMAP_LIGHT_SIZE 32
+// least luminance a texel is sampled with, so dark parts of the sky still
+// get some samples
+#define CUBEMAP_LIGHT_FLOOR 0.01
+
 	Cubemap::Cubemap(std::string file)
 	{
 		filename = file;
+		light_level = 0;
 	}
 
 	const std::string Cubemap::tex_name[6] = { "posx", "negx", "posy", "negy", "posz", "negz" };
@@ -15,19 +25,124 @@ namespace _462 {
 		if (filename.empty())
 			return true;
 		std::cout << "Load cubemap " << filename << "...\n";
-		std::string pre_path = "cubemaps/" + filename + "/";
-		
-		bool res = true;
+		init_filenames();
 
+		// decode the faces in parallel
+		int res = 1;
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(&&:res)
+#endif
+		for (int i = 0; i < 6; i++){
+			res = texture[i].load() && res;
+		}
+		if (res)
+			prefilter();
+		return res != 0;
+	}
+
+	// set the filenames of the six faces, without loading them
+	void Cubemap::init_filenames(){
+		std::string pre_path = "cubemaps/" + filename + "/";
 		for (int i = 0; i < 6; i++){
 			texture[i].filename = pre_path + tex_name[i] + ".png";
-			res = res && texture[i].load();
 		}
-		return res;
+	}
+
+	// the six faces, posx, negx, posy, negy, posz, negz
+	Texture* Cubemap::get_faces(){
+		return texture;
+	}
+
+	// the direction through the face coordinates sc, tc in [-1, 1], the
+	// inverse of index_cubemap
+	static Vector3 face_direction(size_t face, real_t sc, real_t tc){
+		switch (face){
+		case 0: return Vector3(1, tc, -sc);
+		case 1: return Vector3(-1, tc, sc);
+		case 2: return Vector3(sc, 1, -tc);
+		case 3: return Vector3(sc, -1, tc);
+		case 4: return Vector3(sc, tc, 1);
+		default: return Vector3(-sc, tc, -1);
+		}
+	}
+
+	/**
+	* Converts the loaded faces into float colors with a mip chain, for
+	* blurred lookups, and builds the distribution the environment light is
+	* sampled with. Called once the faces are loaded.
+	*/
+	void Cubemap::prefilter(){
+		levels.clear();
+		light_cdf.clear();
+		int size = texture[0].width;
+		for (int i = 0; i < 6; i++){
+			if (size <= 0 || texture[i].width != size || texture[i].height != size){
+				std::cout << "Cubemap " << filename << " needs six square faces of the same size\n";
+				return;
+			}
+		}
+
+		levels.resize(1);
+		levels[0].size = size;
+		levels[0].texels.resize(6 * size_t(size) * size);
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (int row = 0; row < 6 * size; row++){
+			int face = row / size;
+			int y = row % size;
+			Color3* out = &levels[0].texels[size_t(row) * size];
+			for (int x = 0; x < size; x++){
+				out[x] = texture[face].get_texture_pixel(x, y);
+			}
+		}
+
+		// each level averages 2x2 texels of the one before, an odd last
+		// texel is averaged with itself
+		while (levels.back().size > 1){
+			size_t l = levels.size();
+			levels.resize(l + 1);
+			const CubemapLevel& prev = levels[l - 1];
+			CubemapLevel& next = levels[l];
+			int n = prev.size;
+			next.size = (n + 1) / 2;
+			next.texels.resize(6 * size_t(next.size) * next.size);
+			for (int face = 0; face < 6; face++){
+				const Color3* in = &prev.texels[face * size_t(n) * n];
+				Color3* out = &next.texels[face * size_t(next.size) * next.size];
+				for (int y = 0; y < next.size; y++){
+					int y0 = 2 * y;
+					int y1 = std::min(y0 + 1, n - 1);
+					for (int x = 0; x < next.size; x++){
+						int x0 = 2 * x;
+						int x1 = std::min(x0 + 1, n - 1);
+						out[y * next.size + x] = real_t(0.25) * (in[y0 * n + x0] + in[y0 * n + x1]
+							+ in[y1 * n + x0] + in[y1 * n + x1]);
+					}
+				}
+			}
+		}
+
+		// texels are picked by their luminance times their solid angle
+		light_level = 0;
+		while (levels[light_level].size > CUBEMAP_LIGHT_SIZE)
+			light_level++;
+		const CubemapLevel& light = levels[light_level];
+		int n = light.size;
+		light_cdf.resize(light.texels.size());
+		double sum = 0;
+		for (size_t i = 0; i < light.texels.size(); i++){
+			real_t sc = (real_t(i % n) + real_t(0.5)) * 2 / n - 1;
+			real_t tc = (real_t(i / n % n) + real_t(0.5)) * 2 / n - 1;
+			real_t r2 = 1 + sc * sc + tc * tc;
+			real_t solid_angle = real_t(4) / (real_t(n) * n) / (r2 * std::sqrt(r2));
+			sum += std::max(luminance(light.texels[i]), real_t(CUBEMAP_LIGHT_FLOOR)) * solid_angle;
+			light_cdf[i] = sum;
+		}
 	}
 
 	//get the index of texture we need to sample, and it's coordinate
-	void Cubemap::index_cubemap(Vector3 d, size_t& face, real_t& s, real_t& t){
+	void Cubemap::index_cubemap(Vector3 d, size_t& face, real_t& s, real_t& t) const{
 		Vector3 absd;
 		float sc = 0.0f, tc = 0.0f, ma = 1.0f;
 
@@ -79,13 +194,119 @@ namespace _462 {
 		}
 	}
 
-	//
+	// the sharp color of the environment in direction d
 	Color3 Cubemap::texCube(Vector3 d){
+		return texCube(d, 0);
+	}
+
+	/**
+	* The color of the environment in direction d, blurred over a cone.
+	* @param footprint Width of the cone in radians, it picks the level.
+	*/
+	Color3 Cubemap::texCube(Vector3 d, real_t footprint){
 		size_t face;
 		real_t s, t;
 		index_cubemap(d, face, s, t);
 		assert(face < 6);
-		return texture[face].sample(s, t);
+		if (levels.empty()){
+			return texture[face].sample(s, t);
+		}
+
+		// a face spans two units of tangent around its center, so the cone
+		// covers about half its width in texture coordinates
+		real_t lod = footprint > 0 ? std::log2(footprint * real_t(0.5) * levels[0].size) : 0;
+		size_t max_level = levels.size() - 1;
+		if (lod <= 0){
+			return sample_level(0, face, s, t);
+		}
+		if (lod >= max_level){
+			return sample_level(max_level, face, s, t);
+		}
+		size_t l0 = (size_t)lod;
+		real_t f = lod - l0;
+		return (1 - f) * sample_level(l0, face, s, t) + f * sample_level(l0 + 1, face, s, t);
+	}
+
+	// interpolates the four texels of a face around s, t, clamped to the face
+	Color3 Cubemap::sample_level(size_t level, size_t face, real_t s, real_t t) const{
+		const CubemapLevel& l = levels[level];
+		real_t u = s * l.size - real_t(0.5);
+		real_t v = t * l.size - real_t(0.5);
+		int i = (int)std::floor(u);
+		int j = (int)std::floor(v);
+		real_t u1 = u - i;
+		real_t v1 = v - j;
+		// hermite interpolation weights, like the textures
+		real_t u2 = u1 * u1 * (3 - 2 * u1);
+		real_t v2 = v1 * v1 * (3 - 2 * v1);
+		int x0 = std::max(0, std::min(i, l.size - 1));
+		int x1 = std::max(0, std::min(i + 1, l.size - 1));
+		int y0 = std::max(0, std::min(j, l.size - 1));
+		int y1 = std::max(0, std::min(j + 1, l.size - 1));
+		const Color3* texels = &l.texels[face * size_t(l.size) * l.size];
+		return (1 - u2) * (1 - v2) * texels[y0 * l.size + x0]
+			+ u2 * (1 - v2) * texels[y0 * l.size + x1]
+			+ (1 - u2) * v2 * texels[y1 * l.size + x0]
+			+ u2 * v2 * texels[y1 * l.size + x1];
+	}
+
+	/**
+	* Picks a direction toward the environment, with a probability that
+	* follows its brightness, to light the scene with it.
+	* @param u1, u2, u3 Uniform random numbers in [0, 1).
+	* @param d The picked direction.
+	* @param radiance The light coming from d.
+	* @param pdf The probability density of d per unit solid angle.
+	* @return False if the cube map is not prefiltered.
+	*/
+	bool Cubemap::sample_light(real_t u1, real_t u2, real_t u3,
+		Vector3& d, Color3& radiance, real_t& pdf) const{
+		if (light_cdf.empty()){
+			return false;
+		}
+		double total = light_cdf.back();
+		size_t i = std::upper_bound(light_cdf.begin(), light_cdf.end(), u1 * total) - light_cdf.begin();
+		i = std::min(i, light_cdf.size() - 1);
+		double p = (light_cdf[i] - (i > 0 ? light_cdf[i - 1] : 0)) / total;
+
+		// a uniform point of the texel
+		const CubemapLevel& light = levels[light_level];
+		int n = light.size;
+		real_t sc = (real_t(i % n) + u2) * 2 / n - 1;
+		real_t tc = (real_t(i / n % n) + u3) * 2 / n - 1;
+		real_t r2 = 1 + sc * sc + tc * tc;
+		d = face_direction(i / (size_t(n) * n), sc, tc) / std::sqrt(r2);
+		radiance = light.texels[i];
+		// the texel covers 4 / n^2 of the face, and a unit of the face
+		// covers 1 / r2^(3/2) of solid angle
+		pdf = real_t(p * n * n / 4) * r2 * std::sqrt(r2);
+		return true;
+	}
+
+	/**
+	* The light sample_light picks in direction d, for directions picked
+	* some other way.
+	* @param pdf The probability density sample_light picks d with.
+	*/
+	Color3 Cubemap::light_radiance(Vector3 d, real_t& pdf) const{
+		if (light_cdf.empty()){
+			pdf = 0;
+			return Color3::Black();
+		}
+		size_t face;
+		real_t s, t;
+		index_cubemap(d, face, s, t);
+		const CubemapLevel& light = levels[light_level];
+		int n = light.size;
+		int x = std::max(0, std::min((int)(s * n), n - 1));
+		int y = std::max(0, std::min((int)(t * n), n - 1));
+		size_t i = face * size_t(n) * n + y * n + x;
+		double p = (light_cdf[i] - (i > 0 ? light_cdf[i - 1] : 0)) / light_cdf.back();
+		real_t sc = 2 * s - 1;
+		real_t tc = 2 * t - 1;
+		real_t r2 = 1 + sc * sc + tc * tc;
+		pdf = real_t(p * n * n / 4) * r2 * std::sqrt(r2);
+		return light.texels[i];
 	}
 
 }
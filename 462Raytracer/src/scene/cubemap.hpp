@@ -9,24 +9,46 @@
 #include "math/vector.hpp"
 #include "scene/texture.hpp"
 #include <string>
+#include <vector>
 
 #ifndef _462_SCENE_CUBEMAP_HPP_
 #define _462_SCENE_CUBEMAP_HPP_
 
 namespace _462 {
 
+	// one level of the prefiltered cube map, the six faces one after the other
+	struct CubemapLevel{
+		int size;
+		std::vector<Color3> texels;
+	};
+
 	class Cubemap
 	{
 	public:
 		std::string filename;
 		Cubemap(std::string file);
 		bool load();
+		void init_filenames();
+		Texture* get_faces();
+		void prefilter();
 		Color3 texCube(Vector3 d);
+		Color3 texCube(Vector3 d, real_t footprint);
+		bool sample_light(real_t u1, real_t u2, real_t u3,
+			Vector3& d, Color3& radiance, real_t& pdf) const;
+		Color3 light_radiance(Vector3 d, real_t& pdf) const;
 	private:
 		//six faces' texture 
 		Texture texture[6];
 		const static std::string tex_name[6];
-		void index_cubemap(Vector3 d, size_t& face, real_t& s, real_t& t);
+		// the faces as float colors, each level half the size of the one
+		// before, built by prefilter
+		std::vector<CubemapLevel> levels;
+		// the level the environment light is sampled from, and the running
+		// sum of the luminance times the solid angle of its texels
+		size_t light_level;
+		std::vector<double> light_cdf;
+		void index_cubemap(Vector3 d, size_t& face, real_t& s, real_t& t) const;
+		Color3 sample_level(size_t level, size_t face, real_t s, real_t t) const;
 	};
 }/* _462 */
 
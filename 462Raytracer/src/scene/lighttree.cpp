@@ -0,0 +1,180 @@
+/**
+* @file lighttree.cpp
+* @brief light bounding volume tree class
+*
+* A bounding volume tree over the sphere lights of a scene, used to pick
+* a few lights per shading point instead of visiting all of them.
+*/
+
+#include "scene/lighttree.hpp"
+#include <algorithm>
+
+namespace _462{
+
+	// orders light indices by the position of the light along one axis
+	struct LightAxisCompare{
+		const SphereLight* lights;
+		int axis;
+		bool operator()(size_t a, size_t b) const{
+			return lights[a].position[axis] < lights[b].position[axis];
+		}
+	};
+
+	LightTree::LightTree() : light_count(0) { }
+
+	/**
+	* Build the light tree over the given lights. Overrides any previous build.
+	* @param lights The lights of the scene.
+	* @param num_lights Number of lights in the array.
+	*/
+	void LightTree::build(const SphereLight* lights, size_t num_lights){
+		nodes.clear();
+		light_count = num_lights;
+		if (num_lights == 0) return;
+
+		std::vector<size_t> order(num_lights);
+		for (size_t i = 0; i < num_lights; ++i){
+			order[i] = i;
+		}
+		nodes.reserve(2 * num_lights - 1);
+		build_node(lights, order, 0, num_lights - 1);
+	}
+
+	/**
+	* Build a node of the tree by giving lights
+	* @param lights The lights of the scene.
+	* @param order Light indices, partitioned in place.
+	* @param start Start index of belonging lights of current node. Inclusive.
+	* @param end End index of belonging lights of current node. Inclusive.
+	* @return the index of the new node.
+	*/
+	size_t LightTree::build_node(const SphereLight* lights, std::vector<size_t>& order, size_t start, size_t end){
+		size_t index = nodes.size();
+		nodes.push_back(Node());
+
+		if (start == end){
+			const SphereLight& light = lights[order[start]];
+			Vector3 r = Vector3(light.radius, light.radius, light.radius);
+			Node& node = nodes[index];
+			node.box = Bound(light.position - r, light.position + r);
+			node.power = luminance(light.color);
+			node.attenuation = light.attenuation;
+			node.left = order[start];
+			node.right = order[start];
+			node.is_leaf = true;
+			return index;
+		}
+
+		// split at the median of the light positions along the longest axis
+		Bound limit = Bound(lights[order[start]].position);
+		for (size_t i = start + 1; i <= end; ++i){
+			limit = Bound(limit, Bound(lights[order[i]].position));
+		}
+		int axis = 0;
+		if (limit.dim(1) > limit.dim(axis)) axis = 1;
+		if (limit.dim(2) > limit.dim(axis)) axis = 2;
+
+		size_t mid = start + (end - start) / 2;
+		LightAxisCompare cmp = { lights, axis };
+		std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end + 1, cmp);
+
+		// children may reallocate nodes, so never keep a reference across them
+		size_t left = build_node(lights, order, start, mid);
+		size_t right = build_node(lights, order, mid + 1, end);
+
+		const Node& l = nodes[left];
+		const Node& r = nodes[right];
+		Node node;
+		node.box = Bound(l.box, r.box);
+		node.power = l.power + r.power;
+		node.attenuation.constant = std::min(l.attenuation.constant, r.attenuation.constant);
+		node.attenuation.linear = std::min(l.attenuation.linear, r.attenuation.linear);
+		node.attenuation.quadratic = std::min(l.attenuation.quadratic, r.attenuation.quadratic);
+		node.left = left;
+		node.right = right;
+		node.is_leaf = false;
+		nodes[index] = node;
+		return index;
+	}
+
+	/**
+	* Conservative estimate of the light a node can send to a shading point.
+	* @param node The node to estimate.
+	* @param p Position of the shading point.
+	* @param n Normal of the shading point.
+	* @return the importance of the node, 0 if it can not light the point.
+	*/
+	real_t LightTree::importance(const Node& node, const Vector3& p, const Vector3& n) const{
+		Vector3 half = (node.box.upper - node.box.lower) * real_t(0.5);
+		Vector3 l = node.box.lower + half - p;
+		real_t r = length(half);
+		real_t d = length(l);
+		real_t zero = real_t(0);
+		real_t one = real_t(1);
+
+		real_t cos_bound = one;
+		if (d > r){
+			// bound the angle between the normal and the cone of directions
+			// from p to the bounding sphere of the node
+			real_t sin_b = r / d;
+			real_t cos_b = std::sqrt(one - sin_b * sin_b);
+			real_t cos_n = (n * l) / d;
+			if (cos_n < cos_b){
+				real_t sin_n = std::sqrt(std::max(zero, one - cos_n * cos_n));
+				cos_bound = std::max(zero, cos_n * cos_b + sin_n * sin_b);
+			}
+			d -= r;
+		}
+		else{
+			d = zero;
+		}
+
+		real_t atten = node.attenuation.constant
+			+ d * node.attenuation.linear
+			+ d * d * node.attenuation.quadratic;
+		atten = std::max(atten, real_t(EPS));
+		return node.power * cos_bound / atten;
+	}
+
+	/**
+	* Pick a light for a shading point, with probability proportional to
+	* the importance of the subtrees along the way.
+	* @param p Position of the shading point.
+	* @param n Normal of the shading point.
+	* @param u Uniform random number in [0, 1).
+	* @param index Output index of the picked light.
+	* @param pdf Output probability of picking that light.
+	* @return False if no light can reach the point, otherwise return True.
+	*/
+	bool LightTree::sample(const Vector3& p, const Vector3& n, real_t u, size_t& index, real_t& pdf) const{
+		if (nodes.empty()) return false;
+
+		size_t current = 0;
+		pdf = real_t(1);
+		while (!nodes[current].is_leaf){
+			const Node& node = nodes[current];
+			real_t il = importance(nodes[node.left], p, n);
+			real_t ir = importance(nodes[node.right], p, n);
+			if (il + ir <= real_t(0)) return false;
+
+			real_t pl = il / (il + ir);
+			if (u < pl){
+				u = u / pl;
+				pdf *= pl;
+				current = node.left;
+			}
+			else{
+				u = (u - pl) / (real_t(1) - pl);
+				pdf *= real_t(1) - pl;
+				current = node.right;
+			}
+		}
+		index = nodes[current].left;
+		return pdf > real_t(0);
+	}
+
+	size_t LightTree::num_lights() const{
+		return light_count;
+	}
+
+} /* _462 */
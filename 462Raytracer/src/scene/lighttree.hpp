@@ -0,0 +1,51 @@
+/**
+* @file lighttree.hpp
+* @brief light bounding volume tree class
+*
+* A bounding volume tree over the sphere lights of a scene. Every node keeps
+* the bound, the total power and the weakest attenuation of its lights, so a
+* light can be importance sampled for a shading point in O(log lights).
+*/
+
+#ifndef _462_SCENE_LIGHTTREE_HPP_
+#define _462_SCENE_LIGHTTREE_HPP_
+
+#include "scene/bound.hpp"
+#include "scene/scene.hpp"
+#include <vector>
+
+namespace _462 {
+
+	class LightTree{
+	public:
+		LightTree();
+
+		void build(const SphereLight* lights, size_t num_lights);
+
+		bool sample(const Vector3& p, const Vector3& n, real_t u, size_t& index, real_t& pdf) const;
+
+		size_t num_lights() const;
+	private:
+		struct Node{
+			// bound of the light spheres below this node
+			Bound box;
+			// summed luminance of the lights below this node
+			real_t power;
+			// smallest attenuation coefficients of the lights below this node
+			SphereLight::Attenuation attenuation;
+			// children index, or the light index if this is a leaf
+			size_t left;
+			size_t right;
+			bool is_leaf;
+		};
+
+		std::vector<Node> nodes;
+		size_t light_count;
+
+		size_t build_node(const SphereLight* lights, std::vector<size_t>& order, size_t start, size_t end);
+		real_t importance(const Node& node, const Vector3& p, const Vector3& n) const;
+	};
+
+} /* _462 */
+
+#endif /* _462_SCENE_LIGHTTREE_HPP_ */
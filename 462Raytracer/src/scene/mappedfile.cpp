@@ -0,0 +1,90 @@
+/**
+* @file mappedfile.cpp
+* @brief read only memory mapped file
+*/
+
+#include "scene/mappedfile.hpp"
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace _462{
+
+	MappedFile::MappedFile() : bytes(NULL), length(0) { }
+
+	MappedFile::~MappedFile(){
+		close();
+	}
+
+	/**
+	* Map a file, closing any previously mapped one.
+	* @param filename The file to map.
+	* @return False if the file can not be opened or is empty, otherwise return True.
+	*/
+	bool MappedFile::open(const std::string& filename){
+		close();
+#ifndef _WIN32
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size <= 0){
+			::close(fd);
+			return false;
+		}
+		void* p = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		// the mapping stays valid after the descriptor is closed
+		::close(fd);
+		if (p != MAP_FAILED){
+			bytes = (const unsigned char*)p;
+			length = size_t(st.st_size);
+			return true;
+		}
+#endif
+		FILE* file = fopen(filename.c_str(), "rb");
+		if (!file) return false;
+		fseek(file, 0, SEEK_END);
+		long n = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		if (n > 0){
+			buffer.resize(size_t(n));
+			if (fread(&buffer[0], 1, buffer.size(), file) == buffer.size()){
+				bytes = &buffer[0];
+				length = buffer.size();
+			}
+			else{
+				buffer.clear();
+			}
+		}
+		fclose(file);
+		return bytes != NULL;
+	}
+
+	void MappedFile::close(){
+#ifndef _WIN32
+		if (bytes && buffer.empty()){
+			munmap((void*)bytes, length);
+		}
+#endif
+		std::vector<unsigned char>().swap(buffer);
+		bytes = NULL;
+		length = 0;
+	}
+
+	bool MappedFile::is_open() const{
+		return bytes != NULL;
+	}
+
+	const unsigned char* MappedFile::data() const{
+		return bytes;
+	}
+
+	size_t MappedFile::size() const{
+		return length;
+	}
+
+} /* _462 */
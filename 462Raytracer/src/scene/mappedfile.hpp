@@ -0,0 +1,41 @@
+/**
+* @file mappedfile.hpp
+* @brief read only memory mapped file
+*
+* Maps a whole file into memory, so cached data can be used in place
+* without copying it. Falls back to reading the file where mmap is missing.
+*/
+
+#ifndef _462_SCENE_MAPPEDFILE_HPP_
+#define _462_SCENE_MAPPEDFILE_HPP_
+
+#include <string>
+#include <vector>
+
+namespace _462 {
+
+	class MappedFile{
+	public:
+		MappedFile();
+		~MappedFile();
+
+		bool open(const std::string& filename);
+		void close();
+
+		bool is_open() const;
+		const unsigned char* data() const;
+		size_t size() const;
+	private:
+		const unsigned char* bytes;
+		size_t length;
+		// file contents when the file could not be mapped
+		std::vector<unsigned char> buffer;
+
+		// prevent copy/assignment
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+	};
+
+} /* _462 */
+
+#endif /* _462_SCENE_MAPPEDFILE_HPP_ */
@@ -22,9 +22,11 @@ Material::Material():
 Material::~Material()
 {
     
+#ifndef _462_HEADLESS
     if ( tex_handle ) {
         glDeleteTextures( 1, &tex_handle );
     }
+#endif
 }
 
 bool Material::load()
@@ -37,11 +39,13 @@ bool Material::load()
 
 bool Material::create_gl_data()
 {
+#ifndef _462_HEADLESS
     // if no texture, nothing to do
     if ( texture.filename.empty() )
         return true;
 
-    if ( !texture.data ) {
+    std::vector<unsigned char> rgba;
+    if ( !texture.get_texture_data( rgba ) ) {
         return false;
     }
 
@@ -58,7 +62,7 @@ bool Material::create_gl_data()
     }
 
     glBindTexture( GL_TEXTURE_2D, tex_handle );
-    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, texture.width, texture.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texture.data );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, texture.width, texture.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &rgba[0] );
 
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
@@ -67,11 +71,13 @@ bool Material::create_gl_data()
 
     glBindTexture( GL_TEXTURE_2D, 0 );
     std::cout << "Loaded GL texture" << texture.filename << '\n';
+#endif
     return true;
 }
 
 void Material::set_gl_state() const
 {
+#ifndef _462_HEADLESS
     float arr[4];
     arr[3] = 1.0; // alpha always 1.0
 
@@ -86,12 +92,15 @@ void Material::set_gl_state() const
     glMaterialfv( GL_FRONT_AND_BACK, GL_SPECULAR,  arr );
     // make up a shininess term
     glMaterialf( GL_FRONT_AND_BACK, GL_SHININESS, shininess );
+#endif
 }
 
 
 void Material::reset_gl_state() const
 {
+#ifndef _462_HEADLESS
     glBindTexture( GL_TEXTURE_2D, 0 );
+#endif
 }
 
 }
@@ -8,12 +8,18 @@
 
 #include "scene/mesh.hpp"
 #include "application/opengl.hpp"
+#include "scene/natfile.hpp"
+#include "scene/mappedfile.hpp"
+#include <algorithm>
 #include <iostream>
+#include <cmath>
 #include <cstring>
 #include <string>
-#include <fstream>
-#include <sstream>
-#include <map>
+#include <unordered_map>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
 
 namespace _462 {
 
@@ -23,16 +29,18 @@ struct TriIndex
     int normal;
     int tcoord;
 
-    bool operator<( const TriIndex& rhs ) const {
-        if ( vertex == rhs.vertex ) {
-            if ( normal == rhs.normal ) {
-                return tcoord < rhs.tcoord;
-            } else {
-                return normal < rhs.normal;
-            }
-        } else {
-            return vertex < rhs.vertex;
-        }
+    bool operator==( const TriIndex& rhs ) const {
+        return vertex == rhs.vertex && normal == rhs.normal && tcoord == rhs.tcoord;
+    }
+};
+
+struct TriIndexHash
+{
+    size_t operator()( const TriIndex& t ) const {
+        uint64_t h = uint64_t( uint32_t( t.vertex ) ) * 0x9E3779B97F4A7C15ull
+                   ^ uint64_t( uint32_t( t.normal ) ) * 0xC2B2AE3D27D4EB4Full
+                   ^ uint64_t( uint32_t( t.tcoord ) ) * 0x165667B19E3779F9ull;
+        return size_t( h ^ ( h >> 32 ) );
     }
 };
 
@@ -41,218 +49,369 @@ struct Face
     TriIndex v[3];
 };
 
-enum ObjFormat
+// the fields of a corner, in the order of the bits of relative indices
+static int TriIndex::* const TRI_INDEX_FIELDS[3] = { &TriIndex::vertex, &TriIndex::normal, &TriIndex::tcoord };
+
+// a field of a face corner given relative to its chunk
+struct ObjFixup
 {
-    VERTEX_ONLY = 1 << 0,
-    VERTEX_UV = 1 << 1,
-    VERTEX_NORMAL = 1 << 2,
-    VERTEX_UV_NORMAL = 1 << 3
+    size_t face;
+    unsigned char corner;
+    unsigned char field;
 };
 
-Mesh::Mesh()
+// flags of the binary cache
+enum NatMeshFlags
 {
-    has_tcoords = false;
-    has_normals = false;
-    vertex_gldata = 0;
-    index_gldata = 0;
-}
-
-Mesh::~Mesh() { }
-
+    NAT_HAS_NORMALS = 1 << 0,
+    NAT_HAS_TCOORDS = 1 << 1
+};
 
+// files are split into chunks of about this many bytes, parsed in parallel
+#define OBJ_CHUNK_SIZE ( 1 << 20 )
+#define OBJ_MAX_CHUNKS 256
 
-bool Mesh::load()
+/**
+ * Everything parsed from one chunk of an OBJ file. Face indices are 0-based
+ * and absolute, except relative (negative) indices, which are relative to
+ * the start of the chunk until the chunks are merged.
+ */
+struct ObjChunk
 {
-    std::cout << "Loading mesh from '" << filename << "'..." << std::endl;
-    if(load_nat()){
-        return true;
-    }
-
-    std::string line;
-    std::ifstream file( filename.c_str() );
-
-    typedef std::vector< Vector3 > PositionList;
-    typedef std::vector< Vector3 > NormalList;
-    typedef std::vector< Vector2 > UVList;
-    typedef std::vector< Face > FaceList;
+    std::vector< Vector3 > positions;
+    std::vector< Vector3 > normals;
+    std::vector< Vector2 > uvs;
+    std::vector< Face > faces;
+    // fields of face corners given relative to this chunk
+    std::vector< ObjFixup > fixups;
+    size_t corners_with_tcoord;
+    size_t corners_without_normal;
+    // position and description of the first syntax error, NULL if none
+    const char* error;
+    const char* error_msg;
+};
 
-    static const char* scan_vertex = "%d";
-    static const char* scan_vertex_uv = "%d/%d";
-    static const char* scan_vertex_normal = "%d//%d";
-    static const char* scan_vertex_uv_normal = "%d/%d/%d";
+static inline bool is_space( char c )
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-    TriIndex tri[4];
+static inline bool is_digit( char c )
+{
+    return c >= '0' && c <= '9';
+}
 
-    FaceList face_list;
-    PositionList position_list;
-    NormalList normal_list;
-    UVList uv_list;
+static inline const char* skip_space( const char* p, const char* end )
+{
+    while ( p < end && is_space( *p ) )
+        ++p;
+    return p;
+}
 
-    int line_num = 0;
+static inline const char* next_line( const char* p, const char* end )
+{
+    const char* q = (const char*)memchr( p, '\n', end - p );
+    return q ? q + 1 : end;
+}
 
-    std::string token;
+static bool parse_int( const char*& p, const char* end, int& out )
+{
+    const char* q = p;
+    bool neg = false;
+    if ( q < end && ( *q == '-' || *q == '+' ) )
+        neg = *q++ == '-';
+    if ( q == end || !is_digit( *q ) )
+        return false;
+    int n = 0;
+    while ( q < end && is_digit( *q ) )
+        n = n * 10 + ( *q++ - '0' );
+    out = neg ? -n : n;
+    p = q;
+    return true;
+}
 
-    triangles.clear();
+static bool parse_real( const char*& p, const char* end, real_t& out )
+{
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char* q = skip_space( p, end );
+    bool neg = false;
+    if ( q < end && ( *q == '-' || *q == '+' ) )
+        neg = *q++ == '-';
+
+    // mantissa as an integer, and the power of ten it is scaled by
+    uint64_t m = 0;
+    int digits = 0;
+    int exp = 0;
+    for ( ; q < end && is_digit( *q ); ++q, ++digits ) {
+        if ( m < 100000000000000000ull )
+            m = m * 10 + ( *q - '0' );
+        else
+            exp++;
+    }
+    if ( q < end && *q == '.' ) {
+        for ( ++q; q < end && is_digit( *q ); ++q, ++digits ) {
+            if ( m < 100000000000000000ull ) {
+                m = m * 10 + ( *q - '0' );
+                exp--;
+            }
+        }
+    }
+    if ( digits == 0 )
+        return false;
 
-    ObjFormat format = VERTEX_ONLY;
+    if ( q < end && ( *q == 'e' || *q == 'E' ) ) {
+        const char* e = q + 1;
+        int n;
+        if ( parse_int( e, end, n ) ) {
+            exp += n;
+            q = e;
+        }
+    }
 
-    typedef std::map< TriIndex, unsigned int > VertexMap;
-    VertexMap vertex_map;
+    double v = double( m );
+    if ( exp < 0 )
+        v = -exp <= 22 ? v / pow10[-exp] : v * std::pow( 10.0, exp );
+    else if ( exp > 0 )
+        v = exp <= 22 ? v * pow10[exp] : v * std::pow( 10.0, exp );
+    out = real_t( neg ? -v : v );
+    p = q;
+    return true;
+}
 
-    if ( !file.is_open() ) {
-        std::cout << "Error opening file '" << filename << "' for mesh loading.\n";
+/**
+ * Converts a 1-based OBJ index to 0-based. Negative indices count back from
+ * the last element, here the last one seen in the chunk.
+ * @return False if the index is 0, otherwise return True.
+ */
+static inline bool resolve_index( int index, size_t count, int& out, bool& relative )
+{
+    if ( index > 0 ) {
+        out = index - 1;
+        relative = false;
+    } else if ( index < 0 ) {
+        out = int( count ) + index;
+        relative = true;
+    } else {
         return false;
     }
+    return true;
+}
 
-    while ( getline( file, line ) )
-    {
-        std::stringstream stream( line );
-        stream >> token;
-        line_num++;
-
-        if ( token == "v" ) {
-
+/**
+ * Parses the lines in [begin, end), which must start at a line boundary.
+ * Stops at the first syntax error.
+ */
+static void parse_obj_chunk( const char* begin, const char* end, ObjChunk& chunk )
+{
+    std::vector< TriIndex > corners;
+    // for every corner, bit i is set if field i of the corner is relative
+    std::vector< unsigned char > relative;
+
+    chunk.corners_with_tcoord = 0;
+    chunk.corners_without_normal = 0;
+    chunk.error = NULL;
+    chunk.error_msg = NULL;
+
+    for ( const char* line = begin; line < end; line = next_line( line, end ) ) {
+        // the line ends at its comment, if it has one
+        const char* eol = next_line( line, end );
+        const char* comment = (const char*)memchr( line, '#', eol - line );
+        if ( comment )
+            eol = comment;
+        const char* p = skip_space( line, eol );
+        if ( p + 1 >= eol )
+            continue;
+
+        if ( p[0] == 'v' && is_space( p[1] ) ) {
             Vector3 position;
-            stream >> position.x >> position.y >> position.z;
-
-            if ( stream.fail() ) {
-                std::cerr << "position syntax error on line " << line_num << std::endl;
-                return false;
+            p += 1;
+            if ( !parse_real( p, eol, position.x ) || !parse_real( p, eol, position.y )
+                 || !parse_real( p, eol, position.z ) ) {
+                chunk.error = line;
+                chunk.error_msg = "position syntax error";
+                return;
             }
+            chunk.positions.push_back( position );
 
-            position_list.push_back( position );
-
-        } else if ( token == "vn" ) {
+        } else if ( p[0] == 'v' && p[1] == 'n' ) {
             Vector3 normal;
-            stream >> normal.x >> normal.y >> normal.z;
-
-            if( stream.fail() ) {
-                std::cerr << "normal syntax error on line " << line_num << std::endl;
-                return false;
+            p += 2;
+            if ( !parse_real( p, eol, normal.x ) || !parse_real( p, eol, normal.y )
+                 || !parse_real( p, eol, normal.z ) ) {
+                chunk.error = line;
+                chunk.error_msg = "normal syntax error";
+                return;
             }
-            normal_list.push_back( normal );
-
-        } else if ( token == "vt" ) {
+            chunk.normals.push_back( normal );
 
+        } else if ( p[0] == 'v' && p[1] == 't' ) {
             Vector2 uv;
-            stream >> uv.x >> uv.y;
-
-            if ( stream.fail() ) {
-                std::cerr << "uv syntax error on line " << line_num << std::endl;
-                return false;
+            p += 2;
+            if ( !parse_real( p, eol, uv.x ) || !parse_real( p, eol, uv.y ) ) {
+                chunk.error = line;
+                chunk.error_msg = "uv syntax error";
+                return;
+            }
+            chunk.uvs.push_back( uv );
+
+        } else if ( p[0] == 'f' && is_space( p[1] ) ) {
+            corners.clear();
+            relative.clear();
+            p = skip_space( p + 1, eol );
+
+            // corners are v, v/t, v//n or v/t/n
+            while ( p < eol && *p != '\n' ) {
+                TriIndex c = { 0, -1, -1 };
+                unsigned char rel = 0;
+                bool r = false;
+                int index;
+                bool ok = parse_int( p, eol, index )
+                          && resolve_index( index, chunk.positions.size(), c.vertex, r );
+                rel |= r ? 1 : 0;
+                if ( ok && p < eol && *p == '/' ) {
+                    ++p;
+                    if ( p < eol && *p != '/' ) {
+                        ok = parse_int( p, eol, index )
+                             && resolve_index( index, chunk.uvs.size(), c.tcoord, r );
+                        rel |= r ? 4 : 0;
+                    }
+                    if ( ok && p < eol && *p == '/' ) {
+                        ++p;
+                        ok = parse_int( p, eol, index )
+                             && resolve_index( index, chunk.normals.size(), c.normal, r );
+                        rel |= r ? 2 : 0;
+                    }
+                }
+                if ( !ok || ( p < eol && !is_space( *p ) && *p != '\n' ) ) {
+                    chunk.error = line;
+                    chunk.error_msg = "face syntax error";
+                    return;
+                }
+                corners.push_back( c );
+                relative.push_back( rel );
+                p = skip_space( p, eol );
             }
 
-            uv_list.push_back( uv );
-
-        } else if ( token == "f" ) {
-
-            std::vector< std::string > face_tokens;
-            std::string vert;
+            if ( corners.size() < 3 ) {
+                chunk.error = line;
+                chunk.error_msg = "face has too few vertices";
+                return;
+            }
 
-            while ( true ) {
-                stream >> vert;
-                if( stream.fail() )
-                    break;
-                face_tokens.push_back( vert );
+            for ( size_t i = 0; i < corners.size(); ++i ) {
+                chunk.corners_with_tcoord += corners[i].tcoord >= 0 || ( relative[i] & 4 );
+                chunk.corners_without_normal += corners[i].normal < 0 && !( relative[i] & 2 );
             }
 
-            // if it's the first time parsing a face, figure out the face format
-            if ( face_list.size() == 0 ) {
-                std::string token = face_tokens[0];
-
-                if ( token.find( "//" ) != std::string::npos ) {
-                    format = VERTEX_NORMAL;
-                    has_normals = true;
-                } else if ( token.find( '/' ) == std::string::npos ) {
-                    format = VERTEX_ONLY;
-                } else {
-                    size_t p1 = token.find( '/' );
-                    size_t p2 = token.rfind( '/' );
-                    if ( p1 == p2 ) {
-                        format = VERTEX_UV;
-                        has_tcoords = true;
-                    } else {
-                        format = VERTEX_UV_NORMAL;
-                        has_normals = true;
-                        has_tcoords = true;
+            // triangulate the polygon as a fan around its first corner
+            for ( size_t i = 1; i + 1 < corners.size(); ++i ) {
+                size_t k[3] = { 0, i, i + 1 };
+                Face f;
+                for ( size_t j = 0; j < 3; ++j ) {
+                    f.v[j] = corners[k[j]];
+                    for ( size_t field = 0; field < 3; ++field ) {
+                        if ( relative[k[j]] & ( 1 << field ) ) {
+                            ObjFixup fixup = { chunk.faces.size(), (unsigned char)j, (unsigned char)field };
+                            chunk.fixups.push_back( fixup );
+                        }
                     }
                 }
+                chunk.faces.push_back( f );
             }
+        }
+    }
+}
 
-            size_t num_vertex;
-            num_vertex = face_tokens.size();
+Mesh::Mesh()
+{
+    has_tcoords = false;
+    has_normals = false;
+    vertex_gldata = 0;
+    index_gldata = 0;
+    triangle_view = NULL;
+    triangle_count = 0;
+    vertex_view = NULL;
+    vertex_count = 0;
+}
 
-            if ( num_vertex > 4 || num_vertex < 3 ) {
-                std::cerr << "Syntax error at line " << line_num
-                          << ", face has incorrect number of vertices" << std::endl;
-                return false;
-            }
+Mesh::~Mesh() { }
 
-            for ( size_t i = 0; i < num_vertex; ++i ) {
-                switch ( format )
-                {
-                case VERTEX_ONLY:
-                    sscanf( face_tokens[i].c_str(),
-                            scan_vertex,
-                            &tri[i].vertex );
-                    tri[i].normal = 0;
-                    tri[i].tcoord = 0;
-                    break;
-
-                case VERTEX_UV:
-                    sscanf( face_tokens[i].c_str(),
-                            scan_vertex_uv,
-                            &tri[i].vertex,
-                            &tri[i].tcoord );
-                    tri[i].normal = 0;
-                    break;
-
-                case VERTEX_NORMAL:
-                    sscanf( face_tokens[i].c_str(),
-                            scan_vertex_normal,
-                            &tri[i].vertex,
-                            &tri[i].normal );
-                    tri[i].tcoord = 0;
-                    break;
-
-                case VERTEX_UV_NORMAL:
-                    sscanf( face_tokens[i].c_str(),
-                            scan_vertex_uv_normal,
-                            &tri[i].vertex,
-                            &tri[i].tcoord,
-                            &tri[i].normal );
-                    break;
-
-                default:
-                    std::cerr << "Syntax error, unrecongnized face format at line "
-                              << line_num << std::endl;
-                    break;
-                }
-            }
 
-            for ( size_t i = 0; i < num_vertex; ++i ) {
-                tri[i].vertex--;
-                tri[i].normal--;
-                tri[i].tcoord--;
-            }
 
-            Face f1 = { { tri[0], tri[1], tri[2] } };
-            face_list.push_back( f1 );
+bool Mesh::load()
+{
+    std::cout << "Loading mesh from '" << filename << "'..." << std::endl;
+    if(load_nat()){
+        return true;
+    }
 
-            if ( num_vertex == 4 ) {
-                Face f2 = { { tri[2], tri[3], tri[0] } };
-                face_list.push_back( f2 );
-            }
+    MappedFile file;
+    if ( !file.open( filename ) ) {
+        std::cout << "Error opening file '" << filename << "' for mesh loading.\n";
+        return false;
+    }
 
-        } else if ( token == " " ) {
+    const char* data = (const char*)file.data();
+    const char* end = data + file.size();
 
-        } else {
-            //std::cerr << "Unknown token on line " << line_num << std::endl;
+    // split the file into chunks at line boundaries
+    size_t num_chunks = std::min( std::max( file.size() / OBJ_CHUNK_SIZE, size_t( 1 ) ), size_t( OBJ_MAX_CHUNKS ) );
+    std::vector< const char* > bounds( num_chunks + 1 );
+    bounds[0] = data;
+    for ( size_t i = 1; i < num_chunks; ++i ) {
+        const char* p = std::max( data + i * ( file.size() / num_chunks ), bounds[i - 1] );
+        bounds[i] = p == data ? p : next_line( p - 1, end );
+    }
+    bounds[num_chunks] = end;
+
+    std::vector< ObjChunk > chunks( num_chunks );
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for ( int i = 0; i < int( num_chunks ); ++i ) {
+        parse_obj_chunk( bounds[i], bounds[i + 1], chunks[i] );
+    }
+
+    // merge the chunks, turning relative indices into absolute ones
+    std::vector< Vector3 > position_list;
+    std::vector< Vector3 > normal_list;
+    std::vector< Vector2 > uv_list;
+    std::vector< Face > face_list;
+    size_t corners_with_tcoord = 0;
+    size_t corners_without_normal = 0;
+
+    for ( size_t i = 0; i < num_chunks; ++i ) {
+        ObjChunk& chunk = chunks[i];
+        if ( chunk.error ) {
+            size_t line_num = std::count( data, chunk.error, '\n' ) + 1;
+            std::cerr << chunk.error_msg << " on line " << line_num << std::endl;
+            return false;
+        }
+
+        int offsets[3] = { int( position_list.size() ), int( normal_list.size() ), int( uv_list.size() ) };
+        for ( size_t j = 0; j < chunk.fixups.size(); ++j ) {
+            const ObjFixup& fixup = chunk.fixups[j];
+            chunk.faces[fixup.face].v[fixup.corner].*TRI_INDEX_FIELDS[fixup.field] += offsets[fixup.field];
         }
 
-        token.clear();
-        line.clear();
+        position_list.insert( position_list.end(), chunk.positions.begin(), chunk.positions.end() );
+        normal_list.insert( normal_list.end(), chunk.normals.begin(), chunk.normals.end() );
+        uv_list.insert( uv_list.end(), chunk.uvs.begin(), chunk.uvs.end() );
+        face_list.insert( face_list.end(), chunk.faces.begin(), chunk.faces.end() );
+        corners_with_tcoord += chunk.corners_with_tcoord;
+        corners_without_normal += chunk.corners_without_normal;
+        std::vector< ObjFixup >().swap( chunk.fixups );
+        std::vector< Face >().swap( chunk.faces );
     }
+    file.close();
+
+    // normals are only used if every corner has one, otherwise they are computed
+    has_tcoords = corners_with_tcoord > 0;
+    has_normals = !face_list.empty() && corners_without_normal == 0;
 
     // verify index list sanity
 
@@ -271,34 +430,39 @@ bool Mesh::load()
                  || nidx < -1 || nidx >= num_normal
                  || tidx < -1 || tidx >= num_tcoord ) {
                 std::cout << "Invalid index in face " << i << ".\n";
+                return false;
             }
         }
     }
 
-    // build vertex list using map for shared vertices
+    // build vertex list using a hash map for shared vertices
 
-    triangles.reserve( face_list.size() );
-    vertices.reserve( face_list.size() * 2 );
+    typedef std::unordered_map< TriIndex, unsigned int, TriIndexHash > VertexMap;
+    VertexMap vertex_map;
+    vertex_map.reserve( face_list.size() );
 
-    // current vertex index, for creating new vertices
-    unsigned int vert_idx_counter = 0;
+    triangles.clear();
+    vertices.clear();
+    triangles.reserve( face_list.size() );
+    vertices.reserve( face_list.size() / 2 + 3 );
 
     for ( size_t i = 0; i < face_list.size(); ++i ) {
         const Face& face = face_list[i];
         MeshTriangle tri;
         for ( size_t j = 0; j < 3; ++j ) {
+            TriIndex key = face.v[j];
+            // drop normals that are not used, so they do not split vertices
+            if ( !has_normals )
+                key.normal = -1;
             // two vertices are only actually the same one if the vertex,
             // normal, and tcoord are all the same. use the map to check this.
-            std::pair< VertexMap::iterator, bool > rv = vertex_map.insert( std::make_pair( face.v[j], vert_idx_counter ) );
+            std::pair< VertexMap::iterator, bool > rv = vertex_map.insert( std::make_pair( key, (unsigned int)vertices.size() ) );
             if ( rv.second ) {
                 MeshVertex v;
-                v.position = position_list[face.v[j].vertex];
-                int nidx = face.v[j].normal;
-                v.normal = nidx == -1 ? Vector3::Zero() : normal_list[nidx];
-                int tidx = face.v[j].tcoord;
-                v.tex_coord = tidx == -1 ? Vector2::Zero() : uv_list[tidx];
+                v.position = position_list[key.vertex];
+                v.normal = key.normal == -1 ? Vector3::Zero() : normal_list[key.normal];
+                v.tex_coord = key.tcoord == -1 ? Vector2::Zero() : uv_list[key.tcoord];
                 vertices.push_back( v );
-                vert_idx_counter++;
             }
 
             tri.vertices[j] = rv.first->second;
@@ -307,6 +471,7 @@ bool Mesh::load()
     }
 
     initialize();
+    use_lists();
 
     std::cout << "Successfully loaded mesh '" << filename << "'.\n";
     
@@ -314,58 +479,97 @@ bool Mesh::load()
     return true;
 }
 
-void Mesh::save_nat(){
-    std::ofstream myfile;
-    myfile.open ("/tmp/"+filename+".nat");
-    if ( !myfile.is_open() ) {
-        std::cout << "Warning: cannot save '" << filename << ".nat'.\n";
+void Mesh::use_lists()
+{
+    nat.close();
+    triangle_view = triangles.empty() ? NULL : &triangles[0];
+    triangle_count = triangles.size();
+    vertex_view = vertices.empty() ? NULL : &vertices[0];
+    vertex_count = vertices.size();
+}
+
+std::string Mesh::nat_filename() const
+{
+    return nat_cache_filename( filename, ".nat" );
+}
+
+void Mesh::save_nat() const
+{
+    NatKey key;
+    std::string nat_file = nat_filename();
+    if ( nat_file.empty() || !nat_source_key( filename, key ) ) {
+        return;
     }
-    size_t vertex_count=vertices.size();
-    size_t triangle_count=triangles.size();
-    myfile.write((char*)&vertex_count,sizeof(size_t));
-    myfile.write((char*)&triangle_count,sizeof(size_t));
-    myfile.write((char*)&(vertices[0]),sizeof(vertices[0])*vertex_count);
-    myfile.write((char*)&(triangles[0]),sizeof(triangles[0])*triangle_count);
-    myfile.flush();
-    myfile.close();
+
+    NatWriter writer;
+    writer.add_section( NAT_MESH_VERTICES, sizeof( MeshVertex ), vertex_view, vertex_count );
+    writer.add_section( NAT_MESH_TRIANGLES, sizeof( MeshTriangle ), triangle_view, triangle_count );
+    uint64_t flags = ( has_normals ? NAT_HAS_NORMALS : 0 ) | ( has_tcoords ? NAT_HAS_TCOORDS : 0 );
+    writer.write_background( nat_file, key, flags );
 }
-bool Mesh::load_nat(){
-    std::ifstream myfile(filename+".nat");
-    if ( !myfile.is_open() ) {
-        std::cout << "Warning: cannot load '" << filename << ".nat' - regenerating.\n";
+
+bool Mesh::load_nat()
+{
+    NatKey key;
+    std::string nat_file = nat_filename();
+    if ( nat_file.empty() ) {
+        return false;
+    }
+    if ( !nat_source_key( filename, key ) || !nat.open( nat_file, key ) ) {
+        std::cout << "Warning: cannot load '" << nat_file << "' - regenerating.\n";
+        return false;
+    }
+
+    // use the mapped arrays in place
+    uint64_t num_vertices, num_triangles;
+    const void* v = nat.section( NAT_MESH_VERTICES, sizeof( MeshVertex ), num_vertices );
+    const void* t = nat.section( NAT_MESH_TRIANGLES, sizeof( MeshTriangle ), num_triangles );
+    if ( !v || !t ) {
+        nat.close();
         return false;
     }
-    size_t vertex_count;
-    size_t triangle_count;
-    myfile.read((char*)&vertex_count,sizeof(size_t));
-    myfile.read((char*)&triangle_count,sizeof(size_t));
-    vertices.resize(vertex_count);
-    triangles.resize(triangle_count);
-    myfile.read((char*)&(vertices[0]),sizeof(vertices[0])*vertex_count);
-    myfile.read((char*)&(triangles[0]),sizeof(triangles[0])*triangle_count);
-    myfile.close();
-    std::cout << "Successfully loaded mesh '" << filename << ".nat'.\n";
+
+    // reject indices out of range, the rest of the code trusts them
+    const MeshTriangle* tris = (const MeshTriangle*)t;
+    for ( size_t i = 0; i < num_triangles; ++i ) {
+        for ( size_t j = 0; j < 3; ++j ) {
+            if ( tris[i].vertices[j] >= num_vertices ) {
+                nat.close();
+                return false;
+            }
+        }
+    }
+
+    triangles.clear();
+    vertices.clear();
+    vertex_view = (const MeshVertex*)v;
+    vertex_count = size_t( num_vertices );
+    triangle_view = tris;
+    triangle_count = size_t( num_triangles );
+    has_normals = ( nat.get_flags() & NAT_HAS_NORMALS ) != 0;
+    has_tcoords = ( nat.get_flags() & NAT_HAS_TCOORDS ) != 0;
+    std::cout << "Successfully loaded mesh '" << filename << "' from its cache.\n";
     return true;
 }
 
 const MeshTriangle* Mesh::get_triangles() const
 {
-    return triangles.empty() ? NULL : &triangles[0];
+    return triangle_view;
 }
 
 size_t Mesh::num_triangles() const
 {
-    return triangles.size();
+    return triangle_count;
 }
 
 const MeshVertex* Mesh::get_vertices() const
 {
-    return vertices.empty() ? NULL : &vertices[0];
+    return vertex_view;
 }
 
 size_t Mesh::num_vertices() const
 {
-    return vertices.size();
+    return vertex_count;
 }
 
 bool Mesh::are_normals_valid() const
@@ -413,31 +617,32 @@ void Mesh::computeNormals(){
 bool Mesh::create_gl_data()
 {
     // if no vertices, nothing to do
-    if ( vertices.empty() || triangles.empty() ) {
+    if ( vertex_count == 0 || triangle_count == 0 ) {
         return false;
     }
 
     //computeNormals();
 
     // build vertex data
-    vertex_data.resize( vertices.size() * VERTEX_SIZE );
+    vertex_data.resize( vertex_count * VERTEX_SIZE );
     float* vertex = &vertex_data[0];
-    for ( size_t i = 0; i < vertices.size(); ++i ) {
-        vertices[i].tex_coord.to_array( vertex + 0 );
-        vertices[i].normal.to_array( vertex + 2 );
-        vertices[i].position.to_array( vertex + 5 );
+    for ( size_t i = 0; i < vertex_count; ++i ) {
+        vertex_view[i].tex_coord.to_array( vertex + 0 );
+        vertex_view[i].normal.to_array( vertex + 2 );
+        vertex_view[i].position.to_array( vertex + 5 );
         vertex += VERTEX_SIZE;
     }
     // build index data
-    index_data.resize( triangles.size() * 3 );
+    index_data.resize( triangle_count * 3 );
     unsigned int* index = &index_data[0];
 
-    for ( size_t i = 0; i < triangles.size(); ++i ) {
-        index[0] = triangles[i].vertices[0];
-        index[1] = triangles[i].vertices[1];
-        index[2] = triangles[i].vertices[2];
+    for ( size_t i = 0; i < triangle_count; ++i ) {
+        index[0] = triangle_view[i].vertices[0];
+        index[1] = triangle_view[i].vertices[1];
+        index[2] = triangle_view[i].vertices[2];
         index += 3;
     }
+#ifndef _462_HEADLESS
     size_t vertex_gldata_byte_count=sizeof (vertex_data[0]) * vertex_data.size();
     glGenBuffers(1, &vertex_gldata);
     glBindBuffer(GL_ARRAY_BUFFER, vertex_gldata);
@@ -451,12 +656,14 @@ bool Mesh::create_gl_data()
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
 
     return true;
 }
 
 void Mesh::render() const
 {
+#ifndef _462_HEADLESS
     glEnable(GL_CULL_FACE);
     glCullFace(GL_BACK);
     glBindBuffer(GL_ARRAY_BUFFER, vertex_gldata);
@@ -466,6 +673,7 @@ void Mesh::render() const
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     glDisable(GL_CULL_FACE);
+#endif
 }
 
 bool Mesh::initialize()
@@ -11,6 +11,7 @@
 
 #include "math/vector.hpp"
 #include "application/opengl.hpp"
+#include "scene/natfile.hpp"
 
 #include <vector>
 #include <cassert>
@@ -45,8 +46,13 @@ public:
      * @return True on success.
      */
     bool load();
+    /// Maps the binary cache of the mesh, if it is up to date with the OBJ file.
     bool load_nat();
-    void save_nat();
+    /// Writes the binary cache of the mesh to the cache directory.
+    void save_nat() const;
+    /// The filename of the binary cache in the cache directory, empty if
+    /// there is none.
+    std::string nat_filename() const;
 
     /// Get a pointer to the triangles.
     const MeshTriangle* get_triangles() const;
@@ -73,10 +79,10 @@ public:
     typedef std::vector< MeshTriangle > MeshTriangleList;
     typedef std::vector< MeshVertex > MeshVertexList;
 
-    // The list of all triangles in this model.
+    // The list of all triangles in this model, empty if loaded from the cache.
     MeshTriangleList triangles;
 
-    // The list of all vertices in this model.
+    // The list of all vertices in this model, empty if loaded from the cache.
     MeshVertexList vertices;
 
     bool has_tcoords;
@@ -97,6 +103,16 @@ private:
     GLuint vertex_gldata;
     GLuint index_gldata;
 
+    // the mapped binary cache, the views point into it when it is used
+    NatReader nat;
+    // the triangles and vertices in use, in the lists or in the cache
+    const MeshTriangle* triangle_view;
+    size_t triangle_count;
+    const MeshVertex* vertex_view;
+    size_t vertex_count;
+
+    void use_lists();
+
     // prevent copy/assignment
     Mesh( const Mesh& );
     Mesh& operator=( const Mesh& );
@@ -11,7 +11,10 @@
 #include "application/opengl.hpp"
 #include "scene/triangle.hpp"
 #include "scene/bvhnode.hpp"
+#include "scene/natfile.hpp"
+#include <chrono>
 #include <iostream>
+#include <cstdio>
 #include <cstring>
 #include <string>
 #include <fstream>
@@ -20,8 +23,22 @@
 
 namespace _462 {
 
-Model::Model() : mesh( 0 ), material( 0 ), bvh_root(NULL) { }
-Model::~Model() { }
+// bump whenever the tree built by BvhNode changes for the same input
+#define BVH_BUILD_VERSION 3
+
+Model::Model() : mesh( 0 ), material( 0 ), bvh_root(NULL), built_mesh( 0 ), built_material( 0 ) { }
+Model::~Model()
+{
+    clear();
+}
+
+// free the triangles and the tree over them
+void Model::clear()
+{
+    bvh_root = NULL;
+    triangle_list.clear();
+    arena.clear();
+}
 
 void Model::render() const
 {
@@ -37,17 +54,19 @@ void Model::render() const
 
 bool Model::initialize(){
 	Geometry::initialize();
+	clear();
+	built_mesh = mesh;
+	built_material = material;
 
 	//copy mesh triangles to a geometry triangles
 	size_t tri_num = mesh->num_triangles();
-	std::vector<Geometry* > triangle_list;
 	triangle_list.reserve(tri_num);
 
 	const MeshTriangle* triangles = mesh->get_triangles();
 	const MeshVertex* vertices = mesh->get_vertices();
 
 	for (size_t i = 0; i < tri_num; i++){
-		Triangle* tri = new Triangle();
+		Triangle* tri = arena.create<Triangle>();
 		for (size_t j = 0; j < 3; j++){
 			tri->vertices[j].position = vertices[triangles[i].vertices[j]].position;
 			tri->vertices[j].normal = vertices[triangles[i].vertices[j]].normal;
@@ -59,22 +78,151 @@ bool Model::initialize(){
 		tri->invMat = invMat;
 		tri->normMat = normMat;
 		tri->gen_bound_box();
+		tri->owner = this;
 		triangle_list.push_back(tri);
 	}
 
-	//set internal bvh tree
-	bvh_root = new BvhNode(triangle_list,0 , 0, tri_num - 1);
+	//set internal bvh tree, from the cache if it was built from the same mesh.
+	//the cached tree is built in object space, so it fits every transformation
+	//of the mesh once its boxes are refit. on a miss the tree is built here,
+	//not in the background: no ray can be traced without it, and a cached
+	//tree of another mesh does not fit these triangles. only the write of
+	//the new tree is left to the background
+	NatKey key = bvh_key();
+	std::string cache_file = bvh_filename();
+	if (!cache_file.empty()){
+		bvh_root = load_bvh(cache_file, key, triangle_list);
+	}
+	if (bvh_root == NULL){
+		set_triangle_transforms(Matrix4::Identity(), Matrix4::Identity(), Matrix3::Identity());
+		bvh_root = BvhNode::build(triangle_list, arena);
+		if (!cache_file.empty()){
+			save_bvh(cache_file, key, triangle_list);
+		}
+		set_triangle_transforms(mat, invMat, normMat);
+		bvh_root->refit();
+	}
 	box = bvh_root->box;
     return true;
 }
 
-bool Model::intersect_test(const Ray& r, real_t& t, Intersection& info){
-	return bvh_root->intersect_test(r,t,info);
+/**
+* Move the triangles to the new transformation and refit the tree over them
+* instead of building it again. The refit tree is not written to the cache.
+*/
+bool Model::update_transform(){
+	if (content_changed()) return initialize();
+	Geometry::initialize();
+	set_triangle_transforms(mat, invMat, normMat);
+	bvh_root->refit();
+	box = bvh_root->box;
+	return true;
+}
+
+/**
+* Build the tree of the model again, without keeping it, to time the
+* builder. The model has to be initialized.
+* @param bins Bins the surface area heuristic is evaluated at.
+* @param runs Number of builds.
+* @param cost Output SAH cost of the tree, see BvhNode::sah_cost.
+* @return the time of the fastest build in milliseconds.
+*/
+double Model::time_bvh_build(int bins, int runs, real_t* cost) const{
+	double best = 0;
+	for (int run = 0; run < runs; run++){
+		Arena scratch;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		BvhNode* root = BvhNode::build(triangle_list, scratch, bins);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (run == 0 || elapsed.count() < best) best = elapsed.count();
+		*cost = root->sah_cost();
+	}
+	return best;
+}
+
+// gives every triangle the transformation and its box there
+void Model::set_triangle_transforms(const Matrix4& m, const Matrix4& inv, const Matrix3& norm){
+#ifdef OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < (int)triangle_list.size(); i++){
+		Triangle* tri = static_cast<Triangle*>(triangle_list[i]);
+		tri->mat = m;
+		tri->invMat = inv;
+		tri->normMat = norm;
+		tri->gen_bound_box();
+	}
+}
+
+/**
+* The triangles have to be copied again if the model was given another mesh
+* or material.
+*/
+bool Model::content_changed() const{
+	return mesh != built_mesh || material != built_material;
+}
+
+/**
+* Key of the bvh tree, a hash of everything the build depends on: the mesh
+* data and the build version. The transformation is applied by refitting.
+*/
+NatKey Model::bvh_key() const{
+	uint64_t h = nat_checksum((const unsigned char*)mesh->get_vertices(), mesh->num_vertices() * sizeof(MeshVertex), BVH_BUILD_VERSION);
+	h = nat_checksum((const unsigned char*)mesh->get_triangles(), mesh->num_triangles() * sizeof(MeshTriangle), h);
+	NatKey key = { mesh->num_triangles(), 0, h };
+	return key;
+}
+
+/**
+* The cache file of the bvh tree in the cache directory, one per mesh file,
+* replaced when the mesh changes. Empty if there is no cache directory.
+*/
+std::string Model::bvh_filename() const{
+	return nat_cache_filename(mesh->filename, ".bvh");
+}
+
+/**
+* Map the cached bvh tree and rebuild it over the given triangles.
+* @return the root, or NULL if there is no valid cache.
+*/
+BvhNode* Model::load_bvh(const std::string& filename, const NatKey& key, const std::vector<Geometry* >& prims){
+	NatReader reader;
+	if (!reader.open(filename, key)) return NULL;
+	uint64_t count;
+	const BvhFlatNode* nodes = (const BvhFlatNode*)reader.section(NAT_BVH_NODES, sizeof(BvhFlatNode), count);
+	if (nodes == NULL) return NULL;
+	return BvhNode::unflatten(nodes, size_t(count), prims, arena);
+}
+
+/**
+* Write the bvh tree to the cache in the background.
+*/
+void Model::save_bvh(const std::string& filename, const NatKey& key, const std::vector<Geometry* >& prims) const{
+	std::unordered_map<const Geometry*, int32_t> prim_index;
+	prim_index.reserve(prims.size());
+	for (size_t i = 0; i < prims.size(); i++){
+		prim_index[prims[i]] = int32_t(i);
+	}
+	std::vector<BvhFlatNode> nodes;
+	nodes.reserve(prims.size());
+	bvh_root->flatten(prim_index, nodes);
+
+	NatWriter writer;
+	writer.add_section(NAT_BVH_NODES, sizeof(BvhFlatNode), &nodes[0], nodes.size());
+	writer.write_background(filename, key, 0);
+}
+
+bool Model::intersect_test(const Ray& r, HitRecord& rec){
+	return bvh_root->intersect_test(r, rec);
 }
 
 bool Model::shadow_test(const Ray& r,real_t dis){
 	return bvh_root->shadow_test(r,dis);
 }
 
+Geometry* Model::shadow_occluder(const Ray& r, real_t dis){
+	return bvh_root->shadow_occluder(r, dis);
+}
+
 
 } /* _462 */
@@ -11,6 +11,8 @@
 #include "scene/scene.hpp"
 #include "scene/mesh.hpp"
 #include "scene/meshtree.hpp"
+#include "scene/natfile.hpp"
+#include "scene/arena.hpp"
 
 namespace _462 {
 
@@ -30,10 +32,30 @@ public:
 
     virtual void render() const;
     virtual bool initialize();
-	virtual bool intersect_test(const Ray& r, real_t& t, Intersection& rec);
+	virtual bool update_transform();
+	virtual bool content_changed() const;
+	virtual bool intersect_test(const Ray& r, HitRecord& rec);
 	virtual bool shadow_test(const Ray &r, real_t dis);
+	virtual Geometry* shadow_occluder(const Ray &r, real_t dis);
+
+	double time_bvh_build(int bins, int runs, real_t* cost) const;
 private:
 	BvhNode* bvh_root;
+	// world space copies of the mesh triangles, in the arena
+	std::vector<Geometry* > triangle_list;
+	// holds the triangles and the nodes of the tree
+	Arena arena;
+	// the mesh and material the triangles were copied from
+	const Mesh* built_mesh;
+	const Material* built_material;
+
+	void clear();
+	void set_triangle_transforms(const Matrix4& m, const Matrix4& inv, const Matrix3& norm);
+
+	NatKey bvh_key() const;
+	std::string bvh_filename() const;
+	BvhNode* load_bvh(const std::string& filename, const NatKey& key, const std::vector<Geometry* >& prims);
+	void save_bvh(const std::string& filename, const NatKey& key, const std::vector<Geometry* >& prims) const;
 };
 
 
@@ -0,0 +1,438 @@
+/**
+* @file natfile.cpp
+* @brief binary cache file of typed arrays
+*/
+
+#include "scene/natfile.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <process.h>
+#endif
+
+namespace _462{
+
+	// written in native order, reads back differently on a machine of the other order
+	static const uint32_t NAT_BYTE_ORDER = 0x01020304;
+	static const size_t NAT_ALIGN = 64;
+
+	struct NatHeader{
+		char magic[4];
+		uint32_t version;
+		uint32_t byte_order;
+		uint32_t num_sections;
+		NatKey key;
+		uint64_t flags;
+		// checksum of the header, with this field 0, and the section table
+		uint64_t checksum;
+		uint64_t reserved;
+	};
+
+	struct NatSectionEntry{
+		uint32_t type;
+		// bytes per element, catches layout changes of the stored structs
+		uint32_t stride;
+		uint64_t offset;
+		uint64_t count;
+		// checksum of the data of the section
+		uint64_t checksum;
+		uint64_t reserved;
+	};
+
+	static uint64_t header_checksum(const NatHeader& header, const NatSectionEntry* entries){
+		NatHeader copy = header;
+		copy.checksum = 0;
+		uint64_t h = nat_checksum((const unsigned char*)&copy, sizeof(copy));
+		return nat_checksum((const unsigned char*)entries, header.num_sections * sizeof(NatSectionEntry), h);
+	}
+
+	static size_t align_up(size_t n){
+		return (n + NAT_ALIGN - 1) & ~(NAT_ALIGN - 1);
+	}
+
+	/**
+	* Build the key of a source file from its size and modification time.
+	* @param filename The source file.
+	* @param key Output key, extra is set to 0.
+	* @return False if the file does not exist, otherwise return True.
+	*/
+	bool nat_source_key(const std::string& filename, NatKey& key){
+		struct stat st;
+		if (stat(filename.c_str(), &st) != 0) return false;
+		key.size = uint64_t(st.st_size);
+		key.mtime = int64_t(st.st_mtime);
+		key.extra = 0;
+		return true;
+	}
+
+	// creates a directory and the missing directories above it
+	static bool make_dirs(const std::string& path){
+		for (size_t i = 1; i <= path.size(); ++i){
+			if (i < path.size() && path[i] != '/' && path[i] != '\\') continue;
+			std::string dir = path.substr(0, i);
+			struct stat st;
+			if (stat(dir.c_str(), &st) == 0) continue;
+#ifndef _WIN32
+			if (mkdir(dir.c_str(), 0755) != 0) return false;
+#else
+			if (_mkdir(dir.c_str()) != 0) return false;
+#endif
+		}
+		return true;
+	}
+
+	/**
+	* The directory of all cache files, created if needed: $P3_CACHE_DIR, or
+	* 462raytracer in the user cache directory.
+	* @return the directory with a trailing separator, empty if there is
+	*  none to use.
+	*/
+	std::string nat_cache_dir(){
+		static std::string dir;
+		static std::once_flag once;
+		std::call_once(once, [](){
+			std::string path;
+			const char* env = getenv("P3_CACHE_DIR");
+#ifndef _WIN32
+			const char* xdg = getenv("XDG_CACHE_HOME");
+			const char* home = getenv("HOME");
+			if (env && *env) path = env;
+			else if (xdg && *xdg) path = std::string(xdg) + "/462raytracer";
+			else if (home && *home) path = std::string(home) + "/.cache/462raytracer";
+#else
+			const char* local = getenv("LOCALAPPDATA");
+			if (env && *env) path = env;
+			else if (local && *local) path = std::string(local) + "\\462raytracer";
+#endif
+			if (!path.empty() && make_dirs(path)){
+				dir = path + "/";
+			}
+		});
+		return dir;
+	}
+
+	/**
+	* The cache file of a source file: its path, flattened to one name, in
+	* the cache directory. Stale files are replaced when the source changes.
+	* @param filename The source file.
+	* @param suffix Appended to the name, tells caches of one source apart.
+	* @return the cache file, empty if there is no cache directory.
+	*/
+	std::string nat_cache_filename(const std::string& filename, const char* suffix){
+		std::string dir = nat_cache_dir();
+		if (dir.empty()) return dir;
+		std::string name = filename;
+		for (size_t i = 0; i < name.size(); i++){
+			if (name[i] == '/' || name[i] == '\\' || name[i] == ':') name[i] = '_';
+		}
+		return dir + name + suffix;
+	}
+
+	/**
+	* Hash of a block of bytes, 8 bytes at a time.
+	* @param data The bytes to hash.
+	* @param size Number of bytes.
+	* @param seed Starting value, to chain several blocks.
+	* @return the 64-bit hash.
+	*/
+	uint64_t nat_checksum(const unsigned char* data, size_t size, uint64_t seed){
+		const uint64_t mul = 0x9E3779B97F4A7C15ull;
+		uint64_t h = seed ^ 0xCBF29CE484222325ull;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8){
+			uint64_t w;
+			memcpy(&w, data + i, 8);
+			h = (h ^ w) * mul;
+			h ^= h >> 32;
+		}
+		for (; i < size; ++i){
+			h = (h ^ data[i]) * mul;
+		}
+		return h ^ (h >> 29);
+	}
+
+	/**
+	* Add an array to the file. The data must stay valid until write.
+	* @param type Type of the section, one per file.
+	* @param stride Bytes per element.
+	* @param data The elements.
+	* @param count Number of elements.
+	*/
+	void NatWriter::add_section(uint32_t type, uint32_t stride, const void* data, uint64_t count){
+		Pending p = { type, stride, data, count };
+		sections.push_back(p);
+	}
+
+	/**
+	* Lay out the whole file in memory.
+	* @param key Key of the source the data was built from.
+	* @param flags Free bits for the owner of the file.
+	* @param bytes Output contents of the file.
+	*/
+	void NatWriter::serialize(const NatKey& key, uint64_t flags, std::vector<unsigned char>& bytes) const{
+		size_t table = sections.size() * sizeof(NatSectionEntry);
+		size_t size = align_up(sizeof(NatHeader) + table);
+		std::vector<NatSectionEntry> entries(sections.size());
+		memset(entries.data(), 0, table);
+		for (size_t i = 0; i < sections.size(); ++i){
+			size_t n = size_t(sections[i].stride * sections[i].count);
+			entries[i].type = sections[i].type;
+			entries[i].stride = sections[i].stride;
+			entries[i].offset = size;
+			entries[i].count = sections[i].count;
+			entries[i].checksum = nat_checksum((const unsigned char*)sections[i].data, n);
+			size = align_up(size + n);
+		}
+
+		bytes.assign(size, 0);
+		if (table) memcpy(&bytes[sizeof(NatHeader)], &entries[0], table);
+		for (size_t i = 0; i < sections.size(); ++i){
+			size_t n = size_t(sections[i].stride * sections[i].count);
+			if (n) memcpy(&bytes[size_t(entries[i].offset)], sections[i].data, n);
+		}
+
+		NatHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "NAT", 4);
+		header.version = NAT_VERSION;
+		header.byte_order = NAT_BYTE_ORDER;
+		header.num_sections = uint32_t(sections.size());
+		header.key = key;
+		header.flags = flags;
+		header.checksum = header_checksum(header, entries.data());
+		memcpy(&bytes[0], &header, sizeof(header));
+	}
+
+	/**
+	* Create a temporary file next to filename, with a name no other writer
+	* uses, so writers of the same file never write into each other's.
+	* @param temp Output name of the created file.
+	* @return the open file, NULL if it can not be created.
+	*/
+	static FILE* create_temp(const std::string& filename, std::string& temp){
+#ifndef _WIN32
+		std::vector<char> name(filename.begin(), filename.end());
+		const char suffix[] = ".XXXXXX";
+		name.insert(name.end(), suffix, suffix + sizeof(suffix));
+		int fd = mkstemp(&name[0]);
+		if (fd < 0) return NULL;
+		temp = &name[0];
+		// mkstemp makes the file private, cache files are shared like others
+		fchmod(fd, 0644);
+		FILE* file = fdopen(fd, "wb");
+		if (!file){
+			::close(fd);
+			remove(temp.c_str());
+		}
+		return file;
+#else
+		static std::atomic<unsigned> counter(0);
+		temp = filename + "." + std::to_string(_getpid()) + "." + std::to_string(counter++) + ".tmp";
+		return fopen(temp.c_str(), "wb");
+#endif
+	}
+
+	/**
+	* Write a file next to its final name, then rename it over, so readers
+	* never see a partial file.
+	*/
+	static bool write_file(const std::string& filename, const std::vector<unsigned char>& bytes){
+		std::string temp;
+		FILE* file = create_temp(filename, temp);
+		if (!file) return false;
+		bool ok = fwrite(&bytes[0], bytes.size(), 1, file) == 1;
+		ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+		if (ok) remove(filename.c_str());
+#endif
+		if (!ok || rename(temp.c_str(), filename.c_str()) != 0){
+			remove(temp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	* Write the file.
+	* @param filename The file to write.
+	* @param key Key of the source the data was built from.
+	* @param flags Free bits for the owner of the file.
+	* @return False if the file can not be written, otherwise return True.
+	*/
+	bool NatWriter::write(const std::string& filename, const NatKey& key, uint64_t flags) const{
+		std::vector<unsigned char> bytes;
+		serialize(key, flags, bytes);
+		return write_file(filename, bytes);
+	}
+
+	// files waiting to be written in the background by a single writer
+	// thread, all written before the program exits
+	static struct BackgroundWrites{
+		std::mutex lock;
+		// signaled when a file is queued, and when the queue drains
+		std::condition_variable queued;
+		std::condition_variable drained;
+		struct File{
+			std::string filename;
+			std::vector<unsigned char>* bytes;
+			std::function<void(bool)> done;
+		};
+		std::deque<File> queue;
+		// a file is being written, or the writer should stop
+		bool busy;
+		bool stopping;
+		std::thread writer;
+
+		BackgroundWrites() : busy(false), stopping(false) { }
+		~BackgroundWrites(){
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				stopping = true;
+			}
+			queued.notify_all();
+			if (writer.joinable()) writer.join();
+		}
+		void write_queued();
+	} background_writes;
+
+	// body of the writer thread, writes queued files in order until stopped
+	// with an empty queue
+	void BackgroundWrites::write_queued(){
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;){
+			while (queue.empty() && !stopping) queued.wait(guard);
+			if (queue.empty()) return;
+			File file = queue.front();
+			queue.pop_front();
+			busy = true;
+
+			guard.unlock();
+			bool ok = write_file(file.filename, *file.bytes);
+			if (!ok){
+				std::cout << "Warning: cannot save '" << file.filename << "'.\n";
+			}
+			delete file.bytes;
+			if (file.done) file.done(ok);
+			guard.lock();
+
+			busy = false;
+			if (queue.empty()) drained.notify_all();
+		}
+	}
+
+	/**
+	* Copy the sections now and queue the file for the writer thread, so the
+	* caller does not wait for the disk. Failures are only reported.
+	* @param done Called on the writer thread once the file is written,
+	*  with whether it could be, or nullptr.
+	*/
+	void NatWriter::write_background(const std::string& filename, const NatKey& key, uint64_t flags,
+		const std::function<void(bool)>& done) const{
+		BackgroundWrites::File file = { filename, new std::vector<unsigned char>(), done };
+		serialize(key, flags, *file.bytes);
+		{
+			std::lock_guard<std::mutex> guard(background_writes.lock);
+			background_writes.queue.push_back(file);
+			if (!background_writes.writer.joinable()){
+				background_writes.writer = std::thread(&BackgroundWrites::write_queued, &background_writes);
+			}
+		}
+		background_writes.queued.notify_one();
+	}
+
+	/**
+	* Wait for all files queued to be written in the background.
+	*/
+	void nat_wait_writes(){
+		std::unique_lock<std::mutex> guard(background_writes.lock);
+		while (!background_writes.queue.empty() || background_writes.busy){
+			background_writes.drained.wait(guard);
+		}
+	}
+
+	NatReader::NatReader() : flags(0) { }
+
+	/**
+	* Map a file and check that it is complete and built from the given source.
+	* Only the header and the section table are read unless verify is set.
+	* @param filename The file to read.
+	* @param key Key of the current source.
+	* @param verify Also check the data of every section against its checksum.
+	* @return False if the file is missing, stale or damaged, otherwise return True.
+	*/
+	bool NatReader::open(const std::string& filename, const NatKey& key, bool verify){
+		if (!file.open(filename)) return false;
+
+		const unsigned char* data = file.data();
+		size_t size = file.size();
+		const NatHeader* header = (const NatHeader*)data;
+		bool ok = size >= sizeof(NatHeader)
+			&& memcmp(header->magic, "NAT", 4) == 0
+			&& header->version == NAT_VERSION
+			&& header->byte_order == NAT_BYTE_ORDER
+			&& header->key.size == key.size
+			&& header->key.mtime == key.mtime
+			&& header->key.extra == key.extra
+			&& (size - sizeof(NatHeader)) / sizeof(NatSectionEntry) >= header->num_sections
+			&& header->checksum == header_checksum(*header, (const NatSectionEntry*)(data + sizeof(NatHeader)));
+		if (ok){
+			const NatSectionEntry* entries = (const NatSectionEntry*)(data + sizeof(NatHeader));
+			for (uint32_t i = 0; ok && i < header->num_sections; ++i){
+				const NatSectionEntry& e = entries[i];
+				ok = e.offset % NAT_ALIGN == 0 && e.offset <= size
+					&& (e.stride == 0 || e.count <= (size - e.offset) / e.stride)
+					&& (!verify || e.checksum == nat_checksum(data + e.offset, size_t(e.stride * e.count)));
+			}
+		}
+		if (!ok){
+			file.close();
+			return false;
+		}
+		flags = header->flags;
+		return true;
+	}
+
+	void NatReader::close(){
+		file.close();
+		flags = 0;
+	}
+
+	/**
+	* Find a section of the open file.
+	* @param type Type of the section.
+	* @param stride Expected bytes per element.
+	* @param count Output number of elements.
+	* @return the elements in place, NULL if there is no such section or its stride differs.
+	*/
+	const void* NatReader::section(uint32_t type, uint32_t stride, uint64_t& count) const{
+		count = 0;
+		if (!file.is_open()) return NULL;
+		const NatHeader* header = (const NatHeader*)file.data();
+		const NatSectionEntry* entries = (const NatSectionEntry*)(file.data() + sizeof(NatHeader));
+		for (uint32_t i = 0; i < header->num_sections; ++i){
+			if (entries[i].type == type){
+				if (entries[i].stride != stride) return NULL;
+				count = entries[i].count;
+				return file.data() + entries[i].offset;
+			}
+		}
+		return NULL;
+	}
+
+	uint64_t NatReader::get_flags() const{
+		return flags;
+	}
+
+} /* _462 */
@@ -0,0 +1,88 @@
+/**
+* @file natfile.hpp
+* @brief binary cache file of typed arrays
+*
+* A .nat file is a header, a table of sections and the section data, each
+* section aligned to 64 bytes. The header records the format version, the
+* byte order, a key identifying the source the data was built from and a
+* checksum of itself and the section table. Every section has a checksum
+* of its data as well, which readers only check when asked to, so opening
+* a large file does not read all of it. Readers map the file and use the
+* sections in place.
+*/
+
+#ifndef _462_SCENE_NATFILE_HPP_
+#define _462_SCENE_NATFILE_HPP_
+
+#include "scene/mappedfile.hpp"
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// bump whenever the layout of the header or of any section changes
+#define NAT_VERSION 3
+
+namespace _462 {
+
+	enum NatSectionType{
+		NAT_MESH_VERTICES = 1,
+		NAT_MESH_TRIANGLES = 2,
+		NAT_BVH_NODES = 3,
+		// progress of a render, see Raytracer::save_checkpoint
+		NAT_CHECKPOINT_COLORS = 4,
+		NAT_CHECKPOINT_AOVS = 6,
+		// decoded mip map pyramid of a texture, see Texture::load
+		NAT_TEXTURE_LEVELS = 7,
+		NAT_TEXTURE_TILES = 8
+	};
+
+	// identifies the source a cache file was built from
+	struct NatKey{
+		uint64_t size;
+		int64_t mtime;
+		uint64_t extra;
+	};
+
+	bool nat_source_key(const std::string& filename, NatKey& key);
+	std::string nat_cache_dir();
+	std::string nat_cache_filename(const std::string& filename, const char* suffix);
+	uint64_t nat_checksum(const unsigned char* data, size_t size, uint64_t seed = 0);
+
+	class NatWriter{
+	public:
+		void add_section(uint32_t type, uint32_t stride, const void* data, uint64_t count);
+		bool write(const std::string& filename, const NatKey& key, uint64_t flags) const;
+		void write_background(const std::string& filename, const NatKey& key, uint64_t flags,
+			const std::function<void(bool)>& done = nullptr) const;
+	private:
+		struct Pending{
+			uint32_t type;
+			uint32_t stride;
+			const void* data;
+			uint64_t count;
+		};
+		std::vector<Pending> sections;
+
+		void serialize(const NatKey& key, uint64_t flags, std::vector<unsigned char>& bytes) const;
+	};
+
+	void nat_wait_writes();
+
+	class NatReader{
+	public:
+		NatReader();
+
+		bool open(const std::string& filename, const NatKey& key, bool verify = false);
+		void close();
+
+		const void* section(uint32_t type, uint32_t stride, uint64_t& count) const;
+		uint64_t get_flags() const;
+	private:
+		MappedFile file;
+		uint64_t flags;
+	};
+
+} /* _462 */
+
+#endif /* _462_SCENE_NATFILE_HPP_ */
@@ -0,0 +1,178 @@
+/**
+* @file numa.cpp
+* @brief NUMA topology, thread placement and memory placement
+*/
+
+#include "scene/numa.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace _462{
+
+	// memory policy constants of the mbind system call, from numaif.h
+	#define NUMA_MPOL_INTERLEAVE 3
+	#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+	struct NumaTopology{
+		// cpus of every node
+		std::vector<std::vector<int> > node_cpus;
+		// node of every cpu
+		std::vector<int> cpu_node;
+		// cpus in pinning order, alternating between the nodes
+		std::vector<int> pin_order;
+		bool interleave;
+	};
+
+	/**
+	* Parse a cpu list of the form "0-3,8,10-11".
+	*/
+	static void parse_cpu_list(const char* text, std::vector<int>& cpus){
+		const char* p = text;
+		while (*p){
+			char* end;
+			long first = strtol(p, &end, 10);
+			if (end == p) break;
+			long last = first;
+			p = end;
+			if (*p == '-'){
+				last = strtol(p + 1, &end, 10);
+				p = end;
+			}
+			for (long c = first; c <= last; ++c){
+				cpus.push_back(int(c));
+			}
+			if (*p != ',') break;
+			++p;
+		}
+	}
+
+	/**
+	* Read the topology from sysfs, a single node with every cpu if it is
+	* not there.
+	*/
+	static NumaTopology load_topology(){
+		NumaTopology t;
+		t.interleave = false;
+#ifdef __linux__
+		for (int node = 0;; ++node){
+			char path[64];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+			FILE* file = fopen(path, "r");
+			if (!file) break;
+			char text[4096];
+			std::vector<int> cpus;
+			if (fgets(text, sizeof(text), file)) parse_cpu_list(text, cpus);
+			fclose(file);
+			t.node_cpus.push_back(cpus);
+		}
+#endif
+		if (t.node_cpus.empty()){
+			std::vector<int> cpus;
+#ifdef __linux__
+			long n = sysconf(_SC_NPROCESSORS_ONLN);
+			for (long c = 0; c < n; ++c) cpus.push_back(int(c));
+#endif
+			t.node_cpus.push_back(cpus);
+		}
+
+		size_t most = 0;
+		for (size_t n = 0; n < t.node_cpus.size(); ++n){
+			const std::vector<int>& cpus = t.node_cpus[n];
+			for (size_t i = 0; i < cpus.size(); ++i){
+				if (size_t(cpus[i]) >= t.cpu_node.size()) t.cpu_node.resize(cpus[i] + 1, 0);
+				t.cpu_node[cpus[i]] = int(n);
+			}
+			if (cpus.size() > most) most = cpus.size();
+		}
+		for (size_t i = 0; i < most; ++i){
+			for (size_t n = 0; n < t.node_cpus.size(); ++n){
+				if (i < t.node_cpus[n].size()) t.pin_order.push_back(t.node_cpus[n][i]);
+			}
+		}
+		return t;
+	}
+
+	static NumaTopology& topology(){
+		static NumaTopology topo = load_topology();
+		return topo;
+	}
+
+	int numa_num_nodes(){
+		return int(topology().node_cpus.size());
+	}
+
+	/**
+	* @return the node of the cpu the calling thread runs on.
+	*/
+	int numa_current_node(){
+#ifdef __linux__
+		const NumaTopology& t = topology();
+		int cpu = sched_getcpu();
+		if (cpu >= 0 && size_t(cpu) < t.cpu_node.size()) return t.cpu_node[cpu];
+#endif
+		return 0;
+	}
+
+	/**
+	* Pin the calling thread to one cpu. Consecutive indices go to different
+	* nodes, so a team of threads uses the memory bandwidth of all nodes.
+	* @param index Index of the thread in its team.
+	* @return False if the thread could not be pinned, otherwise return True.
+	*/
+	bool numa_pin_thread(size_t index){
+#ifdef __linux__
+		const NumaTopology& t = topology();
+		if (t.pin_order.empty()) return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(t.pin_order[index % t.pin_order.size()], &set);
+		return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	* Choose whether scene data is interleaved over the nodes. Has to be set
+	* before the scene is loaded.
+	*/
+	void numa_set_interleave(bool interleave){
+		topology().interleave = interleave;
+	}
+
+	/**
+	* Spread the pages of a block of memory over all nodes, if interleaving
+	* is on. Pages already touched are moved. Only whole pages inside the
+	* block are affected.
+	* @param data The memory.
+	* @param size Number of bytes.
+	*/
+	void numa_interleave(void* data, size_t size){
+#if defined(__linux__) && defined(SYS_mbind)
+		const NumaTopology& t = topology();
+		if (!t.interleave || t.node_cpus.size() < 2) return;
+
+		size_t page = size_t(sysconf(_SC_PAGESIZE));
+		size_t begin = (size_t(data) + page - 1) & ~(page - 1);
+		size_t end = (size_t(data) + size) & ~(page - 1);
+		if (end <= begin) return;
+
+		const size_t bits = 8 * sizeof(unsigned long);
+		std::vector<unsigned long> mask((t.node_cpus.size() + bits - 1) / bits, 0);
+		for (size_t n = 0; n < t.node_cpus.size(); ++n){
+			mask[n / bits] |= 1ul << (n % bits);
+		}
+		syscall(SYS_mbind, begin, end - begin, NUMA_MPOL_INTERLEAVE, &mask[0],
+			// the kernel ignores the last bit of maxnode
+			mask.size() * bits + 1, NUMA_MPOL_MF_MOVE);
+#endif
+	}
+
+} /* _462 */
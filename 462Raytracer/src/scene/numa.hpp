@@ -0,0 +1,28 @@
+/**
+* @file numa.hpp
+* @brief NUMA topology, thread placement and memory placement
+*
+* On machines with several memory nodes, render threads can be pinned
+* spread over the nodes, and the large read only scene data (bvh trees,
+* triangles and textures) can be interleaved over all nodes, so no node
+* serves every miss. On a single node machine, or without Linux, every
+* function here does nothing.
+*/
+
+#ifndef _462_SCENE_NUMA_HPP_
+#define _462_SCENE_NUMA_HPP_
+
+#include <cstddef>
+
+namespace _462 {
+
+	int numa_num_nodes();
+	int numa_current_node();
+	bool numa_pin_thread(size_t index);
+
+	void numa_set_interleave(bool interleave);
+	void numa_interleave(void* data, size_t size);
+
+} /* _462 */
+
+#endif /* _462_SCENE_NUMA_HPP_ */
@@ -3,12 +3,14 @@
 namespace _462 {
 
 
-Ray::Ray(){}
+Ray::Ray():width(0),spread(0){}
 
 Ray::Ray(Vector3 e, Vector3 d)
 {
     this->e = e;
     this->d = d;
+    width = 0;
+    spread = 0;
 }
 
 
@@ -33,5 +35,11 @@ Vector3 Projector::get_pixel_dir(real_t ni, real_t nj)
     return normalize(dir + dist*(nj*cU + AR*ni*cR));
 }
 
+real_t Projector::get_pixel_spread(size_t height) const
+{
+    // the image plane at distance 1 is 2*dist high
+    return real_t(2)*dist/height;
+}
+
 
 }
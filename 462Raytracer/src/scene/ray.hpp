@@ -18,12 +18,20 @@ class Ray
 public:
     Vector3 e;
     Vector3 d;
+    // ray cone used to pick texture mip levels: width of the cone at e,
+    // and the spread angle of the cone. Both are 0 for an infinitely thin ray.
+    real_t width;
+    real_t spread;
     
     Ray();
     Ray(Vector3 e, Vector3 d);
     Vector3 atTime(real_t t) const{
     return e+d*t;
     }
+    // width of the ray cone at time t
+    real_t width_at(real_t t) const{
+    return width+spread*t*length(d);
+    }
 };
 
 std::ostream& operator<<( std::ostream& os, const Ray& rhs );
@@ -40,6 +48,8 @@ class Projector{
     
 public:
     Vector3 get_pixel_dir(real_t x, real_t y);
+    // spread angle of a pixel, for an image of the given height
+    real_t get_pixel_spread(size_t height) const;
     void init(const Camera& camera);
 
 
@@ -8,13 +8,16 @@
 
 #include "scene/scene.hpp"
 #include "scene/bvhnode.hpp"
+#include <algorithm>
+#include <unordered_set>
 namespace _462 {
 
 
 Geometry::Geometry():
     position(Vector3::Zero()),
     orientation(Quaternion::Identity()),
-    scale(Vector3::Ones())
+    scale(Vector3::Ones()),
+    owner(this)
 {
 
 }
@@ -30,7 +33,36 @@ bool Geometry::initialize()
     return true;
 }
 
-Ray Geometry::to_local(const Ray& r){
+/**
+ * Recompute the transformation, by default the same as initialize.
+ */
+bool Geometry::update_transform()
+{
+    return initialize();
+}
+
+bool Geometry::content_changed() const
+{
+    return false;
+}
+
+bool Geometry::transform_changed() const
+{
+    Matrix4 m;
+    make_transformation_matrix(&m, position, orientation, scale);
+    return m != mat;
+}
+
+Geometry* Geometry::shadow_occluder(const Ray& r, real_t dis){
+	return shadow_test(r, dis) ? this : NULL;
+}
+
+void Geometry::shade(const Ray& r, const HitRecord& rec, Intersection& info) const{
+	// only primitives are ever recorded as hits
+	assert(false);
+}
+
+Ray Geometry::to_local(const Ray& r) const{
 	Ray local_r;
 	local_r.d = invMat.transform_vector(r.d);
 	local_r.e = invMat.transform_point(r.e);
@@ -59,15 +91,84 @@ Scene::~Scene()
 
 bool Scene::initialize()
 {
-    bool res = true;
-    for (unsigned int i = 0; i < num_geometries(); i++)
-        res &= geometries[i]->initialize();
-    return res;
+    // models build their trees here, so spread the geometries over threads
+    int res = 1;
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(&&:res)
+#endif
+    for (int i = 0; i < (int)num_geometries(); i++)
+        res = geometries[i]->initialize() && res;
+    initialized_geometries = geometries;
+    initialized_lights = point_lights;
+    return res != 0;
+}
+
+static bool same_light(const SphereLight& a, const SphereLight& b)
+{
+    return a.position == b.position && a.color == b.color && a.radius == b.radius
+        && a.attenuation.constant == b.attenuation.constant
+        && a.attenuation.linear == b.attenuation.linear
+        && a.attenuation.quadratic == b.attenuation.quadratic;
 }
 
+/**
+ * Bring the scene up to date after the last initialize or update, only
+ * touching what changed: new geometries are initialized, geometries whose
+ * content changed are built again and moved geometries only recompute
+ * their transformation.
+ * @return the SceneChange bits of what changed.
+ */
+int Scene::update()
+{
+    int changes = SCENE_UNCHANGED;
+
+    std::unordered_set<const Geometry*> known(initialized_geometries.begin(), initialized_geometries.end());
+    // removed geometries only change the list
+    if (geometries != initialized_geometries)
+        changes |= SCENE_GEOMETRY;
+
+    std::vector<Geometry*> rebuilt, moved;
+    for (size_t i = 0; i < geometries.size(); i++) {
+        Geometry* g = geometries[i];
+        if (!known.count(g) || g->content_changed())
+            rebuilt.push_back(g);
+        else if (g->transform_changed())
+            moved.push_back(g);
+    }
+    if (!rebuilt.empty())
+        changes |= SCENE_GEOMETRY;
+    if (!moved.empty())
+        changes |= SCENE_TRANSFORMS;
+
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < (int)rebuilt.size(); i++)
+        rebuilt[i]->initialize();
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < (int)moved.size(); i++)
+        moved[i]->update_transform();
+
+    bool same_lights = point_lights.size() == initialized_lights.size();
+    for (size_t i = 0; same_lights && i < point_lights.size(); i++)
+        same_lights = same_light(point_lights[i], initialized_lights[i]);
+    if (!same_lights)
+        changes |= SCENE_LIGHTS;
+
+    initialized_geometries = geometries;
+    initialized_lights = point_lights;
+    return changes;
+}
+
+/**
+ * Build the bvh tree over all geometries. The tree is owned by the scene
+ * and replaces the tree of the last call.
+ */
 BvhNode* Scene::gen_bvh_tree(){
-	BvhNode* root = new BvhNode(geometries,0 , 0, geometries.size() - 1);
-	return root;
+	bvh_arena.clear();
+	return BvhNode::build(geometries, bvh_arena);
 }
 
 Geometry* const* Scene::get_geometries() const
@@ -123,9 +224,13 @@ void Scene::reset()
     }
 
     geometries.clear();
+    initialized_geometries.clear();
+    initialized_lights.clear();
     materials.clear();
     meshes.clear();
     point_lights.clear();
+    camera_track.clear();
+    geometry_tracks.clear();
 	skybox = NULL;
 
     camera = Camera();
@@ -155,5 +260,35 @@ void Scene::add_light( const SphereLight& l )
     point_lights.push_back( l );
 }
 
-} /* _462 */
+void Scene::set_camera_track( const KeyframeTrack& track )
+{
+    camera_track = track;
+}
 
+void Scene::add_geometry_track( Geometry* g, const KeyframeTrack& track )
+{
+    geometry_tracks.push_back( std::make_pair( g, track ) );
+}
+
+/**
+ * Move the camera and the geometries to their pose at the given time.
+ * Only the transforms change, update picks up the moved geometries.
+ * @param time Time in seconds.
+ */
+void Scene::set_time( real_t time )
+{
+    if ( !camera_track.empty() ) {
+        Keyframe key = camera_track.sample( time );
+        camera.position = key.position;
+        camera.orientation = key.orientation;
+    }
+    for ( size_t i = 0; i < geometry_tracks.size(); ++i ) {
+        Keyframe key = geometry_tracks[i].second.sample( time );
+        Geometry* g = geometry_tracks[i].first;
+        g->position = key.position;
+        g->orientation = key.orientation;
+        g->scale = key.scale;
+    }
+}
+
+} /* _462 */
@@ -19,9 +19,12 @@
 #include <vector>
 #include <cfloat>
 #include "scene/bound.hpp"
+#include "scene/arena.hpp"
+#include "scene/animation.hpp"
 
 namespace _462 {
 class BvhNode;
+class Geometry;
 
 //represents an intersection between a ray and a geometry
 struct Intersection{
@@ -48,14 +51,28 @@ static Intersection default_intersection(){
 	return info;
 }
 
-//represents any additional intersection information
-    
+//represents a hit found while traversing the scene. It only keeps what is
+//needed to shade the hit later, materials and textures are not touched
+//until the closest hit is known.
 struct HitRecord{
-    bool is_hit;
-    //the hitted triangle index of mesh
-    size_t triangle_index;
+    //the hitted primitive, NULL if nothing was hit
+    const Geometry* geometry;
+    //intersection time t
+    real_t t;
+    //barycentric coordinate of the hit point, used by triangles
+    real_t u;
+    real_t v;
 };
 
+static HitRecord default_hit_record(){
+	HitRecord rec;
+	rec.geometry = NULL;
+	rec.t = INFINITY;
+	rec.u = 0;
+	rec.v = 0;
+	return rec;
+}
+
 
 class Geometry
 {
@@ -90,18 +107,32 @@ public:
 	Bound box;
 
     bool isBig;
+    // the scene geometry this belongs to, itself unless it is a triangle
+    // of a model
+    const Geometry* owner;
     /**
      * Renders this geometry using OpenGL in the local coordinate space.
      */
     virtual void render() const = 0;
 
     virtual bool initialize();
-	//intersection test function
-	virtual bool intersect_test(const Ray& r, real_t& t, Intersection& rec) = 0;
+	//recompute everything that depends on the transformation, after position,
+	//orientation or scale changed. Has to be called after initialize.
+	virtual bool update_transform();
+	//check whether the content was changed since initialize and has to be built again
+	virtual bool content_changed() const;
+	//check whether position, orientation or scale changed since the last update
+	bool transform_changed() const;
+	//intersection test function, only records hits closer than rec.t
+	virtual bool intersect_test(const Ray& r, HitRecord& rec) = 0;
+	//fill in the intersection information of a hit found by intersect_test
+	virtual void shade(const Ray& r, const HitRecord& rec, Intersection& info) const;
 	//shadow_test function
 	virtual bool shadow_test(const Ray &r, real_t dis) = 0;
+	//shadow test that also returns the primitive blocking the ray, or NULL
+	virtual Geometry* shadow_occluder(const Ray &r, real_t dis);
 	//change to ray to it's local coordinate
-	Ray to_local(const Ray& r);
+	Ray to_local(const Ray& r) const;
 
 };
 
@@ -128,6 +159,17 @@ struct SphereLight
     real_t radius;
 };
 
+/// what changed in the scene since it was last initialized or updated
+enum SceneChange
+{
+    SCENE_UNCHANGED = 0,
+    // some geometries were moved, the bvh tree can be refit
+    SCENE_TRANSFORMS = 1,
+    // geometries were added or rebuilt, the bvh tree has to be built again
+    SCENE_GEOMETRY = 2,
+    SCENE_LIGHTS = 4
+};
+
 /**
  * The container class for information used to render a scene composed of
  * Geometries.
@@ -155,6 +197,7 @@ public:
     ~Scene();
 
     bool initialize();
+    int update();
 
 	BvhNode* gen_bvh_tree();
 
@@ -177,6 +220,11 @@ public:
     void add_material( Material* m );
     void add_mesh( Mesh* m );
     void add_light( const SphereLight& l );
+
+    // keyframed motion, the tracks are applied by set_time
+    void set_camera_track( const KeyframeTrack& track );
+    void add_geometry_track( Geometry* g, const KeyframeTrack& track );
+    void set_time( real_t time );
 	
 	// load environment map
 	
@@ -196,6 +244,18 @@ private:
     MeshList meshes;
     // list of all geometries. deleted in dctor, so should be allocated on heap.
     GeometryList geometries;
+
+    // motion of the camera, empty if it does not move
+    KeyframeTrack camera_track;
+    // motion of the moving geometries
+    std::vector< std::pair< Geometry*, KeyframeTrack > > geometry_tracks;
+
+    // nodes of the tree built by gen_bvh_tree
+    Arena bvh_arena;
+
+    // geometries and lights as of the last initialize or update
+    GeometryList initialized_geometries;
+    SphereLightList initialized_lights;
 private:
 
     // no meaningful assignment or copy
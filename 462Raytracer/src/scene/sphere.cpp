@@ -115,12 +115,14 @@ void Sphere::render() const
     if ( material )
         material->set_gl_state();
 
+#ifndef _462_HEADLESS
     // just scale by radius and draw unit sphere
     glPushMatrix();
     glScaled( radius, radius, radius );
     glInterleavedArrays( GL_T2F_N3F_V3F, VERTEX_SIZE * sizeof Vertices[0], Vertices );
     glDrawElements( GL_TRIANGLES, SPHERE_NUM_INDICES, GL_UNSIGNED_INT, Indices );
     glPopMatrix();
+#endif
 
     if ( material )
         material->reset_gl_state();
@@ -161,31 +163,40 @@ real_t solve_time(real_t a,real_t b,real_t c){
 }
 
 
-bool Sphere::intersect_test(const Ray& r, real_t& t, Intersection& info){
+bool Sphere::intersect_test(const Ray& r, HitRecord& rec){
 	Ray local_r = to_local(r);
-	t = solve_time(local_r.d * local_r.d, 2.0f * local_r.d * local_r.e, local_r.e * local_r.e - radius * radius);
-    if(t > EPS){
-
-		info.ambient = material->ambient;
-		info.diffuse = material->diffuse;
-		info.specular = material->specular;
-		info.shininess = material->shininess;
-		Vector3 local_pos = local_r.atTime(t);
-		info.position = mat.transform_point(local_pos);
-		//for sphere, the local_pos is it's normal vector;
-		info.normal = normalize(normMat * local_pos);
-		info.refractive_index = material->refractive_index;
-
-		//caculate the uv coordinate of hit point
-
-		real_t theta = std::acos(local_pos.y / radius);
-		real_t phi = std::atan2(-local_pos.x, -local_pos.z) + PI;
-		Vector2 tex_coor = Vector2(phi / (2 * PI),  (PI - theta) / PI);
-		info.tex_Color = material->texture.sample(tex_coor);
-
+	real_t t = solve_time(local_r.d * local_r.d, 2.0f * local_r.d * local_r.e, local_r.e * local_r.e - radius * radius);
+	if (t > EPS && t < rec.t){
+		rec.geometry = this;
+		rec.t = t;
 		return true;
-    }
-    return false;
+	}
+	return false;
+}
+
+void Sphere::shade(const Ray& r, const HitRecord& rec, Intersection& info) const{
+	Ray local_r = to_local(r);
+	Vector3 local_pos = local_r.atTime(rec.t);
+
+	info.ambient = material->ambient;
+	info.diffuse = material->diffuse;
+	info.specular = material->specular;
+	info.shininess = material->shininess;
+	info.position = mat.transform_point(local_pos);
+	//for sphere, the local_pos is it's normal vector;
+	info.normal = normalize(normMat * local_pos);
+	info.refractive_index = material->refractive_index;
+
+	//caculate the uv coordinate of hit point
+	real_t theta = std::acos(local_pos.y / radius);
+	real_t phi = std::atan2(-local_pos.x, -local_pos.z) + PI;
+	Vector2 tex_coor = Vector2(phi / (2 * PI),  (PI - theta) / PI);
+
+	//width of the ray cone on the texture, u spans 2*PI*r and v spans PI*r
+	real_t world_radius = radius * std::max(scale.x, std::max(scale.y, scale.z));
+	real_t cos_d = std::max(std::fabs(info.normal * r.d) / length(r.d), real_t(0.1));
+	real_t footprint = r.width_at(rec.t) / (real_t(std::sqrt(2.0) * PI) * world_radius * cos_d);
+	info.tex_Color = material->texture.sample(tex_coor, footprint);
 }
 
 bool Sphere::shadow_test(const Ray& r, real_t dis){
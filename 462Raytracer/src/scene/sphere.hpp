@@ -27,7 +27,8 @@ public:
     virtual ~Sphere();
 	virtual bool initialize();
     virtual void render() const;
-	virtual bool intersect_test(const Ray& r, real_t& t, Intersection& info);
+	virtual bool intersect_test(const Ray& r, HitRecord& rec);
+	virtual void shade(const Ray& r, const HitRecord& rec, Intersection& info) const;
 	virtual bool shadow_test(const Ray &r, real_t dis);
 	
 };
@@ -7,10 +7,67 @@
 //
 
 #include "scene/texture.hpp"
+#include "scene/tilecache.hpp"
+#include "scene/numa.hpp"
+#include <cstring>
+#include <map>
+#include <mutex>
 namespace _462{
-const unsigned char* Texture::get_texture_data() const
+
+static_assert( TileCache::TILE_BYTES == 4 << ( 2 * Texture::TILE_SHIFT ), "tile size mismatch" );
+
+// 8-bit channel values to [0, 1], instead of a divide per channel
+static struct ByteTable
+{
+    real_t value[256];
+    ByteTable()
+    {
+        for ( int i = 0; i < 256; i++ )
+            value[i] = real_t( i ) / real_t( 255 );
+    }
+} byte_table;
+
+// wraps x into [0, size), with a mask if size is a power of two
+static inline int wrap( int x, int size, int mask )
+{
+    if ( mask >= 0 )
+        return x & mask;
+    x = x % size;
+    return x < 0 ? x + size : x;
+}
+
+static inline int pow2_mask( int size )
+{
+    return ( size & ( size - 1 ) ) == 0 ? size - 1 : -1;
+}
+
+// copies 32-bit RGBA rows into the tiles of a level
+static void tile_level( const MipLevel& l, const unsigned char* rgba, unsigned char* tiles )
 {
-    return data;
+    const int side = 1 << Texture::TILE_SHIFT;
+    for ( int y = 0; y < l.height; y++ ) {
+        for ( int tx = 0; tx * side < l.width; tx++ ) {
+            size_t tile = l.first_tile + ( y >> Texture::TILE_SHIFT ) * l.tiles_x + tx;
+            unsigned char* dst = tiles + tile * TileCache::TILE_BYTES
+                + 4 * ( ( y & Texture::TILE_MASK ) << Texture::TILE_SHIFT );
+            int n = std::min( side, l.width - tx * side );
+            memcpy( dst, rgba + 4 * ( y * l.width + tx * side ), 4 * n );
+        }
+    }
+}
+
+bool Texture::get_texture_data( std::vector<unsigned char>& rgba ) const
+{
+    if ( levels.empty() )
+        return false;
+    rgba.resize( 4 * width * height );
+    TileFetch fetch;
+    for ( int y = 0; y < height; y++ ) {
+        for ( int x = 0; x < width; x++ ) {
+            memcpy( &rgba[4 * ( x + y * width )], get_texel( 0, x, y, fetch ), 4 );
+        }
+    }
+    return true;
 }
 
 void Texture::get_texture_size( int* w, int* h ) const
@@ -22,56 +79,342 @@ void Texture::get_texture_size( int* w, int* h ) const
 
 Color3 Texture::get_texture_pixel( int x, int y ) const
 {
-    if(width<=0 || height<=0){
+    if ( levels.empty() ) {
         return Color3::White();
     }
-    x=x%width;
-    while(x<0){
-        x+=width;
-    }
-    y=y%height;
-    while(y<0){
-        y+=height;
-    }
-    assert(x>=0 && y>=0 && x<width && y<height);
-    return data ? Color3( data + 4 * (x + y * width) ) : Color3::White();
+    const MipLevel& l = levels[0];
+    TileFetch fetch;
+    return get_level_pixel( 0, wrap( x, l.width, l.mask_x ), wrap( y, l.height, l.mask_y ), fetch );
+}
+
+TextureTiles::TextureTiles() : data( NULL ), num_tiles( 0 ), cache_id( -1 ) { }
+
+TextureTiles::~TextureTiles()
+{
+    if ( cache_id >= 0 )
+        texture_tile_cache().remove( cache_id );
+}
+
+// whether decoded textures are kept in .nat files in the cache directory
+static bool use_nat_cache = false;
+
+/**
+ * Turns the .nat files of decoded textures on or off, off by default. A
+ * texture with a current .nat file maps its tiles from it instead of
+ * decoding its image again. They are as large as the decoded images, so
+ * they are only written when asked for.
+ */
+void texture_set_nat_cache( bool enabled )
+{
+    use_nat_cache = enabled;
+}
+
+// a texture file loaded by this process
+struct TextureEntry
+{
+    // held while the texture loads, so other threads wait for it
+    std::mutex lock;
+    bool loaded;
+    // identifies the version of the file that was loaded
+    NatKey key;
+    // the loaded texture without its tiles, which are only kept while
+    // some texture uses them
+    Texture texture;
+    std::weak_ptr< const TextureTiles > tiles;
+
+    TextureEntry() : loaded( false ) { }
+};
+
+// every texture file loaded by this process, shared by all scenes
+static struct TextureRegistry
+{
+    std::mutex lock;
+    std::map< std::string, std::shared_ptr< TextureEntry > > entries;
+} texture_registry;
+
+static bool same_key( const NatKey& a, const NatKey& b )
+{
+    return a.size == b.size && a.mtime == b.mtime && a.extra == b.extra;
 }
 
+/**
+ * Loads the texture from its file. A file already loaded by this process
+ * is shared instead, for as long as any texture still uses its tiles.
+ */
 bool Texture::load(){
     // if no texture, nothing to do
     if ( filename.empty() )
         return true;
-    
-    std::cout << "Loading texture " << filename << "...\n";
-    
-    // allocates data with malloc
-    data = imageio_load_image( filename.c_str(), &width, &height );
-    
-    if ( !data ) {
+
+    NatKey key;
+    if ( !nat_source_key( filename, key ) ) {
         std::cerr << "Cannot load texture file " << filename << std::endl;
         return false;
     }
+
+    std::shared_ptr< TextureEntry > entry;
+    {
+        std::lock_guard< std::mutex > guard( texture_registry.lock );
+        std::shared_ptr< TextureEntry >& e = texture_registry.entries[filename];
+        if ( !e )
+            e.reset( new TextureEntry() );
+        entry = e;
+    }
+
+    std::lock_guard< std::mutex > guard( entry->lock );
+    if ( entry->loaded && same_key( entry->key, key ) ) {
+        std::shared_ptr< const TextureTiles > shared = entry->tiles.lock();
+        if ( shared ) {
+            *this = entry->texture;
+            tiles = shared;
+            texels = shared->data;
+            std::cout << "Reusing texture " << filename << "\n";
+            return true;
+        }
+    }
+
+    if ( !load_file( key ) )
+        return false;
+    entry->loaded = true;
+    entry->key = key;
+    entry->texture = *this;
+    entry->texture.tiles.reset();
+    entry->texture.texels = NULL;
+    entry->tiles = tiles;
+    return true;
+}
+
+// decodes the image, or maps its .nat file if it is current
+bool Texture::load_file( const NatKey& key ){
+    std::cout << "Loading texture " << filename << "...\n";
+
+    if ( !use_nat_cache || !load_nat( key ) ) {
+        // allocates data with malloc
+        unsigned char* data = imageio_load_image( filename.c_str(), &width, &height );
+
+        if ( !data ) {
+            std::cerr << "Cannot load texture file " << filename << std::endl;
+            return false;
+        }
+        gen_mipmaps( data, width, height );
+        free( data );
+        if ( use_nat_cache )
+            save_nat( key );
+    }
+
+    use_tile_cache();
     std::cout << "Finished loading texture" << std::endl;
     return true;
 }
 
+/**
+ * Maps the levels and tiles of the texture from its .nat file.
+ * @return False if there is no current .nat file, otherwise return True.
+ */
+bool Texture::load_nat( const NatKey& key ){
+    std::shared_ptr< TextureTiles > storage( new TextureTiles() );
+    std::string nat_file = nat_cache_filename( filename, ".nat" );
+    if ( nat_file.empty() || !storage->nat.open( nat_file, key ) )
+        return false;
+    uint64_t num_levels, num_tiles;
+    const MipLevel* l = (const MipLevel*)storage->nat.section( NAT_TEXTURE_LEVELS, sizeof( MipLevel ), num_levels );
+    const unsigned char* t = (const unsigned char*)storage->nat.section( NAT_TEXTURE_TILES, TileCache::TILE_BYTES, num_tiles );
+    if ( !l || !t || num_levels == 0 )
+        return false;
+
+    // reject levels with tiles out of range, sampling trusts them
+    for ( size_t i = 0; i < num_levels; i++ ) {
+        if ( l[i].width <= 0 || l[i].height <= 0
+             || l[i].tiles_x != ( l[i].width + TILE_MASK ) >> TILE_SHIFT
+             || l[i].mask_x != pow2_mask( l[i].width ) || l[i].mask_y != pow2_mask( l[i].height )
+             || l[i].first_tile > num_tiles
+             || num_tiles - l[i].first_tile < size_t( l[i].tiles_x ) * ( ( l[i].height + TILE_MASK ) >> TILE_SHIFT ) )
+            return false;
+    }
+
+    levels.assign( l, l + num_levels );
+    width = levels[0].width;
+    height = levels[0].height;
+    storage->data = t;
+    storage->num_tiles = size_t( num_tiles );
+    tiles = storage;
+    texels = t;
+    cache_id = -1;
+    return true;
+}
+
+// writes the levels and tiles to the .nat file of the texture, in the background
+void Texture::save_nat( const NatKey& key ) const{
+    std::string nat_file = nat_cache_filename( filename, ".nat" );
+    if ( levels.empty() || nat_file.empty() )
+        return;
+    NatWriter writer;
+    writer.add_section( NAT_TEXTURE_LEVELS, sizeof( MipLevel ), &levels[0], levels.size() );
+    writer.add_section( NAT_TEXTURE_TILES, TileCache::TILE_BYTES, texels, tiles->num_tiles );
+    writer.write_background( nat_file, key, 0 );
+}
+
+// leaves only the tiles in use in memory, if the tile cache is on
+void Texture::use_tile_cache(){
+    TileCache& cache = texture_tile_cache();
+    if ( cache.enabled() ) {
+        int id = cache.add( texels, tiles->num_tiles );
+        if ( id >= 0 ) {
+            std::shared_ptr< TextureTiles > cached( new TextureTiles() );
+            cached->num_tiles = tiles->num_tiles;
+            cached->cache_id = id;
+            tiles = cached;
+            texels = NULL;
+            cache_id = id;
+        }
+    }
+}
+
 Color3 Texture::sample(Vector2 coord) const{
-	real_t u0 = fmod(coord.x, 1);
-	real_t v0 = fmod(coord.y, 1);
-	size_t i = std::floor(u0 * width);
-	size_t j = std::floor(v0 * height);
-	real_t u1 = width * u0 - i;
-	real_t v1 = height * v0 - j;
-	real_t u2 = 3 * std::pow(u1,2) - 2 * std::pow(u1,3);
-	real_t v2 = 3 * std::pow(v1, 2) - 2 * std::pow(v1, 3);
-	return (1 - u2) * (1 - v2) * get_texture_pixel(i, j) 
-		+ u2 * (1 - v2) * get_texture_pixel(i + 1, j)
-		+ (1 - u2) * v2 * get_texture_pixel(i, j + 1)
-		 + u2 * v2 * get_texture_pixel(i + 1, j + 1);
+	return sample(coord, 0);
+}
 
+Color3 Texture::sample(Vector2 coord, real_t footprint) const{
+	if (levels.empty()){
+		return Color3::White();
+	}
+
+	// number of level 0 texels the footprint covers picks the level
+	real_t lod = footprint > 0 ? std::log2(footprint * std::sqrt(real_t(width) * real_t(height))) : 0;
+	size_t max_level = levels.size() - 1;
+	if (lod <= 0 || max_level == 0){
+		return sample_level(0, coord);
+	}
+	if (lod >= max_level){
+		return sample_level(max_level, coord);
+	}
+
+	// blend the two nearest levels
+	size_t l0 = (size_t)lod;
+	real_t f = lod - l0;
+	return (1 - f) * sample_level(l0, coord) + f * sample_level(l0 + 1, coord);
+}
+
+Color3 Texture::sample_level(size_t level, Vector2 coord) const{
+	const MipLevel& l = levels[level];
+	real_t u = (coord.x - std::floor(coord.x)) * l.width;
+	real_t v = (coord.y - std::floor(coord.y)) * l.height;
+	int i = (int)u;
+	int j = (int)v;
+	real_t u1 = u - i;
+	real_t v1 = v - j;
+	// hermite interpolation weights
+	real_t u2 = u1 * u1 * (3 - 2 * u1);
+	real_t v2 = v1 * v1 * (3 - 2 * v1);
+	int x0 = wrap(i, l.width, l.mask_x);
+	int x1 = wrap(i + 1, l.width, l.mask_x);
+	int y0 = wrap(j, l.height, l.mask_y);
+	int y1 = wrap(j + 1, l.height, l.mask_y);
+	TileFetch fetch;
+	return (1 - u2) * (1 - v2) * get_level_pixel(level, x0, y0, fetch)
+		+ u2 * (1 - v2) * get_level_pixel(level, x1, y0, fetch)
+		+ (1 - u2) * v2 * get_level_pixel(level, x0, y1, fetch)
+		+ u2 * v2 * get_level_pixel(level, x1, y1, fetch);
+}
+
+/**
+ * Returns the RGBA bytes of the (x,y) texel of a level, x and y must be
+ * inside the level. A tile in the tile cache is only fetched if it is not
+ * the one fetch holds.
+ */
+const unsigned char* Texture::get_texel( size_t level, int x, int y, TileFetch& fetch ) const
+{
+    const MipLevel& l = levels[level];
+    size_t tile = l.first_tile + ( y >> TILE_SHIFT ) * l.tiles_x + ( x >> TILE_SHIFT );
+    size_t offset = 4 * ( ( ( y & TILE_MASK ) << TILE_SHIFT ) | ( x & TILE_MASK ) );
+    if ( cache_id < 0 )
+        return texels + tile * TileCache::TILE_BYTES + offset;
+    if ( fetch.tile != tile ) {
+        fetch.data = texture_tile_cache().get_tile( cache_id, tile );
+        fetch.tile = tile;
+    }
+    return fetch.data + offset;
+}
+
+Color3 Texture::get_level_pixel( size_t level, int x, int y, TileFetch& fetch ) const
+{
+    const unsigned char* p = get_texel( level, x, y, fetch );
+    return Color3( byte_table.value[p[0]], byte_table.value[p[1]], byte_table.value[p[2]] );
+}
+
+/**
+ * Builds the mip map pyramid by averaging 2x2 blocks of texels, down to a
+ * single texel, and stores every level in tiles.
+ */
+void Texture::gen_mipmaps( const unsigned char* rgba, int w, int h )
+{
+    levels.clear();
+    tiles.reset();
+    texels = NULL;
+    cache_id = -1;
+    if ( !rgba || w <= 0 || h <= 0 )
+        return;
+
+    // lay out all levels at once
+    size_t total = 0;
+    for ( ;; ) {
+        MipLevel l;
+        l.width = w;
+        l.height = h;
+        l.tiles_x = ( w + TILE_MASK ) >> TILE_SHIFT;
+        l.mask_x = pow2_mask( w );
+        l.mask_y = pow2_mask( h );
+        l.first_tile = total;
+        total += l.tiles_x * ( ( h + TILE_MASK ) >> TILE_SHIFT );
+        levels.push_back( l );
+        if ( w == 1 && h == 1 )
+            break;
+        w = std::max( 1, w / 2 );
+        h = std::max( 1, h / 2 );
+    }
+    std::shared_ptr< TextureTiles > storage( new TextureTiles() );
+    storage->decoded.assign( total * TileCache::TILE_BYTES, 0 );
+    storage->num_tiles = total;
+    unsigned char* t = &storage->decoded[0];
+    storage->data = t;
+    numa_interleave( t, storage->decoded.size() );
+    tile_level( levels[0], rgba, t );
+
+    std::vector<unsigned char> prev, cur;
+    const unsigned char* s = rgba;
+    for ( size_t i = 1; i < levels.size(); i++ ) {
+        const MipLevel& src = levels[i - 1];
+        const MipLevel& dst = levels[i];
+        cur.resize( 4 * dst.width * dst.height );
+        unsigned char* d = &cur[0];
+
+        for ( int y = 0; y < dst.height; y++ ) {
+            int y0 = std::min( 2 * y, src.height - 1 );
+            int y1 = std::min( 2 * y + 1, src.height - 1 );
+            for ( int x = 0; x < dst.width; x++ ) {
+                int x0 = std::min( 2 * x, src.width - 1 );
+                int x1 = std::min( 2 * x + 1, src.width - 1 );
+                const unsigned char* p00 = s + 4 * ( x0 + y0 * src.width );
+                const unsigned char* p10 = s + 4 * ( x1 + y0 * src.width );
+                const unsigned char* p01 = s + 4 * ( x0 + y1 * src.width );
+                const unsigned char* p11 = s + 4 * ( x1 + y1 * src.width );
+                unsigned char* q = d + 4 * ( x + y * dst.width );
+                for ( int c = 0; c < 4; c++ ) {
+                    q[c] = (unsigned char)( ( p00[c] + p10[c] + p01[c] + p11[c] + 2 ) / 4 );
+                }
+            }
+        }
+
+        tile_level( dst, d, t );
+        prev.swap( cur );
+        s = &prev[0];
+    }
+
+    tiles = storage;
+    texels = t;
 }
 
 Color3 Texture::sample(real_t x, real_t y) const{
 	return sample(Vector2(x,y));
 }
-}
\ No newline at end of file
+}
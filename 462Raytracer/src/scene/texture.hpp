@@ -11,21 +11,56 @@
 #include "math/color.hpp"
 #include "math/vector.hpp"
 #include "application/opengl.hpp"
+#include "scene/natfile.hpp"
+#include <memory>
 #include <string>
+#include <vector>
 #include "application/imageio.hpp"
 
 namespace _462 {
+    // one level of a mip map pyramid, stored in tiles of 8x8 texels
+    struct MipLevel{
+        int width;
+        int height;
+        // number of tiles in a row of the level
+        int tiles_x;
+        // width - 1 and height - 1 for power of two sizes, otherwise -1
+        int mask_x;
+        int mask_y;
+        // index of the first tile of the level in the tile storage
+        size_t first_tile;
+    };
+
+    // the tiles of all levels of a texture, decoded into memory, mapped
+    // from its .nat file or moved to the tile cache
+    struct TextureTiles{
+        std::vector<unsigned char> decoded;
+        NatReader nat;
+        // NULL if the tiles are in the tile cache
+        const unsigned char* data;
+        size_t num_tiles;
+        // id of the tiles in the tile cache, freed with them; -1 if none
+        int cache_id;
+        TextureTiles();
+        ~TextureTiles();
+    };
+
     class Texture{
         public:
+        // texels along the side of a tile are 1 << TILE_SHIFT
+        static const int TILE_SHIFT = 3;
+        static const int TILE_MASK = ( 1 << TILE_SHIFT ) - 1;
+
         Texture(){
-            width=0;height=0;data=NULL;
+            width=0;height=0;texels=NULL;cache_id=-1;
         }
         std::string filename;
         int width;
         int height;
-        unsigned char * data;
-        /// returns the raw texture data
-        const unsigned char* get_texture_data() const;
+        // mip map pyramid, level 0 is the full size texture
+        std::vector<MipLevel> levels;
+        /// copies level 0 into 32-bit RGBA rows, returns false if there is no texture
+        bool get_texture_data( std::vector<unsigned char>& rgba ) const;
         
         /// puts the dimensions into width and height
         void get_texture_size( int* width, int* height ) const;
@@ -38,8 +73,38 @@ namespace _462 {
         Color3 get_texture_pixel( int x, int y ) const;
         Color3 sample(Vector2 coord) const;
 		Color3 sample(real_t x, real_t y) const;
+        /**
+         * Trilinear sample of the mip map pyramid. footprint is the width
+         * of the sampled area in texture coordinates, it picks the level.
+         */
+        Color3 sample(Vector2 coord, real_t footprint) const;
         bool load();
+        /// builds the tiled mip map pyramid from 32-bit RGBA rows
+        void gen_mipmaps( const unsigned char* rgba, int w, int h );
+
+        private:
+        // tiles of all levels, shared by copies of the texture
+        std::shared_ptr< const TextureTiles > tiles;
+        const unsigned char* texels;
+        // id of the texture in the tile cache, -1 if the tiles are in memory
+        int cache_id;
+        // the tile a lookup read last, so the texels of one tile in the
+        // tile cache fetch it once
+        struct TileFetch{
+            size_t tile;
+            const unsigned char* data;
+            TileFetch() : tile( ~size_t( 0 ) ), data( NULL ) { }
+        };
+        const unsigned char* get_texel( size_t level, int x, int y, TileFetch& fetch ) const;
+        Color3 get_level_pixel( size_t level, int x, int y, TileFetch& fetch ) const;
+        Color3 sample_level( size_t level, Vector2 coord ) const;
+        bool load_file( const NatKey& key );
+        bool load_nat( const NatKey& key );
+        void save_nat( const NatKey& key ) const;
+        void use_tile_cache();
     };
+
+    void texture_set_nat_cache( bool enabled );
 }
 
 #endif /*_462_SCENE_TEXTURE_HPP_*/
\ No newline at end of file
@@ -0,0 +1,242 @@
+/**
+* @file tilecache.cpp
+* @brief bounded memory cache of texture tiles
+*/
+
+#include "scene/tilecache.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+
+namespace _462{
+
+// tiles every thread keeps copies of, a power of two
+#define TILE_CACHE_LOCAL 64
+// least tiles of a shard, enough for the bilinear lookups of a few textures
+#define TILE_CACHE_MIN_SLOTS 8
+
+	// the tile of a texture, ids are never reused so keys are unique
+	static inline uint64_t tile_key(int id, size_t tile){
+		return (uint64_t(id) << 40) | uint64_t(tile);
+	}
+
+	static inline uint64_t tile_hash(uint64_t key){
+		return key * 0x9E3779B97F4A7C15ull;
+	}
+
+	// copies of the tiles a thread used last, direct mapped by the tile hash.
+	// Tiles never change once added, so the copies never go stale.
+	struct LocalTiles{
+		uint64_t keys[TILE_CACHE_LOCAL];
+		unsigned char data[TILE_CACHE_LOCAL * TileCache::TILE_BYTES];
+		LocalTiles(){
+			for (size_t i = 0; i < TILE_CACHE_LOCAL; i++) keys[i] = ~uint64_t(0);
+		}
+	};
+	static thread_local LocalTiles local_tiles;
+
+	TileCache::TileCache() : backing(NULL), backing_tiles(0) {
+		for (size_t i = 0; i < TILE_CACHE_SHARDS; i++){
+			shards[i].num_slots = 0;
+			shards[i].used_slots = 0;
+			shards[i].lookups = 0;
+			shards[i].misses = 0;
+		}
+	}
+
+	TileCache::~TileCache(){
+		if (backing) fclose(backing);
+	}
+
+	/**
+	* Set the memory budget of the cache. Has to be called before any texture
+	* is added, 0 disables the cache and keeps every texture in memory.
+	* Every thread that samples textures keeps TILE_CACHE_LOCAL more tiles.
+	* @param bytes Maximum bytes of tiles kept in memory.
+	*/
+	void TileCache::set_budget(size_t bytes){
+		std::lock_guard<std::mutex> file_guard(file_lock);
+		assert(textures.empty());
+		size_t num_slots = bytes / TILE_BYTES / TILE_CACHE_SHARDS;
+		if (bytes > 0 && num_slots < TILE_CACHE_MIN_SLOTS) num_slots = TILE_CACHE_MIN_SLOTS;
+		for (size_t i = 0; i < TILE_CACHE_SHARDS; i++){
+			Shard& shard = shards[i];
+			std::lock_guard<std::mutex> guard(shard.lock);
+			shard.num_slots = num_slots;
+			shard.used_slots = 0;
+			shard.slots.clear();
+			shard.lru.clear();
+			shard.resident.clear();
+		}
+	}
+
+	bool TileCache::enabled() const{
+		return shards[0].num_slots > 0;
+	}
+
+	// returns a run of tiles to the free runs, merged with its neighbors.
+	// A run at the end of the file shortens it instead.
+	static void free_extent(std::map<size_t, size_t>& free_tiles, size_t& backing_tiles,
+		size_t first, size_t count){
+		std::map<size_t, size_t>::iterator next = free_tiles.lower_bound(first);
+		if (next != free_tiles.end() && first + count == next->first){
+			count += next->second;
+			free_tiles.erase(next++);
+		}
+		if (next != free_tiles.begin()){
+			std::map<size_t, size_t>::iterator prev = next;
+			--prev;
+			if (prev->first + prev->second == first){
+				first = prev->first;
+				count += prev->second;
+				free_tiles.erase(prev);
+			}
+		}
+		if (first + count == backing_tiles){
+			backing_tiles = first;
+		}
+		else{
+			free_tiles[first] = count;
+		}
+	}
+
+	/**
+	* Move the tiles of a texture to the backing file, into the first run
+	* freed by a removed texture that fits them or else at its end.
+	* @param tiles The tiles, TILE_BYTES each.
+	* @param num_tiles Number of tiles.
+	* @return the id of the texture in the cache, -1 if it could not be stored.
+	*/
+	int TileCache::add(const unsigned char* tiles, size_t num_tiles){
+		std::lock_guard<std::mutex> guard(file_lock);
+		if (!backing){
+			backing = tmpfile();
+			if (!backing){
+				std::cerr << "Cannot create texture cache file" << std::endl;
+				return -1;
+			}
+		}
+
+		Extent extent = { backing_tiles, num_tiles };
+		std::map<size_t, size_t>::iterator it = free_tiles.begin();
+		while (it != free_tiles.end() && it->second < num_tiles) ++it;
+		if (it != free_tiles.end()){
+			extent.first = it->first;
+			if (it->second > num_tiles){
+				free_tiles[it->first + num_tiles] = it->second - num_tiles;
+			}
+			free_tiles.erase(it);
+		}
+		else{
+			backing_tiles += num_tiles;
+		}
+
+		if (fseek(backing, long(extent.first * TILE_BYTES), SEEK_SET) != 0
+			|| fwrite(tiles, TILE_BYTES, num_tiles, backing) != num_tiles){
+			std::cerr << "Cannot write texture cache file" << std::endl;
+			free_extent(free_tiles, backing_tiles, extent.first, extent.count);
+			return -1;
+		}
+		textures.push_back(extent);
+		return int(textures.size() - 1);
+	}
+
+	/**
+	* Frees the tiles of a texture in the backing file for later textures.
+	* Its tiles in memory are evicted as they fall out of use.
+	* @param id The id returned by add.
+	*/
+	void TileCache::remove(int id){
+		std::lock_guard<std::mutex> guard(file_lock);
+		if (id < 0 || size_t(id) >= textures.size() || textures[id].count == 0) return;
+		free_extent(free_tiles, backing_tiles, textures[id].first, textures[id].count);
+		textures[id].count = 0;
+	}
+
+	// reads a tile from the backing file, white if it can not be read
+	void TileCache::read_tile(uint64_t key, unsigned char* data){
+		std::lock_guard<std::mutex> guard(file_lock);
+		const Extent& extent = textures[size_t(key >> 40)];
+		size_t tile = size_t(key & ((uint64_t(1) << 40) - 1));
+		if (tile >= extent.count
+			|| fseek(backing, long((extent.first + tile) * TILE_BYTES), SEEK_SET) != 0
+			|| fread(data, TILE_BYTES, 1, backing) != 1){
+			memset(data, 255, TILE_BYTES);
+		}
+	}
+
+	/**
+	* Get one tile. The copy of the calling thread is used if it has one,
+	* otherwise the tile is copied from its shard, which loads it from the
+	* backing file on a miss and evicts its least recently used tile when
+	* full.
+	* @param id The id returned by add.
+	* @param tile Index of the tile within the texture.
+	* @return the TILE_BYTES of the tile, valid until the thread gets
+	*  another tile.
+	*/
+	const unsigned char* TileCache::get_tile(int id, size_t tile){
+		uint64_t key = tile_key(id, tile);
+		uint64_t hash = tile_hash(key);
+		size_t line = size_t(hash >> 48) & (TILE_CACHE_LOCAL - 1);
+		unsigned char* local = &local_tiles.data[line * TILE_BYTES];
+		if (local_tiles.keys[line] == key){
+			return local;
+		}
+
+		Shard& shard = shards[size_t(hash >> 56) & (TILE_CACHE_SHARDS - 1)];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		++shard.lookups;
+
+		std::unordered_map<uint64_t, std::list<std::pair<uint64_t, size_t> >::iterator>::iterator it = shard.resident.find(key);
+		if (it != shard.resident.end()){
+			// move to the front of the use order
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			memcpy(local, &shard.slots[it->second->second * TILE_BYTES], TILE_BYTES);
+		}
+		else{
+			++shard.misses;
+			size_t slot;
+			if (shard.used_slots < shard.num_slots){
+				slot = shard.used_slots++;
+				if (shard.slots.size() < shard.used_slots * TILE_BYTES){
+					shard.slots.resize(std::min(shard.num_slots, 2 * shard.used_slots) * TILE_BYTES);
+				}
+			}
+			else{
+				slot = shard.lru.back().second;
+				shard.resident.erase(shard.lru.back().first);
+				shard.lru.pop_back();
+			}
+
+			unsigned char* data = &shard.slots[slot * TILE_BYTES];
+			read_tile(key, data);
+			shard.lru.push_front(std::make_pair(key, slot));
+			shard.resident[key] = shard.lru.begin();
+			memcpy(local, data, TILE_BYTES);
+		}
+		local_tiles.keys[line] = key;
+		return local;
+	}
+
+	// tiles the threads did not have a copy of
+	size_t TileCache::num_lookups() const{
+		size_t lookups = 0;
+		for (size_t i = 0; i < TILE_CACHE_SHARDS; i++) lookups += shards[i].lookups;
+		return lookups;
+	}
+
+	// tiles read from the backing file
+	size_t TileCache::num_misses() const{
+		size_t misses = 0;
+		for (size_t i = 0; i < TILE_CACHE_SHARDS; i++) misses += shards[i].misses;
+		return misses;
+	}
+
+	TileCache& texture_tile_cache(){
+		static TileCache cache;
+		return cache;
+	}
+
+} /* _462 */
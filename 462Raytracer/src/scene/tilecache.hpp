@@ -0,0 +1,89 @@
+/**
+* @file tilecache.hpp
+* @brief bounded memory cache of texture tiles
+*
+* Texture tiles are moved to a backing file when the cache is enabled, and
+* only the most recently used tiles are kept in memory. Texture heavy scenes
+* stay within the budget at the cost of a file read on every miss.
+*
+* The tiles in memory are split into shards with a lock each, and every
+* thread keeps copies of the tiles it used last, so most lookups take no
+* lock at all.
+*/
+
+#ifndef _462_SCENE_TILECACHE_HPP_
+#define _462_SCENE_TILECACHE_HPP_
+
+#include <cstdio>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+namespace _462 {
+
+// shards of the tiles in memory, a power of two
+#define TILE_CACHE_SHARDS 16
+
+	class TileCache{
+	public:
+		// bytes of one tile, 8x8 texels of 32-bit RGBA
+		static const size_t TILE_BYTES = 256;
+
+		TileCache();
+		~TileCache();
+
+		void set_budget(size_t bytes);
+		bool enabled() const;
+
+		int add(const unsigned char* tiles, size_t num_tiles);
+		void remove(int id);
+		const unsigned char* get_tile(int id, size_t tile);
+
+		size_t num_lookups() const;
+		size_t num_misses() const;
+	private:
+		// a part of the tiles in memory, picked by the hash of the tile
+		struct Shard{
+			std::mutex lock;
+			// memory slots, each holds one tile
+			std::vector<unsigned char> slots;
+			size_t num_slots;
+			size_t used_slots;
+			// tiles in use order, the most recent at the front
+			std::list<std::pair<uint64_t, size_t> > lru;
+			// tile key -> its entry in the lru list
+			std::unordered_map<uint64_t, std::list<std::pair<uint64_t, size_t> >::iterator> resident;
+			size_t lookups;
+			size_t misses;
+		};
+		Shard shards[TILE_CACHE_SHARDS];
+
+		// a run of tiles in the backing file
+		struct Extent{
+			size_t first;
+			size_t count;
+		};
+
+		// backing file of all tiles, the tiles of every texture, and the
+		// runs of tiles freed by removed textures, by their first tile
+		std::mutex file_lock;
+		FILE* backing;
+		size_t backing_tiles;
+		std::vector<Extent> textures;
+		std::map<size_t, size_t> free_tiles;
+
+		void read_tile(uint64_t key, unsigned char* data);
+
+		TileCache(const TileCache&);
+		TileCache& operator=(const TileCache&);
+	};
+
+	// the cache shared by all textures
+	TileCache& texture_tile_cache();
+
+} /* _462 */
+
+#endif /* _462_SCENE_TILECACHE_HPP_ */
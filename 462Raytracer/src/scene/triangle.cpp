@@ -8,6 +8,7 @@
 #include "scene/triangle.hpp"
 #include "application/opengl.hpp"
 #include "math/math.hpp"
+#include "math/simd.hpp"
 
 namespace _462 {
 
@@ -16,6 +17,7 @@ Triangle::Triangle()
     vertices[0].material = 0;
     vertices[1].material = 0;
     vertices[2].material = 0;
+    tex_scale = 0;
     isBig=true;
 }
 
@@ -31,10 +33,15 @@ bool Triangle::initialize(){
 
 void Triangle::gen_bound_box(){
 	//set bound box;
-	Vector3 upper = mat.transform_point(vertices[0].position);
+	Vector3 world[3];
+	for (size_t i = 0; i < 3; ++i){
+		world[i] = mat.transform_point(vertices[i].position);
+	}
+
+	Vector3 upper = world[0];
 	Vector3 lower = upper;
 	for (size_t i = 1; i < 3; ++i){
-		Vector3 pos = mat.transform_point(vertices[i].position);
+		const Vector3& pos = world[i];
 		if (pos.x < lower.x) lower.x = pos.x;
 		if (pos.y < lower.y) lower.y = pos.y;
 		if (pos.z < lower.z) lower.z = pos.z;
@@ -53,6 +60,13 @@ void Triangle::gen_bound_box(){
 	if (lower.z == upper.z) upper.z += EPS;
 
 	box = Bound(lower, upper);
+
+	// ratio of the texture area to the world area of the triangle
+	Vector2 t1 = vertices[1].tex_coord - vertices[0].tex_coord;
+	Vector2 t2 = vertices[2].tex_coord - vertices[0].tex_coord;
+	real_t tex_area = std::fabs(t1.x * t2.y - t1.y * t2.x);
+	real_t world_area = length(cross(world[1] - world[0], world[2] - world[0]));
+	tex_scale = world_area > 0 ? std::sqrt(tex_area / world_area) : 0;
 }
 
 void Triangle::render() const
@@ -65,6 +79,7 @@ void Triangle::render() const
     if ( materials_nonnull )
         vertices[0].material->set_gl_state();
 
+#ifndef _462_HEADLESS
     glBegin(GL_TRIANGLES);
 
 #if REAL_FLOAT
@@ -94,45 +109,58 @@ void Triangle::render() const
 #endif
 
     glEnd();
+#endif
 
     if ( materials_nonnull )
         vertices[0].material->reset_gl_state();
 }
 
 
-bool Triangle::intersect_test(const Ray& r, real_t& t, Intersection& info){
-
+bool Triangle::intersect_test(const Ray& r, HitRecord& rec){
 	Ray local_r = to_local(r);
-    t = -1;
-	if (solve_raytri(local_r, vertices[0].position, vertices[1].position, vertices[2].position, t)){
-		Vector3 local_pos = local_r.atTime(t);
-
-		real_t a, b, c;
-
-		barycentric_coor(local_pos, vertices[0].position, vertices[1].position, vertices[2].position, a, b, c);
-		// compute intersection material info based on barycentric coordinate
-		info.ambient = vertices[0].material->ambient * a + vertices[1].material->ambient * b + vertices[1].material->ambient * c;
-		info.diffuse = vertices[0].material->diffuse * a + vertices[1].material->diffuse * b + vertices[1].material->diffuse * c;
-		info.specular = vertices[0].material->specular * a + vertices[1].material->specular * b + vertices[1].material->specular * c;
-		info.shininess = vertices[0].material->shininess * a + vertices[1].material->shininess * b + vertices[1].material->shininess * c;
-		info.position = mat.transform_point(local_pos);
-		info.normal = vertices[0].normal * a + vertices[1].normal * b + vertices[2].normal * c;
-		info.normal = normalize(normMat * info.normal);
-		info.refractive_index = vertices[0].material->refractive_index * a
-			+ vertices[1].material->refractive_index * b
-			+ vertices[2].material->refractive_index * c;
-		//get the texture coordinate
-		Vector2 tex_coord = vertices[0].tex_coord * a + vertices[1].tex_coord * b + vertices[2].tex_coord * c;
-		//interpolate texture color
-		Color3 c0 = vertices[0].material->texture.sample(tex_coord);
-		Color3 c1 = vertices[1].material->texture.sample(tex_coord);
-		Color3 c2 = vertices[2].material->texture.sample(tex_coord);
-		info.tex_Color = c0 * a + c1 * b + c2 * c;
+	real_t t, beta, gamma;
+	if (solve_raytri(local_r, vertices[0].position, vertices[1].position, vertices[2].position, t, beta, gamma)
+		&& t < rec.t){
+		rec.geometry = this;
+		rec.t = t;
+		rec.u = beta;
+		rec.v = gamma;
 		return true;
 	}
 	return false;
 }
 
+void Triangle::shade(const Ray& r, const HitRecord& rec, Intersection& info) const{
+	// barycentric coordinate of the hit point
+	real_t b = rec.u;
+	real_t c = rec.v;
+	real_t a = real_t(1) - b - c;
+
+	// compute intersection material info based on barycentric coordinate
+	const Material* m0 = vertices[0].material;
+	const Material* m1 = vertices[1].material;
+	const Material* m2 = vertices[2].material;
+	info.ambient = m0->ambient * a + m1->ambient * b + m2->ambient * c;
+	info.diffuse = m0->diffuse * a + m1->diffuse * b + m2->diffuse * c;
+	info.specular = m0->specular * a + m1->specular * b + m2->specular * c;
+	info.shininess = m0->shininess * a + m1->shininess * b + m2->shininess * c;
+	info.refractive_index = m0->refractive_index * a + m1->refractive_index * b + m2->refractive_index * c;
+	// local ray keeps the same t, so the world hit point is on the world ray
+	info.position = r.atTime(rec.t);
+	info.normal = vertices[0].normal * a + vertices[1].normal * b + vertices[2].normal * c;
+	info.normal = normalize(normMat * info.normal);
+	//get the texture coordinate
+	Vector2 tex_coord = vertices[0].tex_coord * a + vertices[1].tex_coord * b + vertices[2].tex_coord * c;
+	//width of the ray cone on the texture, grows at grazing angles
+	real_t cos_d = std::max(std::fabs(info.normal * r.d) / length(r.d), real_t(0.1));
+	real_t footprint = r.width_at(rec.t) * tex_scale / cos_d;
+	//interpolate texture color, a shared material is only sampled once
+	Color3 c0 = m0->texture.sample(tex_coord, footprint);
+	Color3 c1 = m1 == m0 ? c0 : m1->texture.sample(tex_coord, footprint);
+	Color3 c2 = m2 == m0 ? c0 : (m2 == m1 ? c1 : m2->texture.sample(tex_coord, footprint));
+	info.tex_Color = c0 * a + c1 * b + c2 * c;
+}
+
 bool Triangle::shadow_test(const Ray& r,real_t dis){
 	if (!box.intersects(r)){
 		return false;
@@ -145,34 +173,36 @@ bool Triangle::shadow_test(const Ray& r,real_t dis){
 
 
 bool solve_raytri(const Ray& r, const Vector3& v1, const Vector3& v2, const Vector3& v3, real_t& t){
-	//initial linear solution matrix variable
-	real_t a = v1.x - v2.x;
-	real_t b = v1.y - v2.y;
-	real_t c = v1.z - v2.z;
-	real_t d = v1.x - v3.x;
-	real_t e = v1.y - v3.y;
-	real_t f = v1.z - v3.z;
-	real_t g = r.d.x;
-	real_t h = r.d.y;
-	real_t i = r.d.z;
-	real_t j = v1.x - r.e.x;
-	real_t k = v1.y - r.e.y;
-	real_t l = v1.z - r.e.z;
-
-	real_t M = a * (e * i - h * f) + b * (g * f - d * i) + c * (d * h - e * g);
+	real_t beta, gamma;
+	return solve_raytri(r, v1, v2, v3, t, beta, gamma);
+}
+
+//solve the ray triangle linear function, also returns the barycentric
+//weights of v2 (beta) and v3 (gamma) at the hit point. Cramer's rule,
+//with the determinants written as triple products of the edges.
+bool solve_raytri(const Ray& r, const Vector3& v1, const Vector3& v2, const Vector3& v3, real_t& t, real_t& beta, real_t& gamma){
+	Vec4f p1 = Vec4f::load3(v1);
+	Vec4f e1 = p1 - Vec4f::load3(v2);
+	Vec4f e2 = p1 - Vec4f::load3(v3);
+	Vec4f d = Vec4f::load3(r.d);
+	Vec4f s = p1 - Vec4f::load3(r.e);
+	Vec4f p = cross3(e2, d);
+	Vec4f q = cross3(e1, s);
+
+	real_t M = dot3(e1, p);
     if(M >=0 && M < EPS) return false;
 	M = ec_reciprocal(M);
 	//compute t
-	t = (f * (a * k - j * b) + e * (j * c - a * l) + d * (b * l - k * c)) * M * -1;
+	t = dot3(e2, q) * M * -1;
 	if (t < EPS) return false;
 
 	//compute gamma
-	real_t _gamma = (i * (a * k - j * b) + h * (j * c - a * l) + g * (b * l - k * c)) * M;
-	if (_gamma < 0 || _gamma > 1) return false;
+	gamma = dot3(d, q) * M;
+	if (gamma < 0 || gamma > 1) return false;
 
 	//compute beta
-	real_t _beta = (j * (e * i - h * f) + k *(g * f - d * i) + l * (d * h - e * g)) * M;
-	if (_beta < 0 || _beta > 1 - _gamma) return false;
+	beta = dot3(s, p) * M;
+	if (beta < 0 || beta > 1 - gamma) return false;
 
 	return true;
 }
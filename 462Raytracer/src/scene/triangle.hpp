@@ -17,6 +17,7 @@ namespace _462 {
 void barycentric_coor(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c, real_t &u, real_t &v, real_t &w);
     //solve the ray triangle linear function
 bool solve_raytri(const Ray& r, const Vector3& at, const Vector3& bt, const Vector3& ct, real_t& t);
+bool solve_raytri(const Ray& r, const Vector3& at, const Vector3& bt, const Vector3& ct, real_t& t, real_t& beta, real_t& gamma);
     
 /**
  * a triangle geometry.
@@ -42,11 +43,15 @@ public:
     // the triangle's vertices, in CCW order
     Vertex vertices[3];
 
+    // texture coordinate units per world unit, used to pick mip levels
+    real_t tex_scale;
+
     Triangle();
     virtual ~Triangle();
 	virtual bool initialize();
     virtual void render() const;
-	virtual bool intersect_test(const Ray& r, real_t& t, Intersection& info);
+	virtual bool intersect_test(const Ray& r, HitRecord& rec);
+	virtual void shade(const Ray& r, const HitRecord& rec, Intersection& info) const;
 	virtual bool shadow_test(const Ray &r, real_t dis);
 	void gen_bound_box();
 };